@@ -17,6 +17,21 @@
  *          SDA     I2C3_SDA        PB4
  *          SCL     I2C4_SCL        PF14
  *          SDA     I2C4_SDA        PF15
+ *          IN/TRIG Motor 1 trigger     PE7
+ *          IN/TRIG Motor 2 trigger     PE8
+ *          IN/TRIG Motor 3 trigger     PE9
+ *          IN/TRIG Motor 4 trigger     PE10
+ *
+ *          Every motor sits alone on its own bus and owns a queue of register commands that
+ *          are sent one at a time with interrupt transfers, so queueing a cue from an
+ *          interrupt only copies a few bytes. The event and error interrupts of I2C1 to I2C4
+ *          have to be enabled in CubeMX so stm32l4xx_it.c forwards them to the HAL. The
+ *          blocking register functions are only meant for setup, before anything is queued.
+ *
+ *          With DRV2605_TRIGGER_GPIO the motors run in edge trigger mode and a GO raises
+ *          the IN/TRIG line of the motor instead of writing the GO register, so I2C is only
+ *          used when a pattern is loaded. The lines share one port and a group of motors is
+ *          fired by a single BSRR write.
  *
  * @author  Miles Hanbury (mhanbury)
  * @author  James Kelly (jkellymi)
@@ -25,13 +40,100 @@
 
 #include "Adafruit_DRV2605.h"
 
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef struct DRV2605_COMMAND_STRUCT
+{
+    uint8_t reg;
+    uint8_t data;                                                                                   // data to write, or the value read
+    uint8_t flags;                                                                                  // DRV2605_COMMAND_*
+} drv2605_command_t;
+
+typedef struct DRV2605_QUEUE_STRUCT
+{
+    drv2605_command_t command[DRV2605_QUEUE_DEPTH];
+    volatile uint8_t  head;                                                                         // next free slot, free running
+    volatile uint8_t  tail;                                                                         // oldest command, the one on the bus
+    volatile uint8_t  busy;                                                                         // the oldest command is being transferred
+    volatile uint32_t start;                                                                        // tick the oldest command reached the front
+    uint8_t           seq[DRV2605_SEQ_SLOTS];                                                       // shadow of WAVESEQ1 .. WAVESEQ8
+    uint8_t           seq_known;                                                                    // slots whose shadow matches the device
+    uint8_t           rtp;                                                                          // shadow of RTPIN, last amplitude queued
+    uint8_t           rtp_known;                                                                    // the shadow matches the device once the queue drains
+    uint8_t           rtp_queued;                                                                   // an RTPIN write is still in the queue
+    uint8_t           rtp_at;                                                                       // queue position of that write
+} drv2605_queue_t;
+
 /* ------------------------------------- Global Variables -------------------------------------- */
 extern I2C_HandleTypeDef* DRV2605_HI2C_INST1;
 extern I2C_HandleTypeDef* DRV2605_HI2C_INST2;
 extern I2C_HandleTypeDef* DRV2605_HI2C_INST3;
 extern I2C_HandleTypeDef* DRV2605_HI2C_INST4;
 
+static drv2605_queue_t queue[DRV2605_MOTORS];
+static volatile uint32_t dropped;                                                                   // commands lost to a full queue or a bus error
+static volatile uint8_t  sync_group;                                                                // motors of the DRV2605_GoSync group still to start
+static volatile uint8_t  sync_ready;                                                                // group motors whose GO is at the front
+static volatile uint32_t sync_start;                                                                // tick the group was queued
+static volatile uint8_t  skew_group;                                                                // motors of the last started group
+static volatile uint8_t  skew_landed;                                                               // group motors whose GO has landed
+static uint32_t          skew_first;                                                                // cycle count of the first GO that landed
+static volatile uint32_t skew_cycles;                                                               // landing skew of the last complete group
+static volatile uint16_t trig_raised;                                                               // trigger lines still high
+static volatile uint8_t  held;                                                                      // DRV2605_Hold keeps new transfers off the buses
+static drv2605_calibration_t CALIBRATION;                                                           // results restored or measured, calibrated = 0 if none
+static drv2605_health_t health;                                                                     // background check results
+static uint8_t           health_motor;                                                              // next motor to check
+static uint32_t          health_tick;                                                               // tick of the last check
+static const uint16_t    TRIG_PIN[DRV2605_MOTORS] = {DRV2605_TRIG_PIN1, DRV2605_TRIG_PIN2,
+                                                     DRV2605_TRIG_PIN3, DRV2605_TRIG_PIN4};
+
+#define DRV2605_SETUP_LENGTH    (DRV2605_REG_CONTROL3 - DRV2605_REG_MODE + 1)                       // MODE .. CONTROL3, 29 registers
+
+static const uint8_t SETUP[DRV2605_SETUP_LENGTH] =                                                  // register image DRV2605_Begin writes in one burst
+{
+    DRV2605_MODE_PLAY, 0x00, 0x01,                                                                  // MODE out of standby, RTPIN, LIBRARY 1 (ERM)
+    DRV2605_EFFECT_STRONG_CLICK, DRV2605_EFFECT_END, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,            // WAVESEQ1 .. WAVESEQ8
+    0x00,                                                                                           // GO
+    0x00, 0x00, 0x00, 0x00,                                                                         // no overdrive, sustain or brake offsets
+    0x05, 0x19, 0x64, 0x19, 0xFF,                                                                   // AUDIOCTRL .. AUDIOOUTMAX, reset values but AUDIOMAX
+    0x3E, 0x8C, 0x0C, 0x6C,                                                                         // RATEDV .. AUTOCALEMP, reset values
+    DRV2605_FEEDBACK_ERM, 0x93, 0xF5, 0xA0                                                          // FEEDBACK, CONTROL1 .. CONTROL3, ERM open loop
+};
+
 /* --------------------------------- Function Implementations ---------------------------------- */
+/*!
+ * @brief   motor queue of an I2C instance
+ * @return  int     motor index, -1 if the instance drives no motor
+ */
+static int DRV2605_Motor(I2C_HandleTypeDef* DRV2605_HI2C_INST)
+{
+    if (DRV2605_HI2C_INST == NULL) return -1;
+    if (DRV2605_HI2C_INST == DRV2605_HI2C_INST1) return 0;
+    if (DRV2605_HI2C_INST == DRV2605_HI2C_INST2) return 1;
+    if (DRV2605_HI2C_INST == DRV2605_HI2C_INST3) return 2;
+    if (DRV2605_HI2C_INST == DRV2605_HI2C_INST4) return 3;
+    return -1;
+}
+
+/*!
+ * @brief   updates the WAVESEQ and RTPIN shadow of a motor after a write to one of its registers
+ * @param   known   1 if the device now holds data, 0 if the write may not have landed
+ */
+static void DRV2605_Shadow(int motor, uint8_t reg, uint8_t data, int known)
+{
+    if (motor >= 0 && reg == DRV2605_REG_RTPIN)
+    {
+        queue[motor].rtp = data;
+        queue[motor].rtp_known = (uint8_t)known;
+    }
+    if (motor < 0 || reg < DRV2605_REG_WAVESEQ1 || reg > DRV2605_REG_WAVESEQ8) return;
+
+    uint8_t slot = reg - DRV2605_REG_WAVESEQ1;
+    queue[motor].seq[slot] = data;
+    if (known) queue[motor].seq_known |= 1u << slot;
+    else queue[motor].seq_known &= ~(1u << slot);
+}
+
 /*!
  * @brief   accesses 8-bit register and returns its contents
  * @param   DRV2605_HI2C_INST   motor I2C instance
@@ -41,8 +143,9 @@ extern I2C_HandleTypeDef* DRV2605_HI2C_INST4;
 uint8_t DRV2605_ReadRegister(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t reg)
 {
     uint8_t buffer[1];
+    buffer[0] = 0;
     HAL_I2C_Mem_Read(DRV2605_HI2C_INST, DRV2605_ADDR_R, reg, I2C_MEMADD_SIZE_8BIT,
-        (uint8_t*)buffer, 1, HAL_MAX_DELAY);
+        (uint8_t*)buffer, 1, DRV2605_TIMEOUT);
     return buffer[0];
 }
 
@@ -55,54 +158,760 @@ uint8_t DRV2605_ReadRegister(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t reg)
 void DRV2605_WriteRegister(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t reg, uint8_t data)
 {
     uint8_t buffer[2] = {reg, data};
-    HAL_I2C_Master_Transmit(DRV2605_HI2C_INST, DRV2605_ADDR_W, buffer, 2, HAL_MAX_DELAY);
+    HAL_StatusTypeDef status =
+        HAL_I2C_Master_Transmit(DRV2605_HI2C_INST, DRV2605_ADDR_W, buffer, 2, DRV2605_TIMEOUT);
+    DRV2605_Shadow(DRV2605_Motor(DRV2605_HI2C_INST), reg, data, status == HAL_OK);
+}
+
+/*!
+ * @brief   writes consecutive 8-bit registers in one transfer
+ * @param   DRV2605_HI2C_INST   motor I2C instance
+ * @param   reg                 first register to write
+ * @param   data                register values, in address order
+ * @param   count               number of registers
+ * @return  HAL_StatusTypeDef   result of the transfer
+ * @note    the device increments the register address after every byte
+ */
+static HAL_StatusTypeDef DRV2605_WriteBurst(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t reg,
+    uint8_t* data, uint8_t count)
+{
+    HAL_StatusTypeDef status = HAL_I2C_Mem_Write(DRV2605_HI2C_INST, DRV2605_ADDR_W, reg,
+        I2C_MEMADD_SIZE_8BIT, data, count, DRV2605_TIMEOUT);
+    for (uint8_t i = 0; i < count; i++)
+        DRV2605_Shadow(DRV2605_Motor(DRV2605_HI2C_INST), reg + i, data[i], status == HAL_OK);
+    return status;
+}
+
+/*!
+ * @brief   I2C instance of a motor queue
+ */
+static I2C_HandleTypeDef* DRV2605_Instance(int motor)
+{
+    I2C_HandleTypeDef* instances[DRV2605_MOTORS] = {DRV2605_HI2C_INST1, DRV2605_HI2C_INST2,
+                                                    DRV2605_HI2C_INST3, DRV2605_HI2C_INST4};
+    return instances[motor];
+}
+
+/*!
+ * @brief   writes a range of registers of every motor at once
+ * @param   reg                 first register of the range
+ * @param   data                register values of each motor, in address order
+ * @param   count               number of registers
+ * @return  HAL_StatusTypeDef   HAL_ERROR if a motor did not take its range
+ * @note    every bus runs its own interrupt transfer, so all four take as long as one.
+ *          Nothing may be queued yet, the completions are ignored by DRV2605_Finish.
+ */
+static HAL_StatusTypeDef DRV2605_WriteAll(uint8_t reg, uint8_t data[][DRV2605_SETUP_LENGTH],
+    uint8_t count)
+{
+    HAL_StatusTypeDef status = HAL_OK;
+    uint8_t running = 0;
+
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+        if (HAL_I2C_Mem_Write_IT(DRV2605_Instance(motor), DRV2605_ADDR_W, reg,
+                I2C_MEMADD_SIZE_8BIT, data[motor], count) == HAL_OK)
+            running |= 1u << motor;
+
+    uint32_t start = HAL_GetTick();
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+    {
+        I2C_HandleTypeDef* hi2c = DRV2605_Instance(motor);
+        while ((running & (1u << motor)) && hi2c->State != HAL_I2C_STATE_READY &&
+               HAL_GetTick() - start < DRV2605_TIMEOUT);
+
+        int written = (running & (1u << motor)) && hi2c->State == HAL_I2C_STATE_READY &&
+                      hi2c->ErrorCode == HAL_I2C_ERROR_NONE;
+        if (!written)
+        {
+            if (hi2c->State != HAL_I2C_STATE_READY)                                                 // stuck, same recovery as DRV2605_Poll
+            {
+                HAL_I2C_DeInit(hi2c);
+                HAL_I2C_Init(hi2c);
+            }
+            status = HAL_ERROR;
+        }
+        for (uint8_t i = 0; i < count; i++)
+            DRV2605_Shadow(motor, reg + i, data[motor][i], written);
+    }
+    return status;
+}
+
+/*!
+ * @brief   appends a command, the caller holds interrupts off and has checked for room
+ */
+static void DRV2605_Push(drv2605_queue_t* q, uint8_t reg, uint8_t data, uint8_t flags)
+{
+    drv2605_command_t* command = &q->command[q->head & (DRV2605_QUEUE_DEPTH - 1)];
+
+    if (q->head == q->tail) q->start = HAL_GetTick();                                               // becomes the oldest command
+    command->reg = reg;
+    command->data = data;
+    command->flags = (flags & DRV2605_COMMAND_READ) ? (flags | DRV2605_COMMAND_NOTIFY) : flags;
+    q->head++;
+}
+
+/*!
+ * @brief   records the answer to a health check read, the caller holds interrupts off
+ * @param   motor       motor index
+ * @param   command     retired read command, data holds the value read
+ * @param   status      result of the read
+ */
+static void DRV2605_Health(int motor, drv2605_command_t command, HAL_StatusTypeDef status)
+{
+    uint8_t bit = 1u << motor;
+
+    if (status != HAL_OK)
+    {
+        if (command.reg == DRV2605_REG_STATUS && health.misses[motor] < UINT8_MAX)                  // one miss per check
+            health.misses[motor]++;
+    }
+    else if (command.reg == DRV2605_REG_STATUS)
+    {
+        health.status[motor] = command.data;
+        health.sampled |= bit;
+        health.misses[motor] = 0;
+    }
+    else if (command.reg == DRV2605_REG_VBAT) health.vbat[motor] = command.data;
+
+    uint8_t id = DRV2605_STATUS_ID(health.status[motor]);
+    int failed = health.misses[motor] >= DRV2605_HEALTH_MISSES ||
+        ((health.sampled & bit) && ((id != DRV2605_ID_DRV2605 && id != DRV2605_ID_DRV2605L) ||
+        (health.status[motor] & (DRV2605_STATUS_OVER_TEMP | DRV2605_STATUS_OC_DETECT))));
+    health.failed = failed ? (health.failed | bit) : (health.failed & ~bit);
+    if (motor == DRV2605_MOTORS - 1 && command.reg == DRV2605_REG_VBAT) health.rounds++;            // last read of a round
+}
+
+/*!
+ * @brief   retires the oldest command, the caller holds interrupts off
+ * @return  drv2605_command_t   copy of the retired command
+ */
+static drv2605_command_t DRV2605_Pop(drv2605_queue_t* q, HAL_StatusTypeDef status)
+{
+    drv2605_command_t command = q->command[q->tail & (DRV2605_QUEUE_DEPTH - 1)];
+
+    if (q->rtp_queued && q->rtp_at == q->tail) q->rtp_queued = 0;
+    q->busy = 0;
+    q->tail++;
+    q->start = HAL_GetTick();
+    if (status != HAL_OK && !(command.flags & DRV2605_COMMAND_READ))
+        DRV2605_Shadow(q - queue, command.reg, command.data, 0);                                    // may or may not have landed
+    if (status != HAL_OK) dropped++;
+    if ((command.flags & DRV2605_COMMAND_READ) &&
+        (command.reg == DRV2605_REG_STATUS || command.reg == DRV2605_REG_VBAT))
+        DRV2605_Health(q - queue, command, status);
+    return command;
+}
+
+/*!
+ * @brief   starts the interrupt transfer of the oldest command of a queue
+ */
+static HAL_StatusTypeDef DRV2605_Transfer(int motor)
+{
+    drv2605_queue_t* q = &queue[motor];
+    I2C_HandleTypeDef* hi2c = DRV2605_Instance(motor);
+    drv2605_command_t* command = &q->command[q->tail & (DRV2605_QUEUE_DEPTH - 1)];
+
+    HAL_StatusTypeDef status = (command->flags & DRV2605_COMMAND_READ) ?
+        HAL_I2C_Mem_Read_IT(hi2c, DRV2605_ADDR_R, command->reg, I2C_MEMADD_SIZE_8BIT,
+            &command->data, 1) :
+        HAL_I2C_Mem_Write_IT(hi2c, DRV2605_ADDR_W, command->reg, I2C_MEMADD_SIZE_8BIT,
+            &command->data, 1);
+
+    if (status == HAL_OK)
+    {
+        q->busy = 1;
+        q->start = HAL_GetTick();
+    }
+    return status;
+}
+
+/*!
+ * @brief   records a GO of the started group landing on its motor
+ * @note    the caller holds interrupts off, a GO that failed leaves the measurement
+ */
+static void DRV2605_Land(int motor, HAL_StatusTypeDef status, uint32_t cycles)
+{
+    if (status != HAL_OK) skew_group &= ~(1u << motor);
+    else
+    {
+        if (skew_landed == 0) skew_first = cycles;
+        skew_landed |= 1u << motor;
+        if (skew_landed == skew_group) skew_cycles = cycles - skew_first;
+    }
+    if (skew_landed != 0 && skew_landed == skew_group) skew_group = 0;                              // measured, ignore late GOs
+}
+
+/*!
+ * @brief   raises trigger lines with one write, the caller holds interrupts off
+ * @note    a line DRV2605_Poll has not lowered since the last cue is dropped first, which
+ *          only leaves it low for a couple of cycles
+ */
+static void DRV2605_Trigger(uint16_t pins)
+{
+    if (trig_raised & pins) DRV2605_TRIG_PORT->BRR = trig_raised & pins;
+    DRV2605_TRIG_PORT->BSRR = pins;
+    trig_raised |= pins;
+}
+
+/*!
+ * @brief   retires the trigger GO at the front of a queue once its line has been raised
+ * @note    the caller holds interrupts off
+ */
+static void DRV2605_Fired(int motor)
+{
+    uint32_t now = DWT->CYCCNT;
+    drv2605_command_t command = DRV2605_Pop(&queue[motor], HAL_OK);
+
+    if ((command.flags & DRV2605_COMMAND_SYNC) && (skew_group & (1u << motor)))
+        DRV2605_Land(motor, HAL_OK, now);
+    if (command.flags & DRV2605_COMMAND_NOTIFY)
+        DRV2605_CommandCpltCallback(DRV2605_Instance(motor), command.reg, command.data, HAL_OK);
+}
+
+/*!
+ * @brief   starts the GO of every motor of the waiting group back to back
+ * @return  uint8_t     motors of the group
+ * @note    the caller holds interrupts off. A motor whose bus refuses is left to start on
+ *          its own and is not counted in the skew.
+ */
+static uint8_t DRV2605_StartGroup(void)
+{
+    uint8_t group = sync_group;
+
+    sync_group = 0;
+    sync_ready = 0;
+    skew_group = 0;
+    skew_landed = 0;
+
+    if (DRV2605_TRIGGER == DRV2605_TRIGGER_GPIO)
+    {
+        uint16_t pins = 0;
+        for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+            if (group & (1u << motor)) pins |= TRIG_PIN[motor];
+        DRV2605_Trigger(pins);                                                                      // every motor on the same store
+        skew_cycles = 0;
+        for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+            if (group & (1u << motor)) DRV2605_Fired(motor);
+        return group;
+    }
+
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+        if ((group & (1u << motor)) && DRV2605_Transfer(motor) == HAL_OK)
+            skew_group |= 1u << motor;
+    return group;
+}
+
+/*!
+ * @brief   hands the oldest command of a queue to the bus if the bus is free
+ * @note    the caller holds interrupts off. A bus that stays HAL_BUSY is left to
+ *          DRV2605_Poll, commands the HAL refuses outright are dropped and reported.
+ */
+static void DRV2605_Start(int motor)
+{
+    drv2605_queue_t* q = &queue[motor];
+    I2C_HandleTypeDef* hi2c = DRV2605_Instance(motor);
+
+    if (held) return;                                                                               // started again by DRV2605_Hold
+    while (!q->busy && q->tail != q->head)
+    {
+        drv2605_command_t* command = &q->command[q->tail & (DRV2605_QUEUE_DEPTH - 1)];
+        if ((command->flags & DRV2605_COMMAND_SYNC) && (sync_group & (1u << motor)))
+        {
+            sync_ready |= 1u << motor;
+            if (sync_ready != sync_group) return;                                                   // the last motor to get ready starts the group
+            uint8_t group = DRV2605_StartGroup();
+            for (int other = 0; other < DRV2605_MOTORS; other++)                                    // commands queued behind a fired GO
+                if (other != motor && (group & (1u << other))) DRV2605_Start(other);
+            continue;
+        }
+        if (command->flags & DRV2605_COMMAND_TRIGGER)
+        {
+            DRV2605_Trigger(TRIG_PIN[motor]);
+            DRV2605_Fired(motor);
+            continue;
+        }
+
+        HAL_StatusTypeDef status = DRV2605_Transfer(motor);
+        if (status == HAL_OK) continue;
+        else if (status == HAL_BUSY) return;                                                        // retried from DRV2605_Poll
+        else
+        {
+            drv2605_command_t failed = DRV2605_Pop(q, status);
+            DRV2605_CommandCpltCallback(hi2c, failed.reg, failed.data, status);
+        }
+    }
+}
+
+/*!
+ * @brief   retires the command on the bus of an instance and starts the next one
+ * @note    called from the I2C interrupt
+ */
+static void DRV2605_Finish(I2C_HandleTypeDef* DRV2605_HI2C_INST, HAL_StatusTypeDef status)
+{
+    uint32_t now = DWT->CYCCNT;                                                                     // the register has just been written
+    int motor = DRV2605_Motor(DRV2605_HI2C_INST);
+    if (motor < 0) return;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();                                                                                // a cue may be queued from a higher priority interrupt
+    if (!queue[motor].busy)
+    {
+        __set_PRIMASK(primask);
+        return;                                                                                     // late interrupt of a transfer DRV2605_Poll gave up on
+    }
+    drv2605_command_t command = DRV2605_Pop(&queue[motor], status);
+    if ((command.flags & DRV2605_COMMAND_SYNC) && (skew_group & (1u << motor)))
+        DRV2605_Land(motor, status, now);
+    __set_PRIMASK(primask);
+
+    if (status != HAL_OK || (command.flags & DRV2605_COMMAND_NOTIFY))
+        DRV2605_CommandCpltCallback(DRV2605_HI2C_INST, command.reg, command.data, status);
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    DRV2605_Start(motor);
+    __set_PRIMASK(primask);
+}
+
+/*!
+ * @brief   queues one register access on a motor and starts its bus if it is idle
+ * @param   DRV2605_HI2C_INST   motor I2C instance
+ * @param   reg                 register to access
+ * @param   data                data to write, ignored for reads
+ * @param   flags               DRV2605_COMMAND_READ, DRV2605_COMMAND_NOTIFY
+ * @return  HAL_StatusTypeDef   HAL_BUSY if the queue is full, HAL_ERROR for an unknown bus
+ */
+HAL_StatusTypeDef DRV2605_Queue(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t reg, uint8_t data,
+    uint8_t flags)
+{
+    int motor = DRV2605_Motor(DRV2605_HI2C_INST);
+    if (motor < 0) return HAL_ERROR;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if ((uint8_t)(queue[motor].head - queue[motor].tail) >= DRV2605_QUEUE_DEPTH)
+    {
+        dropped++;
+        __set_PRIMASK(primask);
+        return HAL_BUSY;
+    }
+    DRV2605_Push(&queue[motor], reg, data, flags);
+    DRV2605_Start(motor);
+    __set_PRIMASK(primask);
+    return HAL_OK;
+}
+
+/*!
+ * @brief   queues the writes that load a waveform sequence, played by the next GO
+ * @param   DRV2605_HI2C_INST   motor I2C instance
+ * @param   waveforms           effect ids, played in order
+ * @param   count               number of effects, at most DRV2605_SEQ_SLOTS
+ * @return  HAL_StatusTypeDef   HAL_BUSY if the whole pattern does not fit the queue, nothing
+ *                              is queued then
+ */
+HAL_StatusTypeDef DRV2605_LoadPattern(I2C_HandleTypeDef* DRV2605_HI2C_INST,
+    const uint8_t* waveforms, uint8_t count)
+{
+    int motor = DRV2605_Motor(DRV2605_HI2C_INST);
+    if (motor < 0 || count == 0 || count > DRV2605_SEQ_SLOTS) return HAL_ERROR;
+
+    drv2605_queue_t* q = &queue[motor];
+    uint8_t slots = count + (count < DRV2605_SEQ_SLOTS);                                            // effects and the end of the sequence
+    uint8_t seq[DRV2605_SEQ_SLOTS];
+    uint8_t changed = 0;
+    uint8_t needed = 0;
+
+    for (uint8_t slot = 0; slot < slots; slot++) seq[slot] = slot < count ? waveforms[slot] : 0;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    for (uint8_t slot = 0; slot < slots; slot++)                                                    // slots past the end are never played
+        if (!(q->seq_known & (1u << slot)) || q->seq[slot] != seq[slot])
+        {
+            changed |= 1u << slot;
+            needed++;
+        }
+    if ((uint8_t)(q->head - q->tail) + needed > DRV2605_QUEUE_DEPTH)
+    {
+        dropped += needed;
+        __set_PRIMASK(primask);
+        return HAL_BUSY;
+    }
+    for (uint8_t slot = 0; slot < slots; slot++)
+    {
+        if (!(changed & (1u << slot))) continue;
+        DRV2605_Push(q, DRV2605_REG_WAVESEQ1 + slot, seq[slot],
+            --needed == 0 ? DRV2605_COMMAND_NOTIFY : 0);
+        DRV2605_Shadow(motor, DRV2605_REG_WAVESEQ1 + slot, seq[slot], 1);                           // cleared again if the write fails
+    }
+    DRV2605_Start(motor);
+    __set_PRIMASK(primask);
+    return HAL_OK;
 }
 
 /*!
- * @brief   haptic motor initialization sequence
+ * @brief   sets the drive of a motor in real-time playback mode
  * @param   DRV2605_HI2C_INST   motor I2C instance
+ * @param   amplitude           RTPIN value, 0 to 0x7F in the default signed format
+ * @return  HAL_StatusTypeDef   HAL_BUSY if the queue is full, HAL_ERROR for an unknown bus
+ */
+HAL_StatusTypeDef DRV2605_SetRealtime(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t amplitude)
+{
+    int motor = DRV2605_Motor(DRV2605_HI2C_INST);
+    if (motor < 0) return HAL_ERROR;
+
+    drv2605_queue_t* q = &queue[motor];
+    HAL_StatusTypeDef status = HAL_OK;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (q->rtp_queued && !(q->busy && q->rtp_at == q->tail))
+    {
+        q->command[q->rtp_at & (DRV2605_QUEUE_DEPTH - 1)].data = amplitude;                         // not on the bus yet, the newest value wins
+        q->rtp = amplitude;
+    }
+    else if (!q->rtp_known || q->rtp != amplitude)
+    {
+        if ((uint8_t)(q->head - q->tail) >= DRV2605_QUEUE_DEPTH)
+        {
+            dropped++;
+            status = HAL_BUSY;
+        }
+        else
+        {
+            q->rtp_queued = 1;
+            q->rtp_at = q->head;
+            DRV2605_Push(q, DRV2605_REG_RTPIN, amplitude, 0);
+            DRV2605_Shadow(motor, DRV2605_REG_RTPIN, amplitude, 1);                                 // cleared again if the write fails
+            DRV2605_Start(motor);
+        }
+    }
+    __set_PRIMASK(primask);
+    return status;
+}
+
+/*!
+ * @brief   plays the waveforms of several motors at the same instant
+ * @param   motors              motor I2C instances
+ * @param   count               number of motors
+ * @return  HAL_StatusTypeDef   HAL_BUSY if a queue is full or the previous group has not
+ *                              started yet, nothing is queued then
  */
-void DRV2605_Init(I2C_HandleTypeDef* DRV2605_HI2C_INST)
+HAL_StatusTypeDef DRV2605_GoSync(I2C_HandleTypeDef** motors, uint8_t count)
 {
-    uint8_t id = DRV2605_ReadRegister(DRV2605_HI2C_INST, DRV2605_REG_STATUS);
+    uint8_t group = 0;
 
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_MODE, 0x00);                               // out of standby
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_RTPIN, 0x00);                              // no real-time-playback
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_WAVESEQ1, 0x01);                           // strong click
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_WAVESEQ2, 0x00);                           // end sequence
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_OVERDRIVE, 0x00);                          // no overdrive
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_SUSTAINPOS, 0x00);
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_SUSTAINNEG, 0x00);
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_BREAK, 0x00);
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_AUDIOMAX, 0x64);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        int motor = DRV2605_Motor(motors[i]);
+        if (motor < 0) return HAL_ERROR;
+        group |= 1u << motor;                                                                       // a motor listed twice plays once
+    }
+    if (group == 0) return HAL_ERROR;
 
-    // ERM open loop
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint8_t full = sync_group != 0;                                                                 // one group waits at a time
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+        if ((group & (1u << motor)) &&
+            (uint8_t)(queue[motor].head - queue[motor].tail) >= DRV2605_QUEUE_DEPTH) full = 1;
+    if (full)
+    {
+        dropped++;
+        __set_PRIMASK(primask);
+        return HAL_BUSY;
+    }
 
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_FEEDBACK, 
-        DRV2605_ReadRegister(DRV2605_HI2C_INST, DRV2605_REG_FEEDBACK) & 0x7F);                      // turn off N_ERM_LRA
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_CONTROL3, 
-        DRV2605_ReadRegister(DRV2605_HI2C_INST, DRV2605_REG_CONTROL3) | 0x20);                      // turn on ERM_OPEN_LOOP
+    sync_group = DRV2605_SYNC ? group : 0;
+    sync_ready = 0;
+    sync_start = HAL_GetTick();
+    skew_group = DRV2605_SYNC ? 0 : group;                                                          // unsynchronized GOs are still measured
+    skew_landed = 0;
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+        if (group & (1u << motor))
+            DRV2605_Push(&queue[motor], DRV2605_REG_GO, 0x01,
+                DRV2605_COMMAND_GO | DRV2605_COMMAND_SYNC);
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+        if (group & (1u << motor)) DRV2605_Start(motor);
+    __set_PRIMASK(primask);
+    return HAL_OK;
+}
+
+/*!
+ * @brief   time between the first and the last GO of the last DRV2605_GoSync group landing
+ *          on its motor
+ * @return  uint32_t    skew in microseconds, measured with the DWT cycle counter
+ */
+uint32_t DRV2605_GetSkew(void)
+{
+    return skew_cycles / (SystemCoreClock / 1000000);
+}
+
+/*!
+ * @brief   checks every bus for a transfer that has not finished in DRV2605_TIMEOUT and
+ *          resets that bus, lowers the trigger lines raised since the last call and queues
+ *          the next health check
+ * @note    re-initializing the peripheral aborts the transfer, releases SCL and SDA and
+ *          reapplies the timing Clock_Manager keeps in the handle
+ */
+void DRV2605_Poll(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (trig_raised)
+    {
+        DRV2605_TRIG_PORT->BRR = trig_raised;                                                       // edge mode only needs the rising edge
+        trig_raised = 0;
+    }
+    if (sync_group && HAL_GetTick() - sync_start >= DRV2605_TIMEOUT)
+    {
+        sync_group = 0;                                                                             // a motor never got ready, start the rest
+        sync_ready = 0;
+    }
+    __set_PRIMASK(primask);
+
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+    {
+        drv2605_queue_t* q = &queue[motor];
+        I2C_HandleTypeDef* hi2c = DRV2605_Instance(motor);
+
+        primask = __get_PRIMASK();
+        __disable_irq();
+        DRV2605_Start(motor);                                                                       // retry a bus that was busy or a released GO
+        if (q->tail == q->head || HAL_GetTick() - q->start < DRV2605_TIMEOUT)
+        {
+            __set_PRIMASK(primask);
+            continue;
+        }
+        drv2605_command_t command = DRV2605_Pop(q, HAL_TIMEOUT);
+        HAL_I2C_DeInit(hi2c);
+        HAL_I2C_Init(hi2c);
+        __set_PRIMASK(primask);
+
+        DRV2605_CommandCpltCallback(hi2c, command.reg, command.data, HAL_TIMEOUT);
+
+        primask = __get_PRIMASK();
+        __disable_irq();
+        DRV2605_Start(motor);
+        __set_PRIMASK(primask);
+    }
+
+    if (HAL_GetTick() - health_tick < DRV2605_HEALTH_PERIOD/DRV2605_MOTORS) return;
+    drv2605_queue_t* q = &queue[health_motor];
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if (q->head == q->tail && !(sync_group & (1u << health_motor)))                                 // only on an idle bus, retried next poll
+    {
+        DRV2605_Push(q, DRV2605_REG_STATUS, 0, DRV2605_COMMAND_READ);
+        DRV2605_Push(q, DRV2605_REG_VBAT, 0, DRV2605_COMMAND_READ);
+        DRV2605_Start(health_motor);
+        health_tick = HAL_GetTick();
+        health_motor = (health_motor + 1) % DRV2605_MOTORS;
+    }
+    __set_PRIMASK(primask);
+}
+
+/*!
+ * @brief   gets the result of the background motor checks
+ * @return  const drv2605_health_t*    per-motor STATUS, VBAT and the motors that failed
+ */
+const drv2605_health_t* DRV2605_GetHealth(void)
+{
+    return &health;
+}
+
+/*!
+ * @brief   holds back new transfers and triggers, or starts every queue again
+ * @param   hold    1 to hold, 0 to release
+ */
+void DRV2605_Hold(uint8_t hold)
+{
+    held = hold;
+    if (hold) return;
+
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+    {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        DRV2605_Start(motor);
+        __set_PRIMASK(primask);
+    }
+}
+
+/*!
+ * @brief   number of commands dropped because a queue was full or its transfer failed
+ * @return  uint32_t    dropped command count
+ */
+uint32_t DRV2605_GetDropped(void)
+{
+    return dropped;
+}
+
+/*!
+ * @brief   called when a queued command with DRV2605_COMMAND_NOTIFY finishes, and for
+ *          every command that fails
+ * @param   DRV2605_HI2C_INST   motor I2C instance
+ * @param   reg                 register that was accessed
+ * @param   data                data written, or the value read
+ * @param   status              HAL_OK, HAL_ERROR after a bus error, HAL_TIMEOUT after a reset
+ * @note    weak, can be overridden by the application. Runs in the I2C interrupt, or in
+ *          the caller of the GO for a trigger fired right away.
+ */
+__weak void DRV2605_CommandCpltCallback(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t reg,
+    uint8_t data, HAL_StatusTypeDef status)
+{
+    (void)DRV2605_HI2C_INST;
+    (void)reg;
+    (void)data;
+    (void)status;
+}
+
+/*!
+ * @brief   HAL callback, a queued register write finished
+ */
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef* hi2c)
+{
+    DRV2605_Finish(hi2c, HAL_OK);
+}
+
+/*!
+ * @brief   HAL callback, a queued register read finished
+ */
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef* hi2c)
+{
+    DRV2605_Finish(hi2c, HAL_OK);
+}
+
+/*!
+ * @brief   HAL callback, a queued transfer was not acknowledged or lost the bus
+ */
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef* hi2c)
+{
+    DRV2605_Finish(hi2c, HAL_ERROR);
+}
+
+/*!
+ * @brief   puts a motor into closed loop with its calibration results
+ * @param   motor       motor index, must have a result in CALIBRATION
+ */
+static void DRV2605_Restore(int motor)
+{
+    I2C_HandleTypeDef* hi2c = DRV2605_Instance(motor);
+    uint8_t results[5] = {CALIBRATION.rated, CALIBRATION.clamp, CALIBRATION.compensation[motor],
+                          CALIBRATION.bemf[motor], CALIBRATION.feedback[motor]};
+
+    DRV2605_WriteBurst(hi2c, DRV2605_REG_RATEDV, results, 5);                                       // RATEDV .. FEEDBACK
+    DRV2605_WriteRegister(hi2c, DRV2605_REG_CONTROL3,
+        DRV2605_ReadRegister(hi2c, DRV2605_REG_CONTROL3) & ~DRV2605_ERM_OPEN_LOOP);
 }
 
 /*!
  * @brief   initializes all haptic motors, sets their default libraries and modes
+ * @return  HAL_StatusTypeDef   HAL_ERROR if a motor did not take its setup
  */
-void DRV2605_Begin(void)
+HAL_StatusTypeDef DRV2605_Begin(void)
 {
-    DRV2605_Init(DRV2605_HI2C_INST1);
-    DRV2605_Init(DRV2605_HI2C_INST2);
-    DRV2605_Init(DRV2605_HI2C_INST3);
-    DRV2605_Init(DRV2605_HI2C_INST4);
+    uint8_t image[DRV2605_MOTORS][DRV2605_SETUP_LENGTH];
+
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;                                                 // cycle counter for the GO skew
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    if (STORAGE_Read(STORAGE_KEY_DRV2605_CAL, &CALIBRATION, sizeof(CALIBRATION)) != HAL_OK ||
+        CALIBRATION.rated != DRV2605_RATED_VOLTAGE || CALIBRATION.clamp != DRV2605_CLAMP_VOLTAGE)
+        CALIBRATION.calibrated = 0;                                                                 // measured for other voltages
 
-    DRV2605_SelectLibrary(DRV2605_HI2C_INST1, 1);
-    DRV2605_SelectLibrary(DRV2605_HI2C_INST2, 1);
-    DRV2605_SelectLibrary(DRV2605_HI2C_INST3, 1);
-    DRV2605_SelectLibrary(DRV2605_HI2C_INST4, 1);
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+    {
+        uint8_t* regs = image[motor] - DRV2605_REG_MODE;                                            // indexed by register address
+        for (int i = 0; i < DRV2605_SETUP_LENGTH; i++) image[motor][i] = SETUP[i];
+        if (!(CALIBRATION.calibrated & (1u << motor))) continue;
+        regs[DRV2605_REG_RATEDV] = CALIBRATION.rated;
+        regs[DRV2605_REG_CLAMPV] = CALIBRATION.clamp;
+        regs[DRV2605_REG_AUTOCALCOMP] = CALIBRATION.compensation[motor];
+        regs[DRV2605_REG_AUTOCALEMP] = CALIBRATION.bemf[motor];
+        regs[DRV2605_REG_FEEDBACK] = CALIBRATION.feedback[motor];
+        regs[DRV2605_REG_CONTROL3] &= ~DRV2605_ERM_OPEN_LOOP;                                       // closed loop
+    }
+    return DRV2605_WriteAll(DRV2605_REG_MODE, image, DRV2605_SETUP_LENGTH);
+}
 
-    DRV2605_SetMode(DRV2605_HI2C_INST1, DRV2605_MODE_INTTRIG);
-    DRV2605_SetMode(DRV2605_HI2C_INST2, DRV2605_MODE_INTTRIG);
-    DRV2605_SetMode(DRV2605_HI2C_INST3, DRV2605_MODE_INTTRIG);
-    DRV2605_SetMode(DRV2605_HI2C_INST4, DRV2605_MODE_INTTRIG);
+/*!
+ * @brief   runs the auto-calibration of every motor and stores the results in flash
+ * @return  HAL_StatusTypeDef   HAL_ERROR if a motor failed or timed out, the others are still
+ *                              stored and the failed one keeps its previous result
+ */
+HAL_StatusTypeDef DRV2605_Calibrate(void)
+{
+    drv2605_calibration_t measured = CALIBRATION;
+    uint8_t voltages[2] = {DRV2605_RATED_VOLTAGE, DRV2605_CLAMP_VOLTAGE};
+    uint8_t running = 0;
+
+    if (measured.rated != DRV2605_RATED_VOLTAGE || measured.clamp != DRV2605_CLAMP_VOLTAGE)
+        measured.calibrated = 0;
+    measured.rated = DRV2605_RATED_VOLTAGE;
+    measured.clamp = DRV2605_CLAMP_VOLTAGE;
+
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+    {
+        I2C_HandleTypeDef* hi2c = DRV2605_Instance(motor);
+        DRV2605_SetMode(hi2c, DRV2605_MODE_AUTOCAL);
+        DRV2605_WriteBurst(hi2c, DRV2605_REG_RATEDV, voltages, 2);                                  // RATEDV, CLAMPV
+        DRV2605_WriteRegister(hi2c, DRV2605_REG_FEEDBACK, DRV2605_FEEDBACK_ERM);
+        DRV2605_WriteRegister(hi2c, DRV2605_REG_CONTROL4, DRV2605_AUTOCAL_TIME);
+        DRV2605_WriteRegister(hi2c, DRV2605_REG_GO, 0x01);                                          // every bus calibrates at once
+        running |= 1u << motor;
+    }
+
+    uint32_t start = HAL_GetTick();
+    while (running != 0 && HAL_GetTick() - start < DRV2605_AUTOCAL_TIMEOUT)
+        for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+            if ((running & (1u << motor)) &&
+                !(DRV2605_ReadRegister(DRV2605_Instance(motor), DRV2605_REG_GO) & 0x01))
+                running &= ~(1u << motor);
+
+    HAL_StatusTypeDef status = HAL_OK;
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+    {
+        I2C_HandleTypeDef* hi2c = DRV2605_Instance(motor);
+        if ((running & (1u << motor)) ||
+            (DRV2605_ReadRegister(hi2c, DRV2605_REG_STATUS) & DRV2605_DIAG_RESULT))
+        {
+            DRV2605_WriteRegister(hi2c, DRV2605_REG_GO, 0x00);                                      // stop a calibration that hangs
+            status = HAL_ERROR;
+            continue;
+        }
+        measured.compensation[motor] = DRV2605_ReadRegister(hi2c, DRV2605_REG_AUTOCALCOMP);
+        measured.bemf[motor] = DRV2605_ReadRegister(hi2c, DRV2605_REG_AUTOCALEMP);
+        measured.feedback[motor] = DRV2605_ReadRegister(hi2c, DRV2605_REG_FEEDBACK);
+        measured.calibrated |= 1u << motor;
+    }
+
+    CALIBRATION = measured;
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+    {
+        I2C_HandleTypeDef* hi2c = DRV2605_Instance(motor);
+        if (CALIBRATION.calibrated & (1u << motor)) DRV2605_Restore(motor);
+        else
+        {
+            DRV2605_WriteRegister(hi2c, DRV2605_REG_FEEDBACK, DRV2605_FEEDBACK_ERM);                // back to ERM open loop
+            DRV2605_WriteRegister(hi2c, DRV2605_REG_CONTROL3,
+                DRV2605_ReadRegister(hi2c, DRV2605_REG_CONTROL3) | DRV2605_ERM_OPEN_LOOP);
+        }
+        DRV2605_SetMode(hi2c, DRV2605_MODE_PLAY);
+    }
+
+    if (measured.calibrated == 0) return HAL_ERROR;
+    HAL_StatusTypeDef stored = STORAGE_Write(STORAGE_KEY_DRV2605_CAL, &CALIBRATION,
+        sizeof(CALIBRATION));
+    return status != HAL_OK ? status : stored;
+}
+
+/*!
+ * @brief   gets the calibration restored by DRV2605_Begin or measured by DRV2605_Calibrate
+ * @return  const drv2605_calibration_t*    per-motor results and the motors that have one
+ */
+const drv2605_calibration_t* DRV2605_GetCalibration(void)
+{
+    return &CALIBRATION;
 }
 
 /*!
@@ -140,8 +949,9 @@ void DRV2605_SetWaveform(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t slot, uin
 /*!
  * @brief   plays the waveform on the haptic motor
  * @param   DRV2605_HI2C_INST   motor I2C instance
+ * @return  HAL_StatusTypeDef   result of queueing the GO
  */
-void DRV2605_Go(I2C_HandleTypeDef* DRV2605_HI2C_INST)
+HAL_StatusTypeDef DRV2605_Go(I2C_HandleTypeDef* DRV2605_HI2C_INST)
 {
-    DRV2605_WriteRegister(DRV2605_HI2C_INST, DRV2605_REG_GO, 0x01);
+    return DRV2605_Queue(DRV2605_HI2C_INST, DRV2605_REG_GO, 0x01, DRV2605_COMMAND_GO);
 }
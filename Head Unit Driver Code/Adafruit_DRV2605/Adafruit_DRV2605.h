@@ -17,13 +17,43 @@
  *          SDA     I2C3_SDA        PB4
  *          SCL     I2C4_SCL        PF14
  *          SDA     I2C4_SDA        PF15
+ *          IN/TRIG Motor 1 trigger     PE7
+ *          IN/TRIG Motor 2 trigger     PE8
+ *          IN/TRIG Motor 3 trigger     PE9
+ *          IN/TRIG Motor 4 trigger     PE10
+ *
+ *          Every motor sits alone on its own bus and owns a queue of register commands that
+ *          are sent one at a time with interrupt transfers, so queueing a cue from an
+ *          interrupt only copies a few bytes. The event and error interrupts of I2C1 to I2C4
+ *          have to be enabled in CubeMX so stm32l4xx_it.c forwards them to the HAL. The
+ *          blocking register functions are only meant for setup, before anything is queued.
+ *
+ *          With DRV2605_TRIGGER_GPIO the motors run in edge trigger mode and a GO raises
+ *          the IN/TRIG line of the motor instead of writing the GO register, so I2C is only
+ *          used when a pattern is loaded. The lines share one port and a group of motors is
+ *          fired by a single BSRR write.
+ *
+ *          DRV2605_Calibrate runs the auto-calibration of every motor once and stores the
+ *          results in flash. DRV2605_Begin restores them on every later boot, which switches
+ *          the motors to closed loop with automatic overdrive and braking, so pulses start
+ *          and stop sharply. Motors without a stored result stay in open loop.
+ *
+ *          DRV2605_Poll reads STATUS and VBAT of one motor at a time whenever its queue is
+ *          idle, so every motor is checked once per DRV2605_HEALTH_PERIOD without delaying a
+ *          cue. A motor that stops answering, reports another device id or latches an over
+ *          current or over temperature fault is flagged in drv2605_health_t until a clean
+ *          read clears it.
  *
  * @author  Miles Hanbury (mhanbury)
  * @author  James Kelly (jkellymi)
  * @author  Joshua Nye (nyej)
  */
 
+#ifndef ADAFRUIT_DRV2605_H
+#define ADAFRUIT_DRV2605_H
+
 #include "stm32l4xx_hal.h"
+#include "Flash_Storage.h"
 
 /* -------------------------------- Adafruit DRV2605 Command Set ------------------------------- */
 #define DRV2605_ADDR                0x5A                                                            // device address
@@ -74,6 +104,93 @@
 #define DRV2605_REG_VBAT            0x21                                                            // Vbat voltage-monitor register
 #define DRV2605_REG_LRARESON        0x22                                                            // LRA resonance-period register
 
+/* ------------------------------------- Effect Definitions ------------------------------------ */
+#define DRV2605_EFFECT_END              0                                                           // ends the sequence
+#define DRV2605_EFFECT_STRONG_CLICK     1                                                           // strong click, 100 %
+#define DRV2605_EFFECT_STRONG_CLICK_60  2                                                           // strong click, 60 %
+#define DRV2605_EFFECT_STRONG_CLICK_30  3                                                           // strong click, 30 %
+#define DRV2605_EFFECT_SOFT_BUMP        7                                                           // soft bump, 100 %
+#define DRV2605_EFFECT_SOFT_BUMP_60     8                                                           // soft bump, 60 %
+#define DRV2605_EFFECT_SOFT_BUMP_30     9                                                           // soft bump, 30 %
+#define DRV2605_EFFECT_RAMP_UP          88                                                          // transition ramp up short smooth 1, 0 to 100 %
+#define DRV2605_WAIT(ms)                (0x80 | ((ms)/10))                                          // sequence slot that pauses, 10 ms steps up to 1270 ms
+
+/* ------------------------------------- Queue Definitions ------------------------------------- */
+#define DRV2605_MOTORS              4                                                               // one motor per I2C bus
+#define DRV2605_QUEUE_DEPTH         16                                                              // commands per motor, power of two
+#define DRV2605_TIMEOUT             10                                                              // ms before a transfer counts as stuck
+#define DRV2605_SEQ_SLOTS           8                                                               // WAVESEQ1 .. WAVESEQ8
+
+#define DRV2605_COMMAND_READ        0x01                                                            // read the register instead of writing it
+#define DRV2605_COMMAND_NOTIFY      0x02                                                            // report completion through the callback
+#define DRV2605_COMMAND_SYNC        0x04                                                            // start together with the rest of a DRV2605_GoSync group
+#define DRV2605_COMMAND_TRIGGER     0x08                                                            // raise IN/TRIG instead of writing the register
+
+#ifndef DRV2605_SYNC
+#define DRV2605_SYNC                1                                                               // 0 lets every GO of a group start on its own, to compare skew
+#endif
+
+/* ------------------------------------ Trigger Definitions ------------------------------------ */
+#define DRV2605_TRIGGER_I2C         0                                                               // GO register written over I2C
+#define DRV2605_TRIGGER_GPIO        1                                                               // rising edge on IN/TRIG, no I2C when firing
+
+#ifndef DRV2605_TRIGGER
+#define DRV2605_TRIGGER             DRV2605_TRIGGER_GPIO
+#endif
+
+#if DRV2605_TRIGGER == DRV2605_TRIGGER_GPIO
+#define DRV2605_COMMAND_GO          (DRV2605_COMMAND_NOTIFY | DRV2605_COMMAND_TRIGGER)              // flags of a queued GO
+#define DRV2605_MODE_PLAY           DRV2605_MODE_EXTTRIGEDGE
+#else
+#define DRV2605_COMMAND_GO          DRV2605_COMMAND_NOTIFY
+#define DRV2605_MODE_PLAY           DRV2605_MODE_INTTRIG
+#endif
+
+#define DRV2605_TRIG_PORT           GPIOE                                                           // one port, one write fires any set of motors
+#define DRV2605_TRIG_PIN1           GPIO_PIN_7
+#define DRV2605_TRIG_PIN2           GPIO_PIN_8
+#define DRV2605_TRIG_PIN3           GPIO_PIN_9
+#define DRV2605_TRIG_PIN4           GPIO_PIN_10
+
+/* ---------------------------------- Calibration Definitions ---------------------------------- */
+#define DRV2605_RATED_VOLTAGE       0x8D                                                            // RATEDV, 3.0 V average closed loop drive, 21.33 mV steps
+#define DRV2605_CLAMP_VOLTAGE       0x9F                                                            // CLAMPV, 3.5 V overdrive peak, 21.96 mV steps
+#define DRV2605_FEEDBACK_ERM        0x36                                                            // ERM, 4x brake factor, medium loop gain
+#define DRV2605_AUTOCAL_TIME        0x20                                                            // CONTROL4, 500 to 700 ms of calibration
+#define DRV2605_AUTOCAL_TIMEOUT     2000                                                            // ms before a calibration counts as stuck
+#define DRV2605_DIAG_RESULT         0x08                                                            // STATUS bit, the last calibration failed
+#define DRV2605_ERM_OPEN_LOOP       0x20                                                            // CONTROL3 bit, ERM driven without back-EMF feedback
+
+/* ------------------------------------- Health Definitions ------------------------------------ */
+#define DRV2605_HEALTH_PERIOD       1000                                                            // ms between two checks of the same motor
+#define DRV2605_HEALTH_MISSES       3                                                               // failed checks in a row before a motor counts as dead
+#define DRV2605_STATUS_ID(status)   ((status) >> 5)                                                 // DEVICE_ID field of STATUS
+#define DRV2605_ID_DRV2605          3
+#define DRV2605_ID_DRV2605L         7                                                               // the Adafruit breakout
+#define DRV2605_STATUS_OVER_TEMP    0x02                                                            // STATUS bit, latched, cleared by reading
+#define DRV2605_STATUS_OC_DETECT    0x01                                                            // STATUS bit, latched, cleared by reading
+
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef struct DRV2605_CALIBRATION_STRUCT
+{
+    uint8_t rated;                                                                                  // DRV2605_RATED_VOLTAGE the results were measured at
+    uint8_t clamp;                                                                                  // DRV2605_CLAMP_VOLTAGE the results were measured at
+    uint8_t calibrated;                                                                             // motors with a result, bit per motor
+    uint8_t compensation[DRV2605_MOTORS];                                                           // AUTOCALCOMP
+    uint8_t bemf[DRV2605_MOTORS];                                                                   // AUTOCALEMP
+    uint8_t feedback[DRV2605_MOTORS];                                                               // FEEDBACK, with the back-EMF gain found
+} drv2605_calibration_t;
+
+typedef struct DRV2605_HEALTH_STRUCT
+{
+    uint8_t  status[DRV2605_MOTORS];                                                                // last STATUS read, device id and fault bits
+    uint8_t  vbat[DRV2605_MOTORS];                                                                  // last VBAT read, 5.6 V/255 steps, updated while driving
+    uint8_t  misses[DRV2605_MOTORS];                                                                // checks in a row that got no answer
+    uint8_t  sampled;                                                                               // motors whose STATUS has been read
+    uint8_t  failed;                                                                                // motors that are dead or report a fault
+    uint16_t rounds;                                                                                // completed checks of all four motors
+} drv2605_health_t;
+
 /* ------------------------------------ Function Prototypes ------------------------------------ */
 /*!
  * @brief   accesses 8-bit register and returns its contents
@@ -92,15 +209,133 @@ uint8_t DRV2605_ReadRegister(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t reg);
 void DRV2605_WriteRegister(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t reg, uint8_t data);
 
 /*!
- * @brief   haptic motor initialization sequence
+ * @brief   queues one register access on a motor and starts its bus if it is idle
+ * @param   DRV2605_HI2C_INST   motor I2C instance
+ * @param   reg                 register to access
+ * @param   data                data to write, ignored for reads
+ * @param   flags               DRV2605_COMMAND_READ, DRV2605_COMMAND_NOTIFY
+ * @return  HAL_StatusTypeDef   HAL_BUSY if the queue is full, HAL_ERROR for an unknown bus
+ * @note    safe from any interrupt, reads always notify
+ */
+HAL_StatusTypeDef DRV2605_Queue(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t reg, uint8_t data,
+    uint8_t flags);
+
+/*!
+ * @brief   queues the writes that load a waveform sequence, played by the next GO
+ * @param   DRV2605_HI2C_INST   motor I2C instance
+ * @param   waveforms           effect ids, played in order
+ * @param   count               number of effects, at most DRV2605_SEQ_SLOTS
+ * @return  HAL_StatusTypeDef   HAL_BUSY if the whole pattern does not fit the queue, nothing
+ *                              is queued then
+ * @note    safe from any interrupt. Only the slots that differ from the shadow of the
+ *          motor's WAVESEQ registers are written, the last write notifies, and a motor
+ *          already holding the sequence costs no I2C at all. A GO queued afterwards waits
+ *          for the load in both trigger modes.
+ */
+HAL_StatusTypeDef DRV2605_LoadPattern(I2C_HandleTypeDef* DRV2605_HI2C_INST,
+    const uint8_t* waveforms, uint8_t count);
+
+/*!
+ * @brief   sets the drive of a motor in real-time playback mode
+ * @param   DRV2605_HI2C_INST   motor I2C instance
+ * @param   amplitude           RTPIN value, 0 to 0x7F in the default signed format
+ * @return  HAL_StatusTypeDef   HAL_BUSY if the queue is full, HAL_ERROR for an unknown bus
+ * @note    safe from any interrupt. Nothing is written if the motor already has this
+ *          amplitude, and a write still waiting in the queue takes the new value instead of
+ *          queueing another, so a motor never has more than one RTPIN write pending behind
+ *          the one on the bus.
+ */
+HAL_StatusTypeDef DRV2605_SetRealtime(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t amplitude);
+
+/*!
+ * @brief   plays the waveforms of several motors at the same instant
+ * @param   motors              motor I2C instances
+ * @param   count               number of motors
+ * @return  HAL_StatusTypeDef   HAL_BUSY if a queue is full or the previous group has not
+ *                              started yet, nothing is queued then
+ * @note    safe from any interrupt. Each GO waits until every motor of the group has
+ *          finished its earlier commands, then all GO transfers are started back to back,
+ *          so the motors start within one HAL call of each other instead of one I2C
+ *          transaction. With DRV2605_TRIGGER_GPIO the group is fired by one port write.
+ *          A group still waiting after DRV2605_TIMEOUT is started unsynchronized.
+ */
+HAL_StatusTypeDef DRV2605_GoSync(I2C_HandleTypeDef** motors, uint8_t count);
+
+/*!
+ * @brief   time between the first and the last GO of the last DRV2605_GoSync group landing
+ *          on its motor
+ * @return  uint32_t    skew in microseconds, measured with the DWT cycle counter
+ */
+uint32_t DRV2605_GetSkew(void);
+
+/*!
+ * @brief   checks every bus for a transfer that has not finished in DRV2605_TIMEOUT and
+ *          resets that bus, lowers the trigger lines raised since the last call and queues
+ *          the next health check
+ * @note    call from a task, the stuck command is reported with HAL_TIMEOUT and the
+ *          rest of the queue is sent after the reset
+ */
+void DRV2605_Poll(void);
+
+/*!
+ * @brief   gets the result of the background motor checks
+ * @return  const drv2605_health_t*    per-motor STATUS, VBAT and the motors that failed
+ * @note    updated from the I2C interrupt, rounds changes once all four motors have been
+ *          checked again
+ */
+const drv2605_health_t* DRV2605_GetHealth(void);
+
+/*!
+ * @brief   holds back new transfers and triggers, or starts every queue again
+ * @param   hold    1 to hold, 0 to release
+ * @note    commands queued while held wait in their queue, the transfers already on a bus
+ *          finish. Used around a clock switch, which needs every bus idle. Call from a task.
+ */
+void DRV2605_Hold(uint8_t hold);
+
+/*!
+ * @brief   number of commands dropped because a queue was full or its transfer failed
+ * @return  uint32_t    dropped command count
+ */
+uint32_t DRV2605_GetDropped(void);
+
+/*!
+ * @brief   called when a queued command with DRV2605_COMMAND_NOTIFY finishes, and for
+ *          every command that fails
  * @param   DRV2605_HI2C_INST   motor I2C instance
+ * @param   reg                 register that was accessed
+ * @param   data                data written, or the value read
+ * @param   status              HAL_OK, HAL_ERROR after a bus error, HAL_TIMEOUT after a reset
+ * @note    weak, can be overridden by the application. Runs in the I2C interrupt, or in
+ *          the caller of the GO for a trigger fired right away.
  */
-void DRV2605_Init(I2C_HandleTypeDef* DRV2605_HI2C_INST);
+void DRV2605_CommandCpltCallback(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t reg, uint8_t data,
+    HAL_StatusTypeDef status);
 
 /*!
  * @brief   initializes all haptic motors, sets their default libraries and modes
+ * @return  HAL_StatusTypeDef   HAL_ERROR if a motor did not take its setup
+ * @note    restores the stored calibration of every motor that has one. Every motor gets
+ *          its whole setup, MODE to CONTROL3, in one burst and the four buses are written
+ *          at the same time, about 3 ms in total at 100 kHz.
  */
-void DRV2605_Begin(void);
+HAL_StatusTypeDef DRV2605_Begin(void);
+
+/*!
+ * @brief   runs the auto-calibration of every motor and stores the results in flash
+ * @return  HAL_StatusTypeDef   HAL_ERROR if a motor failed or timed out, the others are still
+ *                              stored and the failed one keeps its previous result
+ * @note    blocks for about 0.7 s, the four motors calibrate at the same time. Call after
+ *          DRV2605_Begin and before anything is queued, with the motors mounted the way they
+ *          are worn and free to spin. Only needs to run once, or after a motor is replaced.
+ */
+HAL_StatusTypeDef DRV2605_Calibrate(void);
+
+/*!
+ * @brief   gets the calibration restored by DRV2605_Begin or measured by DRV2605_Calibrate
+ * @return  const drv2605_calibration_t*    per-motor results and the motors that have one
+ */
+const drv2605_calibration_t* DRV2605_GetCalibration(void);
 
 /*!
  * @brief   used to select the waveform effects library
@@ -128,5 +363,10 @@ void DRV2605_SetWaveform(I2C_HandleTypeDef* DRV2605_HI2C_INST, uint8_t slot, uin
 /*!
  * @brief   plays the waveform on the haptic motor
  * @param   DRV2605_HI2C_INST   motor I2C instance
+ * @return  HAL_StatusTypeDef   result of queueing the GO
+ * @note    returns right away, safe from any interrupt. With DRV2605_TRIGGER_GPIO and an
+ *          empty queue the motor fires before this returns.
  */
-void DRV2605_Go(I2C_HandleTypeDef* DRV2605_HI2C_INST);
+HAL_StatusTypeDef DRV2605_Go(I2C_HandleTypeDef* DRV2605_HI2C_INST);
+
+#endif
@@ -6,18 +6,39 @@
  * 
  *          PINOUT      LABEL           PORT/PIN
  *          ------------------------------------
- *          SAI1_SCK_A  Block A1        PE5
+ *          SAI1_SCK_A  All blocks      PE5
  *          SAI1_FS_A   --              PE4
- *          SAI1_SD_A   --              PE6
- *          SAI1_SCK_B  Block B1        PF8
- *          SAI1_FS_B   --              PF9
- *          SAI1_SD_B   --              PE3
- *          SAI2_SCK_A  Block A2        PB13
- *          SAI2_FS_A   --              PB12
- *          SAI2_SD_A   --              PB15
- *          SAI2_SCK_B  Block B2        PG2
- *          SAI2_FS_B   --              PG3
- *          SAI2_SD_B   --              PG5
+ *          SAI1_SD_A   Block A1        PE6
+ *          SAI1_SD_B   Block B1        PE3
+ *          SAI2_SD_A   Block A2        PB15
+ *          SAI2_SD_B   Block B2        PG5
+ *
+ *          SAI1 Block A is the only clock master. SAI1 Block B runs synchronous to it and
+ *          SAI2 is synchronized through SynchroExt, so all four microphones take BCLK/WS
+ *          from PE5/PE4 and are sampled on the same edge.
+ *
+ *          Localization runs on a sliding window of SAMPLES samples that advances by
+ *          SPH0645_HOP samples. Each DMA half is one hop, it replaces the oldest hop of the
+ *          window and the window statistics are updated from per-hop moments, so a new
+ *          bearing is available every hop instead of every window.
+ *
+ *          An activity gate sits in front of localization. The window energy is compared
+ *          against an adaptive noise floor using only the statistics pass, so silent hops
+ *          never reach the FFT. With GCC-PHAT the spectral flatness of the cross spectra is
+ *          checked as well, which rejects stationary broadband noise that rose above the
+ *          floor faster than it could adapt.
+ *
+ *          With SPH0645_LISTEN the array drops to a single microphone once the gate has
+ *          been closed for SPH0645_LISTEN_IDLE hops. Block A1 keeps running because it is
+ *          the clock master, the other blocks and the SAI2 clock are stopped, and the CPU
+ *          sleeps between short listening hops that only cost a sum of squares. STOP modes
+ *          are not usable since they halt PLLSAI1 and the DMA. A listening hop above the
+ *          noise floor restarts all four blocks, the first bearing follows once the window
+ *          has refilled.
+ *
+ *          Capture, statistics and the activity gate run on the 4 MHz idle clock. Only a
+ *          window that passed the energy gate is localized with the clock boosted to 120 MHz,
+ *          and the clock drops back before the next hop is waited for.
  *
  * @author  Miles Hanbury (mhanbury)
  * @author  James Kelly (jkellymi)
@@ -25,6 +46,21 @@
  */
 
 #include "Adafruit_SPH0645.h"
+#include "Profiler.h"
+#include <string.h>
+#include <math.h>
+
+#if LOC_FFT_SIZE != SAMPLES
+#error "LOC_FFT_SIZE must match SAMPLES"
+#endif
+
+#if SAMPLES % SPH0645_HOP || SPH0645_HOP % 2
+#error "SPH0645_HOP must be even and divide SAMPLES"
+#endif
+
+#if SPH0645_LISTEN_LENGTH > SPH0645_DMA_LENGTH
+#error "SPH0645_LISTEN_HOP must fit the A1 DMA buffer"
+#endif
 
 /* -------------------------------------- Global Variables ------------------------------------- */
 extern SAI_HandleTypeDef* HSAI_BLOCK_A1;
@@ -32,149 +68,746 @@ extern SAI_HandleTypeDef* HSAI_BLOCK_A2;
 extern SAI_HandleTypeDef* HSAI_BLOCK_B1;
 extern SAI_HandleTypeDef* HSAI_BLOCK_B2;
 
-static int SAMPLES_A1[SAMPLES];
-static int SAMPLES_A2[SAMPLES];
-static int SAMPLES_B1[SAMPLES];
-static int SAMPLES_B2[SAMPLES];
+static q15_t SAMPLES_FRAME[SAMPLES*SPH0645_BLOCKS] __attribute__((aligned(4)));                     // interleaved A1/A2/B1/B2 Q15 frame
+static sph0645_stats_t FRAME_STATS;                                                                 // statistics of SAMPLES_FRAME, means seed the next hop
+static sph0645_moments_t HOP_MOMENTS[SPH0645_HOPS];                                                 // moments of each hop in the window
+static sph0645_moments_t WINDOW_MOMENTS;                                                            // running moments of the whole window
+static uint8_t hop_slot;                                                                            // window slot the next hop is written to
+static uint8_t hop_count;                                                                           // hops in the window, saturates at SPH0645_HOPS
+
+static uint32_t window_energy;                                                                      // mean square of the window across all blocks, Q30
+static uint16_t confidence;                                                                         // Q15 confidence of the latest primary bearing
+static uint32_t noise_floor;                                                                        // adaptive background level, Q30
+static uint8_t  activity;                                                                           // gate decision for the latest window
+static uint16_t quiet_hops;                                                                         // full windows since the gate last opened
+static uint8_t  listening;                                                                          // only block A1 is capturing
+
+static loc_track_t TRACKS[LOC_SRP_SOURCES];                                                         // bearing trackers between localization and output
+
+static sph0645_calibration_t CALIBRATION =                                                          // capsule matching, unity until loaded
+{
+    {SPH0645_GAIN_UNITY, SPH0645_GAIN_UNITY, SPH0645_GAIN_UNITY, SPH0645_GAIN_UNITY}, {0}
+};
+
+static int32_t DMA_A1[SPH0645_DMA_LENGTH];                                                          // circular DMA buffers, one per block
+static int32_t DMA_A2[SPH0645_DMA_LENGTH];
+static int32_t DMA_B1[SPH0645_DMA_LENGTH];
+static int32_t DMA_B2[SPH0645_DMA_LENGTH];
+
+static volatile uint8_t  half_mask[2];                                                              // blocks that have finished each half
+static volatile uint8_t  frame_mask;                                                                // blocks that make up a frame
+static volatile uint8_t  frame_half;                                                                // half holding the newest complete frame
+static volatile uint8_t  frame_ready;                                                               // set when a complete frame is waiting
+static volatile uint32_t frame_overruns;                                                            // frames dropped before being unpacked
 
 /* ---------------------------------- Function Implementations --------------------------------- */
 /*!
- * @brief   samples a microphone
- * @param   hsai    block to sample
- * @return  double  sample value
+ * @brief   maps a SAI handle to its capture block index
+ * @param   hsai    SAI block handle
+ * @return  int     block index, -1 if the handle is not a microphone block
  */
-int SPH0645_Sample(SAI_HandleTypeDef* hsai)
+static int SPH0645_BlockIndex(SAI_HandleTypeDef* hsai)
 {
-    int sample = 0;
-    uint8_t buffer[1] = {0};
-    while (sample == 0 || sample == -1)
+    if (hsai == HSAI_BLOCK_A1) return SPH0645_BLOCK_A1;
+    if (hsai == HSAI_BLOCK_A2) return SPH0645_BLOCK_A2;
+    if (hsai == HSAI_BLOCK_B1) return SPH0645_BLOCK_B1;
+    if (hsai == HSAI_BLOCK_B2) return SPH0645_BLOCK_B2;
+    return -1;
+}
+
+/*!
+ * @brief   marks a buffer half as finished for one block and publishes the frame once every
+ *          block has finished the same half
+ * @param   hsai    SAI block handle
+ * @param   half    buffer half that was completed
+ */
+static void SPH0645_HalfComplete(SAI_HandleTypeDef* hsai, uint8_t half)
+{
+    int block = SPH0645_BlockIndex(hsai);
+    if (block < 0) return;
+
+    half_mask[half] |= (uint8_t)(1 << block);                                                       // this half is now stable for the block
+    half_mask[half ^ 1] &= (uint8_t)~(1 << block);                                                  // the other half is being overwritten
+
+    if (half_mask[half] == frame_mask)
     {
-        HAL_StatusTypeDef res = HAL_SAI_Receive(&hsai, buffer, 1, 1);
-        sample = (double)buffer[0];
+        half_mask[half] = 0;
+        if (frame_ready) ++frame_overruns;                                                          // previous frame was never unpacked
+        frame_half = half;
+        frame_ready = 1;
+        SPH0645_FrameCpltCallback(half);
     }
-    return sample >>= 14;
 }
 
 /*!
- * @brief   samples all block sets
+ * @brief   empties the sliding window
+ * @note    the DC reference of the first hop is seeded from the calibrated offsets
  */
-void SPH0645_SampleAll(void)
+static void SPH0645_ResetWindow(void)
 {
-    for (int i = 0; i < SAMPLES; i++)
+    hop_slot = hop_count = 0;
+    memset(&WINDOW_MOMENTS, 0, sizeof(WINDOW_MOMENTS));
+    for (int block = 0; block < SPH0645_BLOCKS; block++)
     {
-        SAMPLES_A1[i] = SPH0645_Sample(HSAI_BLOCK_A1);
-        SAMPLES_A2[i] = SPH0645_Sample(HSAI_BLOCK_A2);
-        SAMPLES_B1[i] = SPH0645_Sample(HSAI_BLOCK_B1);
-        SAMPLES_B2[i] = SPH0645_Sample(HSAI_BLOCK_B2);
+        int32_t offset = CALIBRATION.offset[block];
+        FRAME_STATS.mean[block] = (q15_t)((offset*CALIBRATION.gain[block]) >> 16);
     }
+    activity = 0;
+    quiet_hops = 0;
 }
 
 /*!
- * @brief   gets the average of a sample set
- * @param   _samples    sample set
- * @return  double      average
+ * @brief   starts circular DMA reception on one block
+ * @param   hsai                SAI block handle
+ * @param   buffer              double buffer for the block
+ * @return  HAL_StatusTypeDef   HAL status of the DMA start
  */
-double SPH0645_GetAverage(int* _samples)
+static HAL_StatusTypeDef SPH0645_StartBlock(SAI_HandleTypeDef* hsai, int32_t* buffer)
 {
-    double avg = 0;
-    for (int i = 0; i < SAMPLES; i++) avg += (double)(_samples[i]);
-    avg /= SAMPLES;
+    hsai->hdmarx->Init.Mode = DMA_CIRCULAR;                                                         // generated MSP init uses normal mode
+    if (HAL_DMA_Init(hsai->hdmarx) != HAL_OK) return HAL_ERROR;
+    return HAL_SAI_Receive_DMA(hsai, (uint8_t*)buffer, SPH0645_DMA_LENGTH);
 }
 
 /*!
- * @brief   normalize sample set by subtracting the average from each sample
- * @param   _samples    sample set
- * @param   avg         average of set
+ * @brief   empties the sliding window and starts all four blocks on the same frame
+ * @return  HAL_StatusTypeDef   HAL_OK if all four blocks were started
  */
-void SPH0645_Normalize(int* _samples, double avg)
+static HAL_StatusTypeDef SPH0645_StartBlocks(void)
 {
-    for (int i = 0; i < SAMPLES; i++) _samples[i] -= avg;
+    half_mask[0] = half_mask[1] = 0;
+    frame_mask = (1 << SPH0645_BLOCKS) - 1;
+    frame_ready = 0;
+    listening = 0;
+    SPH0645_ResetWindow();
+
+    if (SPH0645_StartBlock(HSAI_BLOCK_B1, DMA_B1) != HAL_OK ||                                      // slaves are enabled first so that they
+        SPH0645_StartBlock(HSAI_BLOCK_A2, DMA_A2) != HAL_OK ||                                      // all start on the master's first frame
+        SPH0645_StartBlock(HSAI_BLOCK_B2, DMA_B2) != HAL_OK ||
+        SPH0645_StartBlock(HSAI_BLOCK_A1, DMA_A1) != HAL_OK)
+    {
+        SPH0645_StopCapture();
+        return HAL_ERROR;
+    }
+    return HAL_OK;
 }
 
 /*!
- * @brief   normalize all block sets
+ * @brief   switches the DMA channel of every SAI block to circular mode and starts capturing
+ *          into the double buffers
+ * @return  HAL_StatusTypeDef   HAL_OK if all four blocks were started
  */
-void SPH0645_NormalizeAll()
+HAL_StatusTypeDef SPH0645_StartCapture(void)
 {
-    SPH0645_Normalize(SAMPLES_A1, SPH0645_GetAverage(SAMPLES_A1));
-    SPH0645_Normalize(SAMPLES_A2, SPH0645_GetAverage(SAMPLES_A2));
-    SPH0645_Normalize(SAMPLES_B1, SPH0645_GetAverage(SAMPLES_B1));
-    SPH0645_Normalize(SAMPLES_B2, SPH0645_GetAverage(SAMPLES_B2));
+    LOC_Init();
+    frame_overruns = 0;
+    noise_floor = 0;
+    for (int t = 0; t < LOC_SRP_SOURCES; t++) LOC_TrackInit(&TRACKS[t]);
+    __HAL_RCC_SAI2_CLK_ENABLE();                                                                    // may have been stopped by listening
+    return SPH0645_StartBlocks();
 }
 
 /*!
- * @brief   gets the minumum value of a sample set
- * @param   _samples    sample set
- * @return  double      minimum value in set
+ * @brief   stops the DMA capture on all SAI blocks
  */
-double SPH0645_GetMinSample(int* _samples)
+void SPH0645_StopCapture(void)
+{
+    HAL_SAI_DMAStop(HSAI_BLOCK_A1);                                                                 // master first so the slaves stop on a frame edge
+    HAL_SAI_DMAStop(HSAI_BLOCK_B1);
+    HAL_SAI_DMAStop(HSAI_BLOCK_A2);
+    HAL_SAI_DMAStop(HSAI_BLOCK_B2);
+    frame_ready = 0;
+}
+
+/*!
+ * @brief   leaves listening and restarts all four blocks
+ * @return  HAL_StatusTypeDef   HAL_OK if all four blocks were started
+ * @note    the noise floor and the trackers are kept, only the window has to refill
+ */
+static HAL_StatusTypeDef SPH0645_Wake(void)
+{
+    HAL_SAI_DMAStop(HSAI_BLOCK_A1);
+    __HAL_FLASH_SLEEP_POWERDOWN_DISABLE();
+    __HAL_RCC_SAI2_CLK_ENABLE();
+    return SPH0645_StartBlocks();
+}
+
+#if SPH0645_LISTEN
+/*!
+ * @brief   stops every block but the clock master and restarts it on listening hops
+ * @note    the flash is powered down during sleep as well, the wake-up it adds to every
+ *          DMA interrupt is a few microseconds against an 8 ms listening hop
+ */
+static void SPH0645_StartListening(void)
+{
+    SPH0645_StopCapture();                                                                          // A1 has to stop too, its buffer gets a new length
+    __HAL_RCC_SAI2_CLK_DISABLE();                                                                   // A2 and B2 are both on SAI2
+    __HAL_FLASH_SLEEP_POWERDOWN_ENABLE();
+
+    half_mask[0] = half_mask[1] = 0;
+    frame_mask = 1 << SPH0645_BLOCK_A1;
+    listening = 1;
+    if (HAL_SAI_Receive_DMA(HSAI_BLOCK_A1, (uint8_t*)DMA_A1, SPH0645_LISTEN_LENGTH) != HAL_OK)
+        SPH0645_Wake();                                                                             // keep localizing rather than go deaf
+}
+#endif
+
+/*!
+ * @brief   checks if a complete frame is waiting to be unpacked
+ * @return  int     1 if all four blocks have finished the same buffer half
+ */
+int SPH0645_FrameAvailable(void)
+{
+    return frame_ready;
+}
+
+/*!
+ * @brief   number of frames that were overwritten before they were unpacked
+ * @return  uint32_t    overrun count
+ */
+uint32_t SPH0645_GetOverruns(void)
+{
+    return frame_overruns;
+}
+
+/*!
+ * @brief   called from the DMA interrupt once all four blocks have finished the same half
+ * @param   half    buffer half that was completed (0 = first, 1 = second)
+ * @note    weak, can be overridden by the application to be notified of new frames
+ */
+__weak void SPH0645_FrameCpltCallback(uint8_t half)
+{
+    (void)half;
+}
+
+/*!
+ * @brief   converts one half of a block's DMA buffer to Q15 samples and interleaves it
+ * @param   hop         first sample instant of the hop in the frame
+ * @param   block       block index, channel position in the frame
+ * @param   dma         block DMA buffer
+ * @param   half        buffer half to convert
+ * @note    the SPH0645 sends 18-bit data MSB-aligned in a 32-bit slot, the top 16 bits are
+ *          kept as a Q15 fraction of full scale. The calibration gain is folded into that
+ *          scaling: the high word of slot*gain is slot >> 16 at unity, and it is a single
+ *          SMULL on the Cortex-M4 just like the shift, so matching costs nothing per sample.
+ */
+static void SPH0645_Unpack(q15_t* hop, int block, const int32_t* dma, uint8_t half)
+{
+    const int32_t* src = dma + half*SPH0645_HOP;
+    int32_t gain = CALIBRATION.gain[block];
+    q15_t* dst = hop + block;
+    for (int i = 0; i < SPH0645_HOP; i++)
+        dst[i*SPH0645_BLOCKS] = (q15_t)(((int64_t)src[i]*gain) >> 32);                              // gain <= unity, cannot overflow
+}
+
+/*!
+ * @brief   waits for the next hop, writes it over the oldest hop of the sliding window and
+ *          updates the window statistics
+ * @note    the DMA keeps filling the other half while the window is processed. All blocks
+ *          share one sample clock, so index i is the same instant on every channel. Only the
+ *          new hop is read, the hop leaving the window is subtracted from its stored moments.
+ */
+void SPH0645_SampleAll(void)
+{
+    while (!frame_ready) __WFI();                                                                   // sleep until the DMA interrupt publishes a hop
+
+    uint8_t half = frame_half;
+    frame_ready = 0;
+
+    PROF_BEGIN(PROF_ZONE_UNPACK);
+    q15_t* hop = SAMPLES_FRAME + hop_slot*SPH0645_HOP*SPH0645_BLOCKS;                               // oldest hop in the window
+    SPH0645_Unpack(hop, SPH0645_BLOCK_A1, DMA_A1, half);
+    SPH0645_Unpack(hop, SPH0645_BLOCK_A2, DMA_A2, half);
+    SPH0645_Unpack(hop, SPH0645_BLOCK_B1, DMA_B1, half);
+    SPH0645_Unpack(hop, SPH0645_BLOCK_B2, DMA_B2, half);
+    PROF_END(PROF_ZONE_UNPACK);
+
+    PROF_BEGIN(PROF_ZONE_STATS);
+    sph0645_moments_t moments;
+    SPH0645_Moments(hop, SPH0645_HOP, FRAME_STATS.mean, &moments);
+    SPH0645_MomentsUpdate(&WINDOW_MOMENTS, &moments,
+                          hop_count == SPH0645_HOPS ? &HOP_MOMENTS[hop_slot] : NULL);
+    HOP_MOMENTS[hop_slot] = moments;
+
+    if (hop_count < SPH0645_HOPS) ++hop_count;
+    hop_slot = (uint8_t)((hop_slot + 1) % SPH0645_HOPS);
+    SPH0645_WindowStats(&WINDOW_MOMENTS, HOP_MOMENTS, hop_count, hop_count*SPH0645_HOP,
+                        &FRAME_STATS);
+    PROF_END(PROF_ZONE_STATS);
+}
+
+/*!
+ * @brief   checks if the sliding window has been completely filled since capture started
+ * @return  int     1 once SPH0645_HOPS hops have been sampled
+ */
+int SPH0645_WindowFull(void)
+{
+    return hop_count == SPH0645_HOPS;
+}
+
+/*!
+ * @brief   gets the sliding window frame
+ * @return  q15_t*  interleaved Q15 frame, sample i of block b is at [i*SPH0645_BLOCKS + b]
+ * @note    the frame is a ring of hops, so it is circularly rotated in time
+ */
+q15_t* SPH0645_GetFrame(void)
+{
+    return SAMPLES_FRAME;
+}
+
+/*!
+ * @brief   gets the statistics of the sliding window frame
+ * @return  const sph0645_stats_t*  per-block mean, DC-removed min/max, RMS and zero crossings
+ */
+const sph0645_stats_t* SPH0645_GetStats(void)
+{
+    return &FRAME_STATS;
+}
+
+/*!
+ * @brief   loads the capsule calibration from flash
+ * @return  HAL_StatusTypeDef   HAL_OK if a calibration was stored, otherwise unity gains
+ *                              are used
+ */
+HAL_StatusTypeDef SPH0645_LoadCalibration(void)
+{
+    sph0645_calibration_t stored;
+
+    if (STORAGE_Read(STORAGE_KEY_SPH0645_CAL, &stored, sizeof(stored)) != HAL_OK) return HAL_ERROR;
+    for (int block = 0; block < SPH0645_BLOCKS; block++)
+        if (stored.gain[block] < SPH0645_GAIN_MIN || stored.gain[block] > SPH0645_GAIN_UNITY)
+            return HAL_ERROR;                                                                       // never trust a gain that could clip
+    CALIBRATION = stored;
+    return HAL_OK;
+}
+
+/*!
+ * @brief   measures the sensitivity and DC offset of every capsule, applies the result and
+ *          stores it in flash
+ * @param   hops                number of windows to average, SPH0645_CAL_HOPS is ~4 s
+ * @return  HAL_StatusTypeDef   HAL_ERROR if the reference was too quiet or a capsule is off
+ *                              by more than 12 dB, the previous calibration is kept then
+ * @note    measured at unity gain. Every capsule is scaled to the least sensitive one, the
+ *          gain is the amplitude ratio sqrt(E_min/E_block).
+ */
+HAL_StatusTypeDef SPH0645_Calibrate(uint16_t hops)
+{
+    sph0645_calibration_t previous = CALIBRATION;
+    sph0645_calibration_t measured;
+    uint64_t energy[SPH0645_BLOCKS] = {0};
+    int64_t  dc[SPH0645_BLOCKS] = {0};
+    uint32_t quietest = UINT32_MAX;
+
+    if (hops == 0) return HAL_ERROR;
+    if (listening && SPH0645_Wake() != HAL_OK) return HAL_ERROR;                                    // every block has to be measured
+    for (int block = 0; block < SPH0645_BLOCKS; block++)
+        CALIBRATION.gain[block] = SPH0645_GAIN_UNITY;                                               // measure the raw capsules
+    SPH0645_ResetWindow();
+
+    for (uint16_t windows = 0; windows < hops; )
+    {
+        SPH0645_SampleAll();
+        if (!SPH0645_WindowFull()) continue;
+        for (int block = 0; block < SPH0645_BLOCKS; block++)
+        {
+            energy[block] += FRAME_STATS.energy[block];
+            dc[block] += FRAME_STATS.mean[block];
+        }
+        ++windows;
+    }
+
+    for (int block = 0; block < SPH0645_BLOCKS; block++)
+    {
+        energy[block] /= hops;                                                                      // mean square, Q30
+        if (energy[block] < quietest) quietest = (uint32_t)energy[block];
+        measured.offset[block] = (q15_t)(dc[block] / hops);
+    }
+
+    HAL_StatusTypeDef status = quietest < SPH0645_CAL_MIN_ENERGY ? HAL_ERROR : HAL_OK;              // no reference playing
+    for (int block = 0; block < SPH0645_BLOCKS && status == HAL_OK; block++)
+    {
+        uint32_t ratio = (uint32_t)(((uint64_t)quietest << 30) / energy[block]);                    // E_min/E_block, Q30
+        measured.gain[block] = (int32_t)SPH0645_Sqrt(ratio) << 1;                                   // Q15 amplitude to Q16
+        if (measured.gain[block] < SPH0645_GAIN_MIN) status = HAL_ERROR;                            // dead or blocked capsule
+    }
+
+    CALIBRATION = status == HAL_OK ? measured : previous;
+    SPH0645_ResetWindow();                                                                          // the window holds unity-gain hops
+    noise_floor = 0;
+    if (status != HAL_OK) return status;
+    return STORAGE_Write(STORAGE_KEY_SPH0645_CAL, &CALIBRATION, sizeof(CALIBRATION));
+}
+
+/*!
+ * @brief   gets the capsule calibration in use
+ * @return  const sph0645_calibration_t*    per-block Q16 gain and DC offset
+ */
+const sph0645_calibration_t* SPH0645_GetCalibration(void)
+{
+    return &CALIBRATION;
+}
+
+/* ------------------------------------- HAL SAI Callbacks ------------------------------------- */
+void HAL_SAI_RxHalfCpltCallback(SAI_HandleTypeDef* hsai)
+{
+    SPH0645_HalfComplete(hsai, 0);
+}
+
+void HAL_SAI_RxCpltCallback(SAI_HandleTypeDef* hsai)
 {
-    double min = _samples[0];
-    for (int i = 1; i < SAMPLES; i++)
-        if (_samples[i] < min) 
-            min = _samples[i];
-    return min;
+    SPH0645_HalfComplete(hsai, 1);
 }
 
+#if SPH0645_LOCALIZER == SPH0645_LOCALIZER_RATIO
+#include "SPH0645_RatioTable.h"
+
+static const uint8_t SPH0645_LOG2_FRAC[16] =                                                        // 16*log2(1 + (m + 0.5)/16), rounded
+{
+    1, 2, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 13, 14, 15, 16
+};
+
 /*!
- * @brief   gets the maximum value of a sample set
- * @param   _samples    sample set 
- * @return  double      maximum value in set
+ * @brief   integer log2
+ * @param   x           value
+ * @return  int32_t     log2(x) in Q4, 0 for x <= 1
+ * @note    the leading one is found with CLZ and the next four bits look up the fraction,
+ *          within 1/16 octave. Bench/tune_ratio.py mirrors this exactly.
  */
-double SPH0645_GetMaxSample(int* _samples)
+static int32_t SPH0645_Log2(uint32_t x)
 {
-    double max = _samples[0];
-    for (int i = 1; i < SAMPLES; i++)
-        if (_samples[i] > max) 
-            max = _samples[i];
-    return max;
+    if (x <= 1) return 0;
+    int32_t msb = 31 - (int32_t)__CLZ(x);
+    uint32_t frac = msb < 4 ? (x << (4 - msb)) & 15 : (x >> (msb - 4)) & 15;
+    return 16*msb + SPH0645_LOG2_FRAC[frac];
 }
 
 /*!
- * @brief   squares two values and then returns the ratio of them
- * @param   a           numerator value
- * @param   b           denomanator value
- * @return  double      squared ratio
+ * @brief   quantizes the log ratio of two ranges to a decision table index
+ * @param   a           numerator range
+ * @param   b           denominator range
+ * @return  int         bin of log2(a/b), clamped to the table
  */
-double RatioSquared(double a, double b)
+static int SPH0645_RatioBin(uint32_t a, uint32_t b)
 {
-    return (a*a)/(b*b);
+    int32_t bin = (SPH0645_Log2(a) - SPH0645_Log2(b) + SPH0645_RATIO_OFFSET) >> SPH0645_RATIO_SHIFT;
+    return bin < 0 ? 0 : bin >= SPH0645_RATIO_BINS ? SPH0645_RATIO_BINS - 1 : bin;
 }
 
 /*!
- * @brief   compares sample ranges to threshold to determine angle
+ * @brief   looks up the angle of the current frame from the ratios of its sample ranges
  * @return  int         determined angle
- * @note    returns -1 if no angle is determined as to allow caller to determine default
+ * @note    returns -1 if no angle is determined as to allow caller to determine default.
+ *          The table is fitted offline by Bench/tune_ratio.py, by default from T1..T5.
+ */
+static int SPH0645_RatioAngle(void)
+{
+    const sph0645_stats_t* stats = &FRAME_STATS;                                                    // min/max are already DC-removed
+
+    uint32_t rangeA1 = stats->max[SPH0645_BLOCK_A1] - stats->min[SPH0645_BLOCK_A1];                 // range of block A1 values
+    uint32_t rangeA2 = stats->max[SPH0645_BLOCK_A2] - stats->min[SPH0645_BLOCK_A2];                 // range of block A2 values
+    uint32_t rangeB1 = stats->max[SPH0645_BLOCK_B1] - stats->min[SPH0645_BLOCK_B1];                 // range of block B1 values
+    uint32_t rangeB2 = stats->max[SPH0645_BLOCK_B2] - stats->min[SPH0645_BLOCK_B2];                 // range of block B2 values
+
+    int8_t direction = SPH0645_RATIO_TABLE[SPH0645_RatioBin(rangeA2, rangeA1)]                      // front/back ratio picks the row,
+                                          [SPH0645_RatioBin(rangeB2, rangeB1)];                     // left/right ratio the column
+    return direction < 0 ? -1 : direction*45;
+}
+#endif
+
+/*!
+ * @brief   checks if the window energy is a given ratio above the noise floor
+ * @param   ratio       threshold, Q8
+ * @return  int         1 if the energy exceeds ratio*floor and the absolute minimum
+ */
+static int SPH0645_EnergyAbove(uint32_t ratio)
+{
+    return window_energy > SPH0645_VAD_MIN_ENERGY &&
+           ((uint64_t)window_energy << 8) > (uint64_t)ratio*noise_floor;
+}
+
+/*!
+ * @brief   compares an energy against the noise floor and moves the floor towards it
+ * @param   energy      mean square, Q30
+ * @param   ratio       threshold over the floor, Q8
+ * @return  int         1 if the energy is loud enough
+ * @note    the decision uses the floor from before this energy. The floor follows drops
+ *          quickly and rises slowly even during activity, so a sound that never stops
+ *          becomes background after a few seconds.
+ */
+static int SPH0645_FloorGate(uint32_t energy, uint32_t ratio)
+{
+    window_energy = energy;
+    if (noise_floor == 0) noise_floor = energy;                                                     // first full window seeds the floor
+    int active = SPH0645_EnergyAbove(ratio);
+
+    if (energy < noise_floor) noise_floor -= (noise_floor - energy) >> SPH0645_VAD_FALL_SHIFT;
+    else                      noise_floor += (noise_floor >> SPH0645_VAD_RISE_SHIFT) + 1;
+    return active;
+}
+
+/*!
+ * @brief   energy stage of the activity gate, run once per full window
+ * @return  int         1 if the window is loud enough to be localized
+ */
+static int SPH0645_EnergyGate(void)
+{
+    uint32_t energy = 0;
+    for (int block = 0; block < SPH0645_BLOCKS; block++)
+        energy += FRAME_STATS.energy[block] / SPH0645_BLOCKS;
+    return SPH0645_FloorGate(energy, SPH0645_VAD_SNR);
+}
+
+#if SPH0645_LISTEN
+/*!
+ * @brief   sleeps until the next listening hop and wakes the array if it is loud
+ * @note    one DC-removed sum of squares over SPH0645_LISTEN_HOP samples of block A1,
+ *          quiet hops keep the noise floor following the background
+ */
+static void SPH0645_ListenHop(void)
+{
+    int32_t gain = CALIBRATION.gain[SPH0645_BLOCK_A1];
+    int32_t sum = 0;
+    int64_t sumsq = 0;
+
+    while (!frame_ready) __WFI();
+    const int32_t* src = DMA_A1 + frame_half*SPH0645_LISTEN_HOP;
+    frame_ready = 0;
+
+    for (int i = 0; i < SPH0645_LISTEN_HOP; i++)
+    {
+        int32_t sample = (q15_t)(((int64_t)src[i]*gain) >> 32);
+        sum += sample;
+        sumsq += sample*sample;
+    }
+    sumsq -= (int64_t)sum*sum / SPH0645_LISTEN_HOP;
+    if (SPH0645_FloorGate((uint32_t)(sumsq / SPH0645_LISTEN_HOP), SPH0645_LISTEN_SNR))
+        SPH0645_Wake();
+}
+#endif
+
+/*!
+ * @brief   advances the window by one hop and runs the energy stage of the activity gate
+ * @return  int         1 if the window is full and loud enough to be localized
+ * @note    while listening a listening hop is checked instead and 0 is returned. The array
+ *          starts listening after SPH0645_LISTEN_IDLE full windows in a row were quiet.
+ */
+static int SPH0645_Advance(void)
+{
+    activity = 0;
+#if SPH0645_LISTEN
+    if (listening)
+    {
+        SPH0645_ListenHop();
+        return 0;
+    }
+#endif
+    SPH0645_SampleAll();                                                                            // advances the window by one hop
+    if (!SPH0645_WindowFull()) return 0;
+
+    int active = SPH0645_EnergyGate();
+    if (active) quiet_hops = 0;
+    else if (quiet_hops < UINT16_MAX) ++quiet_hops;
+#if SPH0645_LISTEN
+    if (quiet_hops >= SPH0645_LISTEN_IDLE) SPH0645_StartListening();
+#endif
+    return active;
+}
+
+/*!
+ * @brief   checks if the last localized window passed the activity gate
+ * @return  int     1 if sound activity was detected
+ */
+int SPH0645_Active(void)
+{
+    return activity;
+}
+
+/*!
+ * @brief   checks if the array is listening on a single microphone
+ * @return  int     1 while only block A1 is capturing
+ */
+int SPH0645_Listening(void)
+{
+    return listening;
+}
+
+/*!
+ * @brief   gets the adaptive noise floor of the activity gate
+ * @return  uint32_t    mean square of the background across all blocks, Q30
+ */
+uint32_t SPH0645_GetNoiseFloor(void)
+{
+    return noise_floor;
+}
+
+/*!
+ * @brief   gets the energy of the latest window
+ * @return  uint32_t    mean square of the window across all blocks, Q30
+ */
+uint32_t SPH0645_GetEnergy(void)
+{
+    return window_energy;
+}
+
+/*!
+ * @brief   gets the level of the latest window
+ * @return  int16_t     RMS level across all blocks in 0.1 dBFS, SPH0645_LEVEL_SILENT if the
+ *                      window has no energy
+ */
+int16_t SPH0645_GetLevel(void)
+{
+    uint32_t energy = window_energy;
+    if (energy == 0) return SPH0645_LEVEL_SILENT;
+    return (int16_t)lrintf(100.0f*log10f((float)energy/(float)(1u << 30)));                         // -903 for the smallest energy
+}
+
+/*!
+ * @brief   advances the window and gets the peaks the localizers scale the FFT input by
+ * @param   peak        per-block peak magnitude with DC removed, for the FFT scaling
+ * @return  int         1 if the window is full and loud enough to be localized
+ */
+static int SPH0645_NextWindow(q15_t* peak)
+{
+    if (!SPH0645_Advance()) return 0;                                                               // not enough samples, too quiet or listening
+
+    for (int block = 0; block < SPH0645_BLOCKS; block++)
+        peak[block] = (q15_t)__SSAT(-FRAME_STATS.min[block] > FRAME_STATS.max[block] ?
+                                    -FRAME_STATS.min[block] : FRAME_STATS.max[block], 16);
+    return 1;
+}
+
+/*!
+ * @brief   flatness stage of the activity gate
+ * @param   flatness    Q15 spectral flatness of the window
+ * @return  int         1 if the window is not noise-like or is a loud transient
+ */
+static int SPH0645_FlatnessGate(uint16_t flatness)
+{
+    activity = (uint8_t)(flatness <= SPH0645_VAD_FLATNESS ||
+                         SPH0645_EnergyAbove(SPH0645_VAD_SNR_LOUD));                                // noise-like unless a loud transient
+    return activity;
+}
+
+/*!
+ * @brief   samples all microphones and estimates a continuous bearing with GCC-PHAT
+ * @param   result      bearing in degrees and Q15 confidence
+ * @note    the confidence is 0 while the window fills and for windows that fail the
+ *          activity gate. Quiet windows return right after the statistics pass.
+ */
+void SPH0645_GetBearing(loc_result_t* result)
+{
+    q15_t peak[SPH0645_BLOCKS];
+
+    memset(result, 0, sizeof(*result));
+    if (!SPH0645_NextWindow(peak)) return;
+
+    CLOCK_SetProfile(CLOCK_PROFILE_BOOST);                                                          // idle clock if a transfer outlasts CLOCK_IDLE_WAIT, counted
+    PROF_BEGIN(PROF_ZONE_LOCALIZE);
+    LOC_GCCPHAT(SAMPLES_FRAME, FRAME_STATS.mean, peak, result);                                     // a common rotation of all channels keeps the delays
+    PROF_END(PROF_ZONE_LOCALIZE);
+    CLOCK_SetProfile(CLOCK_PROFILE_IDLE);
+    if (!SPH0645_FlatnessGate(result->flatness)) result->confidence = 0;
+}
+
+/*!
+ * @brief   samples all microphones and estimates up to LOC_SRP_SOURCES concurrent sources
+ *          with SRP-PHAT
+ * @param   sources     bearings and Q15 strengths, strongest first
+ * @note    no sources are reported while the window fills and for windows that fail the
+ *          activity gate
+ */
+void SPH0645_GetSources(loc_sources_t* sources)
+{
+    q15_t peak[SPH0645_BLOCKS];
+
+    memset(sources, 0, sizeof(*sources));
+    if (!SPH0645_NextWindow(peak)) return;
+
+    CLOCK_SetProfile(CLOCK_PROFILE_BOOST);
+    PROF_BEGIN(PROF_ZONE_LOCALIZE);
+    LOC_SRPPHAT(SAMPLES_FRAME, FRAME_STATS.mean, peak, sources);
+    PROF_END(PROF_ZONE_LOCALIZE);
+    CLOCK_SetProfile(CLOCK_PROFILE_IDLE);
+    if (!SPH0645_FlatnessGate(sources->flatness)) sources->count = 0;
+}
+
+/*!
+ * @brief   gets the bearing tracker of the primary source
+ * @return  const loc_track_t*  filtered bearing and last emitted direction
+ */
+const loc_track_t* SPH0645_GetTrack(void)
+{
+    return &TRACKS[0];
+}
+
+/*!
+ * @brief   samples all microphones, determines the angle with the selected localizer and
+ *          passes it through the bearing tracker
+ * @return  int         new motor direction, -1 if the direction did not change
+ * @note    a direction is only emitted once it has held past the sector hysteresis for
+ *          LOC_TRACK_PERSIST hops, so single noisy windows never reach the motors. While
+ *          listening a call takes one listening hop and returns -1.
  */
 int SPH0645_GetAngle(void)
 {
-    SPH0645_SampleAll();                                                                            // samples all microphones
-
-    SPH0645_Normalize(SAMPLES_A1, SPH0645_GetAverage(SAMPLES_A1));                                  // normalize block A1 samples
-    SPH0645_Normalize(SAMPLES_A2, SPH0645_GetAverage(SAMPLES_A2));                                  // normalize block A2 samples
-    SPH0645_Normalize(SAMPLES_B1, SPH0645_GetAverage(SAMPLES_B1));                                  // normalize block B1 samples
-    SPH0645_Normalize(SAMPLES_B2, SPH0645_GetAverage(SAMPLES_B2));                                  // normalize block B2 samples
-    
-    double rangeA1 = SPH0645_GetMaxSample(SAMPLES_A1) - SPH0645_GetMinSample(SAMPLES_A1);           // range of block A1 values
-    double rangeA2 = SPH0645_GetMaxSample(SAMPLES_A2) - SPH0645_GetMinSample(SAMPLES_A2);           // range of block A2 values
-    double rangeB1 = SPH0645_GetMaxSample(SAMPLES_B1) - SPH0645_GetMinSample(SAMPLES_B1);           // range of block B1 values
-    double rangeB2 = SPH0645_GetMaxSample(SAMPLES_B2) - SPH0645_GetMinSample(SAMPLES_B2);           // range of block B2 values
-
-    if      (RatioSquared(rangeA2,rangeA1)>T1 && RatioSquared(rangeB2,rangeB1)<T4 &&                // compare ranges to thresholds to determine angle
-             RatioSquared(rangeB1,rangeB2)<T4 ||(RatioSquared(rangeA2,rangeA1)>T5 &&
-             RatioSquared(rangeB2,rangeB1)<T2 && RatioSquared(rangeB1,rangeB2)<T2)) return 180;
-    else if (RatioSquared(rangeA1,rangeA2)>T1 && RatioSquared(rangeB2,rangeB1)<T4 &&
-             RatioSquared(rangeB1,rangeB2)<T4 ||(RatioSquared(rangeA2,rangeA1)>T5 &&
-             RatioSquared(rangeB2,rangeB1)<T2 && RatioSquared(rangeB1,rangeB2)<T2)) return 0;
-    else if (RatioSquared(rangeB2,rangeB1)>T1 && RatioSquared(rangeA2,rangeA1)<T4 &&
-             RatioSquared(rangeA1,rangeA2)<T4 ||(RatioSquared(rangeB2,rangeB1)>T5 &&
-             RatioSquared(rangeA2,rangeA1)<T2 && RatioSquared(rangeA1,rangeA2)<T2)) return 270;
-    else if (RatioSquared(rangeB1,rangeB2)>T1 && RatioSquared(rangeA2,rangeA1)<T4 &&
-             RatioSquared(rangeA1,rangeA2)<T4 ||(RatioSquared(rangeB2,rangeB1)>T5 &&
-             RatioSquared(rangeA2,rangeA1)<T2 && RatioSquared(rangeA1,rangeA2)<T2)) return 90;
-    else if (RatioSquared(rangeA1,rangeA2)>T3 && RatioSquared(rangeB1,rangeB2)>T3)  return 45;
-    else if (RatioSquared(rangeA2,rangeA1)>T3 && RatioSquared(rangeB1,rangeB2)>T3)  return 135;
-    else if (RatioSquared(rangeA2,rangeA1)>T3 && RatioSquared(rangeB2,rangeB1)>T3)  return 225;
-    else if (RatioSquared(rangeA1,rangeA2)>T3 && RatioSquared(rangeB2,rangeB1)>T3)  return 315;
-    else return -1;
+#if SPH0645_LOCALIZER == SPH0645_LOCALIZER_SRPPHAT
+    loc_sources_t sources;
+    int directions[LOC_SRP_SOURCES];
+    SPH0645_GetSources(&sources);
+    confidence = sources.count ? sources.source[0].strength : 0;
+    PROF_BEGIN(PROF_ZONE_TRACK);
+    LOC_TrackSources(TRACKS, &sources, directions);
+    PROF_END(PROF_ZONE_TRACK);
+    return directions[0];
+#else
+    loc_result_t result;
+#if SPH0645_LOCALIZER == SPH0645_LOCALIZER_GCCPHAT
+    SPH0645_GetBearing(&result);
+#else
+    memset(&result, 0, sizeof(result));
+    activity = (uint8_t)SPH0645_Advance();                                                          // energy only, the ratio path has no spectrum
+    int angle = -1;
+    if (activity)
+    {
+        PROF_BEGIN(PROF_ZONE_LOCALIZE);
+        angle = SPH0645_RatioAngle();
+        PROF_END(PROF_ZONE_LOCALIZE);
+    }
+    if (angle >= 0)
+    {
+        result.bearing = (int16_t)angle;
+        result.confidence = Q15_ONE;                                                                // the decision tree has no confidence
+    }
+#endif
+    confidence = result.confidence;
+    PROF_BEGIN(PROF_ZONE_TRACK);
+    int direction = LOC_TrackUpdate(&TRACKS[0], &result);
+    PROF_END(PROF_ZONE_TRACK);
+    return direction;
+#endif
+}
+
+/*!
+ * @brief   gets the confidence of the latest primary bearing
+ * @return  uint16_t    Q15 confidence, or the strength of the strongest SRP-PHAT source,
+ *                      0 if the latest window gave no bearing
+ */
+uint16_t SPH0645_GetConfidence(void)
+{
+    return confidence;
+}
+
+/*!
+ * @brief   gets the current direction of the second strongest source
+ * @return  int         motor direction, -1 if there is no second source
+ * @note    only the SRP-PHAT localizer tracks a second source. The direction is held while
+ *          the source is briefly quiet and cleared once its track times out.
+ */
+int SPH0645_GetSecondaryAngle(void)
+{
+#if SPH0645_LOCALIZER == SPH0645_LOCALIZER_SRPPHAT
+    return TRACKS[1].locked ? TRACKS[1].direction : -1;
+#else
+    return -1;
+#endif
 }
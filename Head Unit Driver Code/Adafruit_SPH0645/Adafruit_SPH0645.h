@@ -6,86 +6,257 @@
  * 
  *          PINOUT      LABEL           PORT/PIN
  *          ------------------------------------
- *          SAI1_SCK_A  Block A1        PE5
+ *          SAI1_SCK_A  All blocks      PE5
  *          SAI1_FS_A   --              PE4
- *          SAI1_SD_A   --              PE6
- *          SAI1_SCK_B  Block B1        PF8
- *          SAI1_FS_B   --              PF9
- *          SAI1_SD_B   --              PE3
- *          SAI2_SCK_A  Block A2        PB13
- *          SAI2_FS_A   --              PB12
- *          SAI2_SD_A   --              PB15
- *          SAI2_SCK_B  Block B2        PG2
- *          SAI2_FS_B   --              PG3
- *          SAI2_SD_B   --              PG5
+ *          SAI1_SD_A   Block A1        PE6
+ *          SAI1_SD_B   Block B1        PE3
+ *          SAI2_SD_A   Block A2        PB15
+ *          SAI2_SD_B   Block B2        PG5
+ *
+ *          SAI1 Block A is the only clock master. SAI1 Block B runs synchronous to it and
+ *          SAI2 is synchronized through SynchroExt, so all four microphones take BCLK/WS
+ *          from PE5/PE4 and are sampled on the same edge.
  *
  * @author  Miles Hanbury (mhanbury)
  * @author  James Kelly (jkellymi)
  * @author  Joshua Nye (nyej)
  */
 
+#ifndef ADAFRUIT_SPH0645_H
+#define ADAFRUIT_SPH0645_H
+
 #include "stm32l4xx_hal.h"
+#include "Localization.h"
+#include "SPH0645_DSP.h"
+#include "Flash_Storage.h"
+#include "Clock_Manager.h"
 
 /* --------------------------------- Localization Definitions ---------------------------------- */
 #define SAMPLES 1024
 
-#define T1     (double)(2.80)
-#define T2     (double)(1.15)
-#define T3     (double)(1.50)
-#define T4     (double)(2.60)
-#define T5     (double)(2.10)
+#define SPH0645_LOCALIZER_RATIO     0                                                               // peak-to-peak range ratios, SPH0645_RatioTable.h
+#define SPH0645_LOCALIZER_GCCPHAT   1                                                               // GCC-PHAT time difference of arrival
+#define SPH0645_LOCALIZER_SRPPHAT   2                                                               // SRP-PHAT, primary and secondary source
+
+#ifndef SPH0645_LOCALIZER
+#define SPH0645_LOCALIZER   SPH0645_LOCALIZER_GCCPHAT
+#endif
+
+#define SPH0645_Q8(x)   ((uint32_t)((x)*256.0 + 0.5))                                              // ratio threshold in Q8, folded at compile time
+
+#define T1     SPH0645_Q8(2.80)                                                                     // hand thresholds, only read by Bench/tune_ratio.py
+#define T2     SPH0645_Q8(1.15)
+#define T3     SPH0645_Q8(1.50)
+#define T4     SPH0645_Q8(2.60)
+#define T5     SPH0645_Q8(2.10)
+
+/* --------------------------------- Activity Gate Definitions --------------------------------- */
+#define SPH0645_VAD_SNR         SPH0645_Q8(4.0)                                                     // window energy over the noise floor for activity, 6 dB
+#define SPH0645_VAD_SNR_LOUD    SPH0645_Q8(32.0)                                                    // above 15 dB the flatness test is skipped (claps, knocks)
+#define SPH0645_VAD_FLATNESS    (Q15_ONE*45/100)                                                    // flatter cross spectra are treated as noise, white ~0.58
+#define SPH0645_VAD_MIN_ENERGY  64                                                                  // absolute floor in Q30, about -72 dBFS RMS
+#define SPH0645_VAD_RISE_SHIFT  7                                                                   // noise floor rises 1/128 per hop (~3 s to 6 dB)
+#define SPH0645_VAD_FALL_SHIFT  2                                                                   // noise floor falls 1/4 of the way per hop
+#define SPH0645_LEVEL_SILENT    (-1000)                                                             // 0.1 dBFS, level of a window without energy
+
+/* ------------------------------------ Capture Definitions ------------------------------------ */
+#define SPH0645_BLOCKS          SPH0645_CHANNELS                                                    // number of SAI blocks (one microphone each)
+#ifndef SPH0645_HOP
+#define SPH0645_HOP             256                                                                 // samples between bearing updates, 16 ms
+#endif
+#define SPH0645_HOPS            (SAMPLES/SPH0645_HOP)                                               // hops in one analysis window
+#define SPH0645_DMA_LENGTH      (2*SPH0645_HOP)                                                     // circular DMA buffer length, one hop per half
+
+#define SPH0645_BLOCK_A1        0                                                                   // capture block indices, also the
+#define SPH0645_BLOCK_A2        1                                                                   // channel order of an interleaved frame
+#define SPH0645_BLOCK_B1        2
+#define SPH0645_BLOCK_B2        3
+
+/* ----------------------------------- Listening Definitions ----------------------------------- */
+#ifndef SPH0645_LISTEN
+#define SPH0645_LISTEN          1                                                                   // after a quiet spell only block A1 captures until a sound
+#endif
+#define SPH0645_LISTEN_IDLE     128                                                                 // quiet hops before listening, ~2 s, past LOC_TRACK_TIMEOUT
+#define SPH0645_LISTEN_HOP      128                                                                 // samples per listening check, 8 ms
+#define SPH0645_LISTEN_LENGTH   (2*SPH0645_LISTEN_HOP)                                              // listening DMA length, reuses the A1 buffer
+#define SPH0645_LISTEN_SNR      SPH0645_VAD_SNR                                                     // hop energy over the noise floor that wakes the array
+
+/* ---------------------------------- Calibration Definitions ---------------------------------- */
+#define SPH0645_GAIN_UNITY      0x10000                                                             // Q16 sample gain of an uncalibrated capsule
+#define SPH0645_GAIN_MIN        (SPH0645_GAIN_UNITY/4)                                              // more than 12 dB of mismatch is a faulty capsule
+#define SPH0645_CAL_HOPS        256                                                                 // windows averaged by a calibration, about 4 s
+#define SPH0645_CAL_MIN_ENERGY  (64*SPH0645_VAD_MIN_ENERGY)                                         // Q30, the reference must be about 18 dB above it
+
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef struct SPH0645_CALIBRATION_STRUCT
+{
+    int32_t  gain[SPH0645_BLOCKS];                                                                  // Q16, at most unity so samples cannot clip
+    q15_t    offset[SPH0645_BLOCKS];                                                                // DC level before the gain
+} sph0645_calibration_t;
 
 /* ------------------------------------ Function Prototypes ------------------------------------ */
 /*!
- * @brief   samples a microphone
- * @param   hsai    block to sample
- * @return  int  sample value
+ * @brief   switches the DMA channel of every SAI block to circular mode and starts capturing
+ *          into the double buffers
+ * @return  HAL_StatusTypeDef   HAL_OK if all four blocks were started
+ */
+HAL_StatusTypeDef SPH0645_StartCapture(void);
+
+/*!
+ * @brief   stops the DMA capture on all SAI blocks
+ */
+void SPH0645_StopCapture(void);
+
+/*!
+ * @brief   loads the capsule calibration from flash
+ * @return  HAL_StatusTypeDef   HAL_OK if a calibration was stored, otherwise unity gains
+ *                              are used
+ * @note    call before SPH0645_StartCapture so the first window is already matched
+ */
+HAL_StatusTypeDef SPH0645_LoadCalibration(void);
+
+/*!
+ * @brief   measures the sensitivity and DC offset of every capsule, applies the result and
+ *          stores it in flash
+ * @param   hops                number of windows to average, SPH0645_CAL_HOPS is ~4 s
+ * @return  HAL_StatusTypeDef   HAL_ERROR if the reference was too quiet or a capsule is off
+ *                              by more than 12 dB, the previous calibration is kept then
+ * @note    capture must be running. All four capsules have to receive the same level, so
+ *          use diffuse noise (a fan, or pink noise from several speakers around the head) or a
+ *          tone from straight above, not a source off to one side.
+ */
+HAL_StatusTypeDef SPH0645_Calibrate(uint16_t hops);
+
+/*!
+ * @brief   gets the capsule calibration in use
+ * @return  const sph0645_calibration_t*    per-block Q16 gain and DC offset
+ */
+const sph0645_calibration_t* SPH0645_GetCalibration(void);
+
+/*!
+ * @brief   checks if a complete frame is waiting to be unpacked
+ * @return  int     1 if all four blocks have finished the same buffer half
+ */
+int SPH0645_FrameAvailable(void);
+
+/*!
+ * @brief   number of frames that were overwritten before they were unpacked
+ * @return  uint32_t    overrun count
  */
-int SPH0645_Sample(SAI_HandleTypeDef* hsai);
+uint32_t SPH0645_GetOverruns(void);
 
 /*!
- * @brief   samples all block sets
+ * @brief   called from the DMA interrupt once all four blocks have finished the same half
+ * @param   half    buffer half that was completed (0 = first, 1 = second)
+ * @note    weak, can be overridden by the application to be notified of new frames
+ */
+void SPH0645_FrameCpltCallback(uint8_t half);
+
+/*!
+ * @brief   waits for the next hop, writes it over the oldest hop of the sliding window and
+ *          updates the window statistics
  */
 void SPH0645_SampleAll(void);
 
 /*!
- * @brief   gets the average of a sample set
- * @param   _samples    sample set
- * @return  double      average
+ * @brief   checks if the sliding window has been completely filled since capture started
+ * @return  int     1 once SPH0645_HOPS hops have been sampled
+ */
+int SPH0645_WindowFull(void);
+
+/*!
+ * @brief   checks if the last localized window passed the activity gate
+ * @return  int     1 if sound activity was detected
+ */
+int SPH0645_Active(void);
+
+/*!
+ * @brief   checks if the array is listening on a single microphone
+ * @return  int     1 while only block A1 is capturing
+ */
+int SPH0645_Listening(void);
+
+/*!
+ * @brief   gets the adaptive noise floor of the activity gate
+ * @return  uint32_t    mean square of the background across all blocks, Q30
+ */
+uint32_t SPH0645_GetNoiseFloor(void);
+
+/*!
+ * @brief   gets the energy of the latest window
+ * @return  uint32_t    mean square of the window across all blocks, Q30
+ */
+uint32_t SPH0645_GetEnergy(void);
+
+/*!
+ * @brief   gets the level of the latest window
+ * @return  int16_t     RMS level across all blocks in 0.1 dBFS, SPH0645_LEVEL_SILENT if the
+ *                      window has no energy
+ * @note    a full-scale mean square of 1.0 is 0 dBFS. The capsule gains of the stored
+ *          calibration are applied before the energy is taken, so the level does not depend
+ *          on which capsule is the most sensitive.
+ */
+int16_t SPH0645_GetLevel(void);
+
+/*!
+ * @brief   gets the sliding window frame
+ * @return  q15_t*  interleaved Q15 frame, sample i of block b is at [i*SPH0645_BLOCKS + b]
+ * @note    the frame is a ring of hops, so it is circularly rotated in time. Statistics and
+ *          GCC-PHAT do not depend on the rotation since every channel is rotated the same.
  */
-double SPH0645_GetAverage(int* _samples);
+q15_t* SPH0645_GetFrame(void);
 
 /*!
- * @brief   normalize sample set by subtracting the average from each sample
- * @param   _samples    sample set
- * @param   avg         average of set
+ * @brief   gets the statistics of the sliding window frame
+ * @return  const sph0645_stats_t*  per-block mean, DC-removed min/max, RMS and zero crossings
  */
-void SPH0645_Normalize(int* _samples, double avg);
+const sph0645_stats_t* SPH0645_GetStats(void);
 
 /*!
- * @brief   normalize all block sets
+ * @brief   samples all microphones and estimates a continuous bearing with GCC-PHAT
+ * @param   result      bearing in degrees and Q15 confidence
+ * @note    the confidence is 0 while the window fills and for windows that fail the
+ *          activity gate
  */
-void SPH0645_NormalizeAll();
+void SPH0645_GetBearing(loc_result_t* result);
 
 /*!
- * @brief   gets the minumum value of a sample set
- * @param   _samples    sample set
- * @return  double      minimum value in set
+ * @brief   samples all microphones and estimates up to LOC_SRP_SOURCES concurrent sources
+ *          with SRP-PHAT
+ * @param   sources     bearings and Q15 strengths, strongest first
+ * @note    no sources are reported while the window fills and for windows that fail the
+ *          activity gate
  */
-double SPH0645_GetMinSample(int* _samples);
+void SPH0645_GetSources(loc_sources_t* sources);
 
 /*!
- * @brief   gets the maximum value of a sample set
- * @param   _samples    sample set 
- * @return  double      maximum value in set
+ * @brief   gets the bearing tracker of the primary source
+ * @return  const loc_track_t*  filtered bearing and last emitted direction
  */
-double SPH0645_GetMaxSample(int* _samples);
+const loc_track_t* SPH0645_GetTrack(void);
 
 /*!
- * @brief   compares sample ranges to threshold to determine angle
- * @return  int         determined angle
- * @note    returns -1 if no angle is determined as to allow caller to determine default
+ * @brief   samples all microphones, determines the angle with the selected localizer and
+ *          passes it through the bearing tracker
+ * @return  int         new motor direction, -1 if the direction did not change
+ * @note    while listening a call sleeps through one listening hop and returns -1
  */
 int SPH0645_GetAngle(void);
 
+/*!
+ * @brief   gets the confidence of the latest primary bearing
+ * @return  uint16_t    Q15 confidence, or the strength of the strongest SRP-PHAT source,
+ *                      0 if the latest window gave no bearing
+ */
+uint16_t SPH0645_GetConfidence(void);
+
+/*!
+ * @brief   gets the current direction of the second strongest source
+ * @return  int         motor direction, -1 if there is no second source
+ * @note    only the SRP-PHAT localizer tracks a second source
+ */
+int SPH0645_GetSecondaryAngle(void);
+
+#endif
+
 /* --------------------------------------------------------------------------------------------- */
@@ -0,0 +1,268 @@
+/*!
+ * @file    SPH0645_DSP.c
+ * @brief   Frame processing kernels for the Adafruit SPH0645 microphone array
+ * @note    This file has no HAL dependency. On the STM32 L4R5ZI-P the kernels use the
+ *          Cortex-M4 DSP extension; everywhere else a portable C version with identical
+ *          results is compiled.
+ *
+ *          An interleaved frame holds two 32-bit words per sample instant, (A1|A2) and
+ *          (B1|B2), so min/max run lane-wise with __SSUB16/__SEL directly on the frame.
+ *          For sums, energy and zero crossings two instants are repacked with __PKHBT/__PKHTB
+ *          into same-channel pairs and accumulated with __SMLAD/__SMLALD.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#include "SPH0645_DSP.h"
+#include <string.h>
+
+#if defined(__ARM_FEATURE_DSP)
+#include "stm32l4xx.h"                                                                              // CMSIS core intrinsics
+#endif
+
+/* ---------------------------------- Function Implementations --------------------------------- */
+/*!
+ * @brief   saturates a value to the Q15 range
+ * @param   x           value
+ * @return  q15_t       saturated value
+ */
+static inline q15_t SPH0645_Sat16(int32_t x)
+{
+    return (q15_t)(x > 32767 ? 32767 : (x < -32768 ? -32768 : x));
+}
+
+/*!
+ * @brief   converts DC-referenced accumulators of one pass into raw moments
+ * @param   moments     block moments
+ * @param   ch          channel
+ * @param   n           samples per channel
+ * @param   dc          DC reference the accumulators were taken around
+ * @param   sum         sum of DC-referenced samples
+ * @param   sumsq       sum of squared DC-referenced samples
+ * @param   lo          raw minimum
+ * @param   hi          raw maximum
+ * @param   zc          zero crossings around the DC reference
+ * @note    exact as long as no sample saturated when the reference was subtracted
+ */
+static void SPH0645_Store(sph0645_moments_t* moments, int ch, uint32_t n, int32_t dc, int32_t sum,
+    uint64_t sumsq, int32_t lo, int32_t hi, uint32_t zc)
+{
+    moments->sum[ch] = sum + (int32_t)n*dc;
+    moments->sumsq[ch] = (int64_t)sumsq + 2*(int64_t)dc*sum + (int64_t)n*dc*dc;
+    moments->min[ch] = (q15_t)lo;
+    moments->max[ch] = (q15_t)hi;
+    moments->crossings[ch] = (uint16_t)zc;
+}
+
+#if defined(__ARM_FEATURE_DSP)
+/*!
+ * @brief   loads two packed Q15 samples as one word
+ * @param   p           first sample
+ * @return  uint32_t    p[0] in the low half, p[1] in the high half
+ */
+static inline uint32_t SPH0645_Read2(const q15_t* p)
+{
+    uint32_t w;
+    memcpy(&w, p, sizeof(w));                                                                       // single LDR, no aliasing issues
+    return w;
+}
+
+/*!
+ * @brief   counts sign changes inside a same-channel pair and against the previous pair
+ * @param   pair        (x[t] | x[t+1] << 16)
+ * @param   prev        previous pair, its high half is x[t-1]
+ * @return  uint32_t    0, 1 or 2 crossings
+ */
+static inline uint32_t SPH0645_Crossings(uint32_t pair, uint32_t prev)
+{
+    return ((pair ^ (pair << 16)) >> 31) + (((pair << 16) ^ prev) >> 31);
+}
+
+/*!
+ * @brief   accumulates the raw moments of a block of an interleaved Q15 frame in one pass
+ * @param   frame       interleaved 4-channel Q15 samples, 4-byte aligned
+ * @param   n           samples per channel, must be even
+ * @param   dc          per-channel DC reference for the zero crossings
+ * @param   moments     raw sums, extremes and crossings of the block
+ */
+void SPH0645_Moments(const q15_t* frame, uint32_t n, const q15_t* dc, sph0645_moments_t* moments)
+{
+    const uint32_t ONES = 0x00010001;
+    uint32_t dcA = (uint16_t)dc[0] | ((uint32_t)(uint16_t)dc[1] << 16);                             // packed DC references
+    uint32_t dcB = (uint16_t)dc[2] | ((uint32_t)(uint16_t)dc[3] << 16);
+
+    uint32_t maxA = SPH0645_Read2(frame), minA = maxA;
+    uint32_t maxB = SPH0645_Read2(frame + 2), minB = maxB;
+
+    uint32_t yA = __QSUB16(maxA, dcA), yB = __QSUB16(maxB, dcB);
+    uint32_t prevA1 = yA << 16, prevA2 = yA & 0xFFFF0000;                                           // first samples, so no crossing is counted
+    uint32_t prevB1 = yB << 16, prevB2 = yB & 0xFFFF0000;
+
+    int32_t  sA1 = 0, sA2 = 0, sB1 = 0, sB2 = 0;
+    uint64_t eA1 = 0, eA2 = 0, eB1 = 0, eB2 = 0;
+    uint32_t zA1 = 0, zA2 = 0, zB1 = 0, zB2 = 0;
+
+    for (const q15_t* p = frame; p < frame + n*SPH0645_CHANNELS; p += 2*SPH0645_CHANNELS)
+    {
+        uint32_t w0 = SPH0645_Read2(p),     w1 = SPH0645_Read2(p + 2);                              // (A1|A2), (B1|B2) at t
+        uint32_t w2 = SPH0645_Read2(p + 4), w3 = SPH0645_Read2(p + 6);                              // (A1|A2), (B1|B2) at t+1
+
+        __SSUB16(w0, maxA); maxA = __SEL(w0, maxA);                                                 // lane-wise extremes
+        __SSUB16(minA, w0); minA = __SEL(w0, minA);
+        __SSUB16(w2, maxA); maxA = __SEL(w2, maxA);
+        __SSUB16(minA, w2); minA = __SEL(w2, minA);
+        __SSUB16(w1, maxB); maxB = __SEL(w1, maxB);
+        __SSUB16(minB, w1); minB = __SEL(w1, minB);
+        __SSUB16(w3, maxB); maxB = __SEL(w3, maxB);
+        __SSUB16(minB, w3); minB = __SEL(w3, minB);
+
+        uint32_t y0 = __QSUB16(w0, dcA), y2 = __QSUB16(w2, dcA);                                    // remove DC with saturation
+        uint32_t y1 = __QSUB16(w1, dcB), y3 = __QSUB16(w3, dcB);
+
+        uint32_t a1 = __PKHBT(y0, y2, 16), a2 = __PKHTB(y2, y0, 16);                                // regroup into (x[t] | x[t+1])
+        uint32_t b1 = __PKHBT(y1, y3, 16), b2 = __PKHTB(y3, y1, 16);
+
+        sA1 = __SMLAD(a1, ONES, sA1); eA1 = __SMLALD(a1, a1, eA1);
+        sA2 = __SMLAD(a2, ONES, sA2); eA2 = __SMLALD(a2, a2, eA2);
+        sB1 = __SMLAD(b1, ONES, sB1); eB1 = __SMLALD(b1, b1, eB1);
+        sB2 = __SMLAD(b2, ONES, sB2); eB2 = __SMLALD(b2, b2, eB2);
+
+        zA1 += SPH0645_Crossings(a1, prevA1); prevA1 = a1;
+        zA2 += SPH0645_Crossings(a2, prevA2); prevA2 = a2;
+        zB1 += SPH0645_Crossings(b1, prevB1); prevB1 = b1;
+        zB2 += SPH0645_Crossings(b2, prevB2); prevB2 = b2;
+    }
+
+    SPH0645_Store(moments, 0, n, dc[0], sA1, eA1, (int16_t)minA, (int16_t)maxA, zA1);
+    SPH0645_Store(moments, 1, n, dc[1], sA2, eA2, (int16_t)(minA >> 16), (int16_t)(maxA >> 16), zA2);
+    SPH0645_Store(moments, 2, n, dc[2], sB1, eB1, (int16_t)minB, (int16_t)maxB, zB1);
+    SPH0645_Store(moments, 3, n, dc[3], sB2, eB2, (int16_t)(minB >> 16), (int16_t)(maxB >> 16), zB2);
+}
+#else
+/*!
+ * @brief   accumulates the raw moments of a block of an interleaved Q15 frame in one pass
+ * @param   frame       interleaved 4-channel Q15 samples, 4-byte aligned
+ * @param   n           samples per channel, must be even
+ * @param   dc          per-channel DC reference for the zero crossings
+ * @param   moments     raw sums, extremes and crossings of the block
+ */
+void SPH0645_Moments(const q15_t* frame, uint32_t n, const q15_t* dc, sph0645_moments_t* moments)
+{
+    for (int ch = 0; ch < SPH0645_CHANNELS; ch++)
+    {
+        const q15_t* x = frame + ch;
+        int32_t ref = dc[ch];
+        int32_t lo = x[0], hi = x[0], sum = 0;
+        uint64_t sumsq = 0;
+        uint32_t zc = 0;
+        int prevNeg = SPH0645_Sat16(x[0] - ref) < 0;
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            int32_t v = x[i*SPH0645_CHANNELS];
+            int32_t y = SPH0645_Sat16(v - ref);
+            if (v < lo) lo = v;
+            if (v > hi) hi = v;
+            sum += y;
+            sumsq += (uint64_t)(y*y);
+            zc += (y < 0) != prevNeg;
+            prevNeg = y < 0;
+        }
+        SPH0645_Store(moments, ch, n, ref, sum, sumsq, lo, hi, zc);
+    }
+}
+#endif
+
+/*!
+ * @brief   adds one block to the running moments of a window and removes another
+ * @param   window      running window moments
+ * @param   enter       moments of the block entering the window
+ * @param   leave       moments of the block leaving the window, NULL while the window fills
+ */
+void SPH0645_MomentsUpdate(sph0645_moments_t* window, const sph0645_moments_t* enter,
+    const sph0645_moments_t* leave)
+{
+    for (int ch = 0; ch < SPH0645_CHANNELS; ch++)
+    {
+        window->sum[ch] += enter->sum[ch];
+        window->sumsq[ch] += enter->sumsq[ch];
+        window->crossings[ch] += enter->crossings[ch];
+        if (leave)
+        {
+            window->sum[ch] -= leave->sum[ch];
+            window->sumsq[ch] -= leave->sumsq[ch];
+            window->crossings[ch] -= leave->crossings[ch];
+        }
+    }
+}
+
+/*!
+ * @brief   turns window moments into frame statistics
+ * @param   window      running window moments
+ * @param   blocks      moments of every block currently in the window
+ * @param   count       number of blocks
+ * @param   n           samples per channel in the window
+ * @param   stats       frame statistics
+ */
+void SPH0645_WindowStats(const sph0645_moments_t* window, const sph0645_moments_t* blocks,
+    uint32_t count, uint32_t n, sph0645_stats_t* stats)
+{
+    for (int ch = 0; ch < SPH0645_CHANNELS; ch++)
+    {
+        int32_t lo = blocks[0].min[ch], hi = blocks[0].max[ch];
+        for (uint32_t b = 1; b < count; b++)                                                        // extremes are reduced, not running
+        {
+            if (blocks[b].min[ch] < lo) lo = blocks[b].min[ch];
+            if (blocks[b].max[ch] > hi) hi = blocks[b].max[ch];
+        }
+
+        int64_t sum = window->sum[ch];
+        int32_t mean = (int32_t)(sum/(int64_t)n);
+        int64_t var = window->sumsq[ch] - (sum*sum)/(int64_t)n;
+
+        stats->mean[ch] = (q15_t)mean;
+        stats->min[ch] = SPH0645_Sat16(lo - mean);
+        stats->max[ch] = SPH0645_Sat16(hi - mean);
+        stats->energy[ch] = var > 0 ? (uint32_t)(var/(int64_t)n) : 0;
+        stats->rms[ch] = SPH0645_Sat16((int32_t)SPH0645_Sqrt(stats->energy[ch]));
+        stats->crossings[ch] = window->crossings[ch];
+    }
+}
+
+/*!
+ * @brief   computes mean, DC-removed min/max, RMS energy and zero crossings of all four
+ *          channels in one pass over an interleaved Q15 frame
+ * @param   frame       interleaved 4-channel Q15 frame, 4-byte aligned
+ * @param   n           samples per channel, must be even
+ * @param   stats       frame statistics, means on entry are the DC reference
+ */
+void SPH0645_FrameStats(const q15_t* frame, uint32_t n, sph0645_stats_t* stats)
+{
+    sph0645_moments_t moments;
+    SPH0645_Moments(frame, n, stats->mean, &moments);
+    SPH0645_WindowStats(&moments, &moments, 1, n, stats);
+}
+
+/*!
+ * @brief   integer square root
+ * @param   x           value
+ * @return  uint32_t    floor(sqrt(x))
+ */
+uint32_t SPH0645_Sqrt(uint32_t x)
+{
+    uint32_t root = 0, bit = 1u << 30;
+    while (bit > x) bit >>= 2;
+    while (bit)
+    {
+        if (x >= root + bit)
+        {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else root >>= 1;
+        bit >>= 2;
+    }
+    return root;
+}
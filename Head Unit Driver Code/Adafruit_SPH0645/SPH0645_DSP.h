@@ -0,0 +1,97 @@
+/*!
+ * @file    SPH0645_DSP.h
+ * @brief   Frame processing kernels for the Adafruit SPH0645 microphone array
+ * @note    This file has no HAL dependency. On the STM32 L4R5ZI-P the kernels use the
+ *          Cortex-M4 DSP extension; everywhere else a portable C version with identical
+ *          results is compiled.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#ifndef SPH0645_DSP_H
+#define SPH0645_DSP_H
+
+#include <stdint.h>
+#include "Localization.h"
+
+/* ------------------------------------- Kernel Definitions ------------------------------------ */
+#define SPH0645_CHANNELS        4                                                                   // interleaved A1/A2/B1/B2
+
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef struct SPH0645_STATS_STRUCT
+{
+    q15_t    mean[SPH0645_CHANNELS];                                                                // DC level
+    q15_t    min[SPH0645_CHANNELS];                                                                 // minimum with DC removed
+    q15_t    max[SPH0645_CHANNELS];                                                                 // maximum with DC removed
+    q15_t    rms[SPH0645_CHANNELS];                                                                 // RMS with DC removed
+    uint32_t energy[SPH0645_CHANNELS];                                                              // mean square with DC removed, Q30
+    uint16_t crossings[SPH0645_CHANNELS];                                                           // zero crossings around the DC level
+} sph0645_stats_t;
+
+typedef struct SPH0645_MOMENTS_STRUCT
+{
+    int32_t  sum[SPH0645_CHANNELS];                                                                 // sum of samples
+    int64_t  sumsq[SPH0645_CHANNELS];                                                               // sum of squared samples
+    q15_t    min[SPH0645_CHANNELS];                                                                 // raw minimum
+    q15_t    max[SPH0645_CHANNELS];                                                                 // raw maximum
+    uint16_t crossings[SPH0645_CHANNELS];                                                           // zero crossings around the DC reference
+} sph0645_moments_t;
+
+/* ------------------------------------ Function Prototypes ------------------------------------ */
+/*!
+ * @brief   computes mean, DC-removed min/max, RMS energy and zero crossings of all four
+ *          channels in one pass over an interleaved Q15 frame
+ * @param   frame       interleaved 4-channel Q15 frame, 4-byte aligned
+ * @param   n           samples per channel, must be even
+ * @param   stats       frame statistics
+ * @note    the means already in stats are used as the DC reference for the zero crossings,
+ *          so the statistics of the previous frame should be passed back in. The energy is
+ *          corrected to the new mean exactly.
+ */
+void SPH0645_FrameStats(const q15_t* frame, uint32_t n, sph0645_stats_t* stats);
+
+/*!
+ * @brief   accumulates the raw moments of a block of an interleaved Q15 frame in one pass
+ * @param   frame       interleaved 4-channel Q15 samples, 4-byte aligned
+ * @param   n           samples per channel, must be even
+ * @param   dc          per-channel DC reference for the zero crossings
+ * @param   moments     raw sums, extremes and crossings of the block
+ * @note    moments of consecutive blocks can be added and subtracted, so a sliding window
+ *          only has to process the samples that enter it
+ */
+void SPH0645_Moments(const q15_t* frame, uint32_t n, const q15_t* dc, sph0645_moments_t* moments);
+
+/*!
+ * @brief   adds one block to the running moments of a window and removes another
+ * @param   window      running window moments
+ * @param   enter       moments of the block entering the window
+ * @param   leave       moments of the block leaving the window, NULL while the window fills
+ * @note    min/max are not running values, they are reduced over the blocks by
+ *          SPH0645_WindowStats
+ */
+void SPH0645_MomentsUpdate(sph0645_moments_t* window, const sph0645_moments_t* enter,
+    const sph0645_moments_t* leave);
+
+/*!
+ * @brief   turns window moments into frame statistics
+ * @param   window      running window moments
+ * @param   blocks      moments of every block currently in the window
+ * @param   count       number of blocks
+ * @param   n           samples per channel in the window
+ * @param   stats       frame statistics
+ */
+void SPH0645_WindowStats(const sph0645_moments_t* window, const sph0645_moments_t* blocks,
+    uint32_t count, uint32_t n, sph0645_stats_t* stats);
+
+/*!
+ * @brief   integer square root
+ * @param   x           value
+ * @return  uint32_t    floor(sqrt(x))
+ */
+uint32_t SPH0645_Sqrt(uint32_t x);
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
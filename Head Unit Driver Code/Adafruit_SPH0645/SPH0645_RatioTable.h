@@ -0,0 +1,64 @@
+/*!
+ * @file    SPH0645_RatioTable.h
+ * @brief   Decision table of the ratio localizer
+ * @note    Generated by Bench/tune_ratio.py from T1..T5, do not edit.
+ *
+ *          Row is the bin of log2(range A2 / range A1), column the bin of
+ *          log2(range B2 / range B1). Bins are 1/8 octave wide, bin 0 holds everything
+ *          below -2 octaves and bin SPH0645_RATIO_BINS-1 everything above. Entries are the
+ *          motor direction in 45 degree steps from A1, -1 where no direction is reported.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#ifndef SPH0645_RATIOTABLE_H
+#define SPH0645_RATIOTABLE_H
+
+#include <stdint.h>
+
+/* ---------------------------------- Ratio Table Definitions ---------------------------------- */
+#define SPH0645_RATIO_BINS      32                                                                  // bins per log ratio
+#define SPH0645_RATIO_SHIFT     1                                                                   // Q4 log2 difference to bin
+#define SPH0645_RATIO_OFFSET    32                                                                  // Q4 log2 difference of bin 0
+
+static const int8_t SPH0645_RATIO_TABLE[SPH0645_RATIO_BINS][SPH0645_RATIO_BINS] =
+{
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+    { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,-1,-1,-1,-1,-1, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1,-1,-1,-1,-1,-1, 7, 7, 7, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1,-1,-1,-1,-1,-1, 7, 7, 7, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1,-1,-1,-1,-1,-1, 7, 7, 7, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3,-1,-1,-1,-1,-1, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3,-1,-1,-1,-1,-1, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+    { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3,-1, 4, 4,-1,-1, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6},
+    { 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5},
+    { 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5},
+    { 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5},
+    { 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5},
+    { 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5},
+    { 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5},
+    { 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5},
+    { 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5},
+    { 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5},
+    { 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5}
+};
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
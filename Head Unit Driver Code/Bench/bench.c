@@ -0,0 +1,435 @@
+/*!
+ * @file    bench.c
+ * @brief   Host replay bench for the head unit localization pipeline
+ * @note    Runs SPH0645_GetAngle() on a recorded 4-channel capture, hop by hop, exactly as
+ *          the head unit does, and compares the result against ground truth bearings.
+ *
+ *          The SAI DMA is emulated: every hop is written into the circular buffers the
+ *          driver registered with HAL_SAI_Receive_DMA and the half/full transfer callbacks
+ *          are called in the hardware order, so the capture, sliding window, activity gate,
+ *          localizer and tracker are the unmodified target sources.
+ *
+ *          CAPTURE     16 kHz PCM WAV, 4 channels in the order A1, A2, B1, B2, 16/24/32-bit
+ *          TRUTH       text file, one segment per line: <start s> <end s> <bearing deg>
+ *                      bearings use the array convention (0 = A1, 90 = B1), '#' comments,
+ *                      overlapping segments are concurrent sources, no segment is silence
+ *
+ *          REPORT      detection   hops inside a segment that passed the activity gate
+ *                      false       hops outside every segment that passed the gate, not
+ *                                  counting the window length after a segment ends
+ *                      error       |tracked bearing - nearest true bearing| while locked
+ *                      sector      emitted direction matched the true motor direction
+ *                      latency     segment start to the first correct direction
+ *                      ns/frame    wall time of SPH0645_GetAngle(), all hops and active hops
+ *                      listening   share of time on one microphone, wakes and the wakes
+ *                                  outside every segment, wall time of a listening hop
+ *
+ *          gcc -O2 -Wall -I. -I../Adafruit_SPH0645 -I../Localization -I../Flash_Storage
+ *              -I../Clock_Manager -I../Profiler -o bench bench.c
+ *              ../Adafruit_SPH0645/Adafruit_SPH0645.c
+ *              ../Adafruit_SPH0645/SPH0645_DSP.c ../Localization/Localization.c -lm
+ *
+ *          add -DSPH0645_LOCALIZER=0/1/2 to select the ratio, GCC-PHAT or SRP-PHAT localizer
+ *          and -DSPH0645_LISTEN=0 to keep all four microphones running. PROF_ENABLE is
+ *          target-only and stays 0, the bench times the hops with the host clock instead.
+ *
+ *          ./bench capture.wav truth.txt [-v]      -v prints one line per hop
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#include "Adafruit_SPH0645.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+/* ------------------------------------- Bench Definitions ------------------------------------- */
+#define BENCH_MAX_SEGMENTS      256                                                                 // truth segments per capture
+#define BENCH_SECTOR            45                                                                  // degrees between motor directions
+
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef struct BENCH_CAPTURE_STRUCT
+{
+    int32_t* samples;                                                                               // interleaved A1/A2/B1/B2, MSB-aligned as the SAI delivers
+    uint32_t frames;                                                                                // samples per channel
+    uint32_t rate;                                                                                  // Hz
+} bench_capture_t;
+
+typedef struct BENCH_SEGMENT_STRUCT
+{
+    double   start, end;                                                                            // seconds
+    int      bearing;                                                                               // degrees
+    int      direction;                                                                             // motor direction the bearing rounds to
+    double   latency;                                                                               // seconds to the first correct direction, <0 if never
+} bench_segment_t;
+
+/* -------------------------------------- Global Variables ------------------------------------- */
+static SAI_HandleTypeDef hsai_BlockA1, hsai_BlockA2, hsai_BlockB1, hsai_BlockB2;
+SAI_HandleTypeDef* HSAI_BLOCK_A1 = &hsai_BlockA1;
+SAI_HandleTypeDef* HSAI_BLOCK_A2 = &hsai_BlockA2;
+SAI_HandleTypeDef* HSAI_BLOCK_B1 = &hsai_BlockB1;
+SAI_HandleTypeDef* HSAI_BLOCK_B2 = &hsai_BlockB2;
+
+static DMA_HandleTypeDef hdma_BlockA1, hdma_BlockA2, hdma_BlockB1, hdma_BlockB2;
+
+static bench_segment_t SEGMENTS[BENCH_MAX_SEGMENTS];
+static int segment_count;
+static uint8_t dma_half;                                                                            // half the running blocks fill next
+
+/* --------------------------------------- HAL Emulation --------------------------------------- */
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef* hdma)
+{
+    (void)hdma;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SAI_Receive_DMA(SAI_HandleTypeDef* hsai, uint8_t* pData, uint16_t Size)
+{
+    hsai->buffer = (int32_t*)pData;
+    hsai->length = Size;
+    if (hsai == HSAI_BLOCK_A1) dma_half = 0;                                                        // the master starts every block on its first frame
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SAI_DMAStop(SAI_HandleTypeDef* hsai)
+{
+    hsai->buffer = NULL;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef STORAGE_Read(uint8_t key, void* data, uint16_t size)
+{
+    (void)key; (void)data; (void)size;
+    return HAL_ERROR;                                                                               // captures are replayed uncalibrated
+}
+
+HAL_StatusTypeDef STORAGE_Write(uint8_t key, const void* data, uint16_t size)
+{
+    (void)key; (void)data; (void)size;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef CLOCK_SetProfile(clock_profile_t profile)
+{
+    (void)profile;
+    return HAL_OK;                                                                                  // the host runs at one speed
+}
+
+void BENCH_WaitForInterrupt(void)
+{
+    fprintf(stderr, "bench: driver waited for a hop that was never delivered\n");
+    exit(1);
+}
+
+/*!
+ * @brief   emulates one DMA half transfer on every running block
+ * @param   capture     capture being replayed
+ * @param   frame       first sample of the transfer in the capture
+ * @return  uint32_t    samples per channel delivered, half the master's DMA length
+ * @note    blocks complete in the order they were started on the target, so the frame is
+ *          published by the last one exactly as it is there. Stopped blocks get nothing,
+ *          which is how listening on A1 alone looks to the driver.
+ */
+static uint32_t BENCH_DeliverHop(const bench_capture_t* capture, uint32_t frame)
+{
+    SAI_HandleTypeDef* blocks[SPH0645_BLOCKS] = {HSAI_BLOCK_A1, HSAI_BLOCK_A2,
+                                                 HSAI_BLOCK_B1, HSAI_BLOCK_B2};                     // channel order of the capture
+    SAI_HandleTypeDef* order[SPH0645_BLOCKS]  = {HSAI_BLOCK_B1, HSAI_BLOCK_A2,
+                                                 HSAI_BLOCK_B2, HSAI_BLOCK_A1};                     // SPH0645_StartCapture order
+    uint32_t hop = HSAI_BLOCK_A1->length / 2;
+    uint8_t half = dma_half;
+
+    dma_half ^= 1;
+    for (int block = 0; block < SPH0645_BLOCKS; block++)
+    {
+        if (blocks[block]->buffer == NULL) continue;
+        int32_t* dst = blocks[block]->buffer + half*hop;
+        const int32_t* src = capture->samples + (size_t)frame*SPH0645_BLOCKS + block;
+        for (uint32_t i = 0; i < hop; i++) dst[i] = src[i*SPH0645_BLOCKS];
+    }
+    for (int block = 0; block < SPH0645_BLOCKS; block++)
+    {
+        if (order[block]->buffer == NULL) continue;
+        if (half) HAL_SAI_RxCpltCallback(order[block]);
+        else      HAL_SAI_RxHalfCpltCallback(order[block]);
+    }
+    return hop;
+}
+
+/* ----------------------------------------- File Input ---------------------------------------- */
+/*!
+ * @brief   reads a 4-channel PCM WAV file
+ * @param   path        file name
+ * @param   capture     samples, MSB-aligned in 32 bits
+ * @return  int         0 on success, -1 with a message on failure
+ */
+static int BENCH_ReadWav(const char* path, bench_capture_t* capture)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) { perror(path); return -1; }
+
+    uint8_t header[12], chunk[8], format[16] = {0};
+    uint16_t tag = 0, channels = 0, bits = 0;
+    int found = 0;
+
+    if (fread(header, 1, 12, file) != 12 || memcmp(header, "RIFF", 4) ||
+        memcmp(header + 8, "WAVE", 4))
+    {
+        fprintf(stderr, "%s: not a WAV file\n", path);
+        fclose(file);
+        return -1;
+    }
+    while (fread(chunk, 1, 8, file) == 8)                                                           // walk the chunks up to "data"
+    {
+        uint32_t size = chunk[4] | chunk[5] << 8 | chunk[6] << 16 | (uint32_t)chunk[7] << 24;
+        if (!memcmp(chunk, "fmt ", 4))
+        {
+            if (size < 16 || fread(format, 1, 16, file) != 16) break;
+            fseek(file, (long)(size - 16 + (size & 1)), SEEK_CUR);
+            tag = (uint16_t)(format[0] | format[1] << 8);                                           // 1 = PCM, 0xFFFE = extensible
+            channels = (uint16_t)(format[2] | format[3] << 8);
+            capture->rate = format[4] | format[5] << 8 | format[6] << 16 |
+                            (uint32_t)format[7] << 24;
+            bits = (uint16_t)(format[14] | format[15] << 8);
+        }
+        else if (!memcmp(chunk, "data", 4))
+        {
+            uint32_t width = bits/8;
+            if ((tag != 1 && tag != 0xFFFE) || channels != SPH0645_BLOCKS ||
+                (width != 2 && width != 3 && width != 4))
+            {
+                fprintf(stderr, "%s: need 4-channel 16/24/32-bit PCM\n", path);
+                break;
+            }
+
+            capture->frames = size / (width*SPH0645_BLOCKS);
+            capture->samples = malloc((size_t)capture->frames*SPH0645_BLOCKS*sizeof(int32_t));
+            uint8_t* raw = malloc(size);
+            if (capture->samples == NULL || raw == NULL || fread(raw, 1, size, file) != size)
+            {
+                fprintf(stderr, "%s: short data chunk\n", path);
+                free(raw);
+                break;
+            }
+            for (uint32_t i = 0; i < capture->frames*SPH0645_BLOCKS; i++)                           // left-align to 32 bits like the SAI slot
+            {
+                uint32_t word = 0;
+                for (uint32_t b = 0; b < width; b++)
+                    word |= (uint32_t)raw[i*width + b] << (8*(4 - width + b));
+                capture->samples[i] = (int32_t)word;
+            }
+            free(raw);
+            found = 1;
+            break;
+        }
+        else fseek(file, (long)(size + (size & 1)), SEEK_CUR);
+    }
+    fclose(file);
+
+    if (!found) return -1;
+    if (capture->rate != LOC_SAMPLE_RATE)
+        fprintf(stderr, "%s: %u Hz capture, the pipeline assumes %d Hz\n", path, capture->rate,
+                LOC_SAMPLE_RATE);
+    return 0;
+}
+
+/*!
+ * @brief   reads the ground truth segments
+ * @param   path        file name
+ * @return  int         0 on success, -1 with a message on failure
+ */
+static int BENCH_ReadTruth(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) { perror(path); return -1; }
+
+    char line[256];
+    int number = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        ++number;
+        char* comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+
+        bench_segment_t segment;
+        int fields = sscanf(line, "%lf %lf %d", &segment.start, &segment.end, &segment.bearing);
+        if (fields <= 0) continue;                                                                  // blank or comment
+        if (fields != 3 || segment.end <= segment.start || segment_count == BENCH_MAX_SEGMENTS)
+        {
+            fprintf(stderr, "%s:%d: expected <start s> <end s> <bearing deg>\n", path, number);
+            fclose(file);
+            return -1;
+        }
+        segment.bearing = ((segment.bearing % 360) + 360) % 360;
+        segment.direction = (segment.bearing + BENCH_SECTOR/2) / BENCH_SECTOR % 8 * BENCH_SECTOR;
+        segment.latency = -1.0;
+        SEGMENTS[segment_count++] = segment;
+    }
+    fclose(file);
+    return 0;
+}
+
+/* ------------------------------------------ Metrics ------------------------------------------ */
+/*!
+ * @brief   absolute angle between two bearings
+ */
+static double BENCH_AngleError(double a, double b)
+{
+    double d = fmod(fabs(a - b), 360.0);
+    return d > 180.0 ? 360.0 - d : d;
+}
+
+static int64_t BENCH_Nanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+static int BENCH_CompareTimes(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* -------------------------------------------- Main ------------------------------------------- */
+int main(int argc, char** argv)
+{
+    bench_capture_t capture = {0};
+    int verbose = argc > 3 && !strcmp(argv[3], "-v");
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s capture.wav truth.txt [-v]\n", argv[0]);
+        return 2;
+    }
+    if (BENCH_ReadWav(argv[1], &capture) || BENCH_ReadTruth(argv[2])) return 1;
+
+    hsai_BlockA1.hdmarx = &hdma_BlockA1;
+    hsai_BlockA2.hdmarx = &hdma_BlockA2;
+    hsai_BlockB1.hdmarx = &hdma_BlockB1;
+    hsai_BlockB2.hdmarx = &hdma_BlockB2;
+    if (SPH0645_StartCapture() != HAL_OK) return 1;
+
+    int64_t* times = malloc((capture.frames / SPH0645_HOP + 1)*sizeof(int64_t));
+    int64_t  total = 0, active_total = 0, listen_total = 0;
+    uint32_t hops = 0, listen_hops = 0, listen_frames = 0, wakes = 0, false_wakes = 0;
+    uint32_t labeled = 0, detected = 0, silent = 0, false_alarms = 0;
+    uint32_t locked = 0, sector_hits = 0, active_hops = 0;
+    double   error_sum = 0.0, error_square = 0.0, error_max = 0.0;
+
+    if (verbose) printf("time_s,truth,active,bearing,direction,ns\n");
+    for (uint32_t frame = 0; frame + HSAI_BLOCK_A1->length / 2 <= capture.frames; )
+    {
+        int listen = SPH0645_Listening();
+        uint32_t hop = BENCH_DeliverHop(&capture, frame);
+        frame += hop;
+
+        int64_t start = BENCH_Nanoseconds();
+        int angle = SPH0645_GetAngle();
+        int64_t time = BENCH_Nanoseconds() - start;
+        (void)angle;
+
+        const loc_track_t* track = SPH0645_GetTrack();
+        double now = (double)frame / capture.rate;                                                  // end of the newest hop
+        double window = (double)SAMPLES / capture.rate;
+        int truth = -1, tail = 0, inside = 0;
+        double best = 360.0;
+
+        for (int s = 0; s < segment_count; s++)
+        {
+            if (now > SEGMENTS[s].end && now - window < SEGMENTS[s].end) tail = 1;                  // window still holds the sound
+            if (now >= SEGMENTS[s].start && now <= SEGMENTS[s].end) inside = 1;
+        }
+
+        if (listen)
+        {
+            ++listen_hops;
+            listen_frames += hop;
+            listen_total += time;
+            if (!SPH0645_Listening()) { ++wakes; false_wakes += (uint32_t)(!inside && !tail); }
+            continue;                                                                               // no window to report on
+        }
+
+        times[hops++] = time;
+        total += time;
+        if (SPH0645_Active()) { ++active_hops; active_total += time; }
+        if (!SPH0645_WindowFull()) continue;                                                        // nothing can be reported yet
+
+        for (int s = 0; s < segment_count; s++)                                                     // nearest concurrent source
+        {
+            if (now < SEGMENTS[s].start || now > SEGMENTS[s].end) continue;
+            double error = track->locked ?
+                           BENCH_AngleError(track->bearing, SEGMENTS[s].bearing) : 0.0;
+            if (truth < 0 || error < best) { truth = s; best = error; }
+            if (SEGMENTS[s].latency < 0.0 && track->direction == SEGMENTS[s].direction)
+                SEGMENTS[s].latency = now - SEGMENTS[s].start;
+        }
+
+        if (truth < 0)
+        {
+            if (tail) continue;                                                                     // neither a source nor silence
+            ++silent;
+            false_alarms += (uint32_t)SPH0645_Active();
+        }
+        else
+        {
+            ++labeled;
+            detected += (uint32_t)SPH0645_Active();
+            if (track->locked)
+            {
+                ++locked;
+                error_sum += best;
+                error_square += best*best;
+                if (best > error_max) error_max = best;
+                sector_hits += (uint32_t)(track->direction == SEGMENTS[truth].direction);
+            }
+        }
+
+        if (verbose)
+            printf("%.3f,%d,%d,%.1f,%d,%lld\n", now, truth < 0 ? -1 : SEGMENTS[truth].bearing,
+                   SPH0645_Active(), track->locked ? track->bearing : -1.0, track->direction,
+                   (long long)time);
+    }
+
+    double latency_sum = 0.0;
+    int    latency_count = 0;
+    for (int s = 0; s < segment_count; s++)
+        if (SEGMENTS[s].latency >= 0.0) { latency_sum += SEGMENTS[s].latency; ++latency_count; }
+
+    qsort(times, hops, sizeof(int64_t), BENCH_CompareTimes);
+
+    printf("localizer   %s, hop %d samples, %u hops (%.1f s)\n",
+           SPH0645_LOCALIZER == SPH0645_LOCALIZER_RATIO   ? "ratio"    :
+           SPH0645_LOCALIZER == SPH0645_LOCALIZER_GCCPHAT ? "GCC-PHAT" : "SRP-PHAT",
+           SPH0645_HOP, hops, (double)(hops*SPH0645_HOP + listen_frames) / capture.rate);
+    printf("detection   %5.1f %%  (%u/%u hops with a source)\n",
+           labeled ? 100.0*detected/labeled : 0.0, detected, labeled);
+    printf("false       %5.1f %%  (%u/%u silent hops)\n",
+           silent ? 100.0*false_alarms/silent : 0.0, false_alarms, silent);
+    printf("error       %5.1f deg mean, %.1f deg rms, %.1f deg max  (%u locked hops)\n",
+           locked ? error_sum/locked : 0.0, locked ? sqrt(error_square/locked) : 0.0, error_max,
+           locked);
+    printf("sector      %5.1f %%  (%u/%u locked hops)\n",
+           locked ? 100.0*sector_hits/locked : 0.0, sector_hits, locked);
+    printf("latency     %5.0f ms mean  (%d/%d segments reached)\n",
+           latency_count ? 1000.0*latency_sum/latency_count : 0.0, latency_count, segment_count);
+    printf("ns/frame    %lld mean, %lld median, %lld p99, %lld active mean\n",
+           hops ? (long long)(total/hops) : 0LL, hops ? (long long)times[hops/2] : 0LL,
+           hops ? (long long)times[hops - 1 - hops/100] : 0LL,
+           active_hops ? (long long)(active_total/active_hops) : 0LL);
+    printf("listening   %5.1f %%  (%u wakes, %u outside a segment, %lld ns/hop)\n",
+           listen_frames ? 100.0*listen_frames / (hops*SPH0645_HOP + listen_frames) : 0.0, wakes,
+           false_wakes,
+           listen_hops ? (long long)(listen_total/listen_hops) : 0LL);
+
+    free(times);
+    free(capture.samples);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------------------------- */
@@ -0,0 +1,98 @@
+/*!
+ * @file    stm32l4xx_hal.h
+ * @brief   Host stand-in for the parts of the STM32L4 HAL used by the SPH0645 driver
+ * @note    Only used by the replay bench. It is found before the real HAL because the bench
+ *          is compiled with -I. first. The SAI DMA is emulated by the bench, which fills the
+ *          buffers passed to HAL_SAI_Receive_DMA from a capture file and calls the half and
+ *          full transfer callbacks itself.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#ifndef STM32L4XX_HAL_H
+#define STM32L4XX_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(PROF_ENABLE) && PROF_ENABLE
+#error "the profiler reads the DWT cycle counter and is target-only, the bench reports ns/frame"
+#endif
+
+/* -------------------------------------- HAL Definitions -------------------------------------- */
+#define __weak                  __attribute__((weak))
+
+#define DMA_NORMAL              0x00000000U
+#define DMA_CIRCULAR            0x00000020U
+
+#define __HAL_RCC_SAI2_CLK_ENABLE()             ((void)0)                                           // clock gating has no host effect
+#define __HAL_RCC_SAI2_CLK_DISABLE()            ((void)0)
+#define __HAL_FLASH_SLEEP_POWERDOWN_ENABLE()    ((void)0)
+#define __HAL_FLASH_SLEEP_POWERDOWN_DISABLE()   ((void)0)
+
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef enum
+{
+    HAL_OK      = 0x00U,
+    HAL_ERROR   = 0x01U,
+    HAL_BUSY    = 0x02U,
+    HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+typedef struct
+{
+    uint32_t Mode;
+} DMA_InitTypeDef;
+
+typedef struct
+{
+    DMA_InitTypeDef Init;
+} DMA_HandleTypeDef;
+
+typedef struct __SAI_HandleTypeDef
+{
+    DMA_HandleTypeDef* hdmarx;
+    int32_t*           buffer;                                                                      // bench only, destination of the emulated DMA
+    uint16_t           length;                                                                      // bench only, buffer length in words
+} SAI_HandleTypeDef;
+
+/* ----------------------------------------- Intrinsics ---------------------------------------- */
+/*!
+ * @brief   signed saturation to a bit width, as the Cortex-M4 SSAT instruction
+ */
+static inline int32_t __SSAT(int32_t value, uint32_t bits)
+{
+    int32_t max = (int32_t)((1U << (bits - 1)) - 1);
+    if (value > max)      return max;
+    if (value < -max - 1) return -max - 1;
+    return value;
+}
+
+/*!
+ * @brief   count leading zeros, as the Cortex-M4 CLZ instruction
+ */
+static inline uint32_t __CLZ(uint32_t value)
+{
+    return value ? (uint32_t)__builtin_clz(value) : 32U;
+}
+
+/*!
+ * @brief   called whenever the driver would sleep waiting for a DMA interrupt
+ * @note    the bench delivers hops before calling the driver, so reaching this is a bench
+ *          error and it aborts instead of spinning forever
+ */
+void BENCH_WaitForInterrupt(void);
+#define __WFI()     BENCH_WaitForInterrupt()
+
+/* ------------------------------------ Function Prototypes ------------------------------------ */
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef* hdma);
+HAL_StatusTypeDef HAL_SAI_Receive_DMA(SAI_HandleTypeDef* hsai, uint8_t* pData, uint16_t Size);
+HAL_StatusTypeDef HAL_SAI_DMAStop(SAI_HandleTypeDef* hsai);
+void HAL_SAI_RxHalfCpltCallback(SAI_HandleTypeDef* hsai);
+void HAL_SAI_RxCpltCallback(SAI_HandleTypeDef* hsai);
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
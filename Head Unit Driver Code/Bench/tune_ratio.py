@@ -0,0 +1,249 @@
+# Offline Tuner for the Ratio Localizer Decision Table
+#
+#  Fits the ratio localizer to labelled recordings and writes SPH0645_RatioTable.h, a const
+#  table that the head unit indexes with the quantized log ratios A2/A1 and B2/B1.
+#
+#  python3 tune_ratio.py [options] [capture.wav truth.txt ...]
+#
+#  Captures and truth files use the replay bench formats (see bench.c). Every cell starts
+#  with --prior votes for the direction the hand thresholds T1..T5 give at its centre, so
+#  with no recordings the table reproduces the current decision tree and recordings only
+#  have to cover the cells they disagree on. A cell is left undecided (-1) unless one
+#  direction has --min-count votes and --purity of all votes. Check the result on
+#  recordings that were not used for fitting with the bench.
+#
+#  @author  Miles Hanbury (mhanbury)
+#  @author  James Kelly (jkellymi)
+#  @author  Joshua Nye (nyej)
+
+import argparse
+import math
+import os
+import re
+import sys
+import wave
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+HEADER = os.path.join(HERE, '..', 'Adafruit_SPH0645', 'Adafruit_SPH0645.h')
+OUTPUT = os.path.join(HERE, '..', 'Adafruit_SPH0645', 'SPH0645_RatioTable.h')
+
+SAMPLES = 1024                                              # analysis window, must match SAMPLES
+HOP = 256                                                   # must match SPH0645_HOP
+CHANNELS = 4                                                # A1, A2, B1, B2
+BINS = 32                                                   # must match SPH0645_RATIO_BINS
+SHIFT = 1                                                   # Q4 log2 difference to bin, 1/8 octave
+OFFSET = 32                                                 # Q4 log2 difference of bin 0, -2 octaves
+DIRECTIONS = 8
+
+LOG2_FRAC = [1, 2, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 13, 14, 15, 16]   # must match SPH0645_LOG2_FRAC
+
+
+def log2_q4(x):
+    """integer log2 in Q4, bit exact with SPH0645_Log2"""
+    if x <= 1:
+        return 0
+    msb = x.bit_length() - 1
+    frac = (x << 4 >> msb) & 15 if msb < 4 else (x >> (msb - 4)) & 15
+    return 16*msb + LOG2_FRAC[frac]
+
+
+def ratio_bin(a, b):
+    """table index of log2(a/b), bit exact with SPH0645_RatioBin"""
+    return min(max((log2_q4(a) - log2_q4(b) + OFFSET) >> SHIFT, 0), BINS - 1)
+
+
+def read_thresholds():
+    """T1..T5 as the firmware rounds them, Q8"""
+    text = open(HEADER).read()
+    t = {}
+    for name, value in re.findall(r'#define\s+(T[1-5])\s+SPH0645_Q8\(([\d.]+)\)', text):
+        t[name] = int(float(value)*256.0 + 0.5) / 256.0
+    if len(t) != 5:
+        sys.exit('T1..T5 not found in ' + HEADER)
+    return t
+
+
+def threshold_direction(x, y, t):
+    """direction index the hand decision tree gives for log2(A2/A1) = x, log2(B2/B1) = y"""
+    gt = lambda r, name: 2*r > math.log2(t[name])           # (a/b)^2 > T
+    lt = lambda r, name: 2*r < math.log2(t[name])           # (a/b)^2 < T
+
+    # same order and grouping as the original SPH0645_RatioAngle branches
+    if gt(x, 'T1') and lt(y, 'T4') and lt(-y, 'T4') or (gt(x, 'T5') and lt(y, 'T2') and lt(-y, 'T2')):
+        return 4
+    if gt(-x, 'T1') and lt(y, 'T4') and lt(-y, 'T4') or (gt(x, 'T5') and lt(y, 'T2') and lt(-y, 'T2')):
+        return 0
+    if gt(y, 'T1') and lt(x, 'T4') and lt(-x, 'T4') or (gt(y, 'T5') and lt(x, 'T2') and lt(-x, 'T2')):
+        return 6
+    if gt(-y, 'T1') and lt(x, 'T4') and lt(-x, 'T4') or (gt(y, 'T5') and lt(x, 'T2') and lt(-x, 'T2')):
+        return 2
+    if gt(-x, 'T3') and gt(-y, 'T3'):
+        return 1
+    if gt(x, 'T3') and gt(-y, 'T3'):
+        return 3
+    if gt(x, 'T3') and gt(y, 'T3'):
+        return 5
+    if gt(-x, 'T3') and gt(y, 'T3'):
+        return 7
+    return -1
+
+
+def bin_centre(i):
+    """log2 ratio at the centre of a table bin"""
+    return ((i << SHIFT) - OFFSET + ((1 << SHIFT) - 1)/2.0) / 16.0
+
+
+def read_capture(path):
+    """per-hop raw min/max of every channel as the firmware sees them (top 16 bits)"""
+    w = wave.open(path, 'rb')
+    if w.getnchannels() != CHANNELS:
+        sys.exit(path + ': need a 4-channel capture')
+    rate, width = w.getframerate(), w.getsampwidth()
+    data = w.readframes(w.getnframes())
+    w.close()
+
+    shift = 8*width - 16
+    hops = []
+    step = width*CHANNELS
+    for start in range(0, len(data) // (HOP*step) * HOP*step, HOP*step):
+        lo, hi = [32767]*CHANNELS, [-32768]*CHANNELS
+        for i in range(start, start + HOP*step, step):
+            for ch in range(CHANNELS):
+                s = int.from_bytes(data[i + ch*width:i + (ch + 1)*width], 'little', signed=True) >> shift
+                if s < lo[ch]:
+                    lo[ch] = s
+                if s > hi[ch]:
+                    hi[ch] = s
+        hops.append((lo, hi))
+    return rate, hops
+
+
+def read_truth(path):
+    segments = []
+    for number, line in enumerate(open(path), 1):
+        fields = line.split('#')[0].split()
+        if not fields:
+            continue
+        if len(fields) != 3:
+            sys.exit('%s:%d: expected <start s> <end s> <bearing deg>' % (path, number))
+        segments.append((float(fields[0]), float(fields[1]), int(fields[2]) % 360))
+    return segments
+
+
+def windows(capture, truth):
+    """(x bin, y bin, direction) of every window that lies inside exactly one segment"""
+    rate, hops = read_capture(capture)
+    segments = read_truth(truth)
+    per_window = SAMPLES // HOP
+    for last in range(per_window - 1, len(hops)):
+        end = (last + 1)*HOP / rate
+        begin = end - SAMPLES / rate
+        inside = [s for s in segments if s[0] <= begin and end <= s[1]]
+        if len(inside) != 1:
+            continue
+        span = range(last - per_window + 1, last + 1)
+        lo = [min(hops[h][0][ch] for h in span) for ch in range(CHANNELS)]
+        hi = [max(hops[h][1][ch] for h in span) for ch in range(CHANNELS)]
+        r = [hi[ch] - lo[ch] for ch in range(CHANNELS)]       # DC cancels out of the range
+        direction = (inside[0][2] + 22) // 45 % DIRECTIONS
+        yield ratio_bin(r[1], r[0]), ratio_bin(r[3], r[2]), direction
+
+
+def define(name, value, comment):
+    """#define line with the value at column 33 and the comment at column 101"""
+    return ('#define ' + name.ljust(24) + str(value)).ljust(100) + '// ' + comment
+
+
+def write_table(table, source):
+    defines = [define('SPH0645_RATIO_BINS', BINS, 'bins per log ratio'),
+               define('SPH0645_RATIO_SHIFT', SHIFT, 'Q4 log2 difference to bin'),
+               define('SPH0645_RATIO_OFFSET', OFFSET, 'Q4 log2 difference of bin 0')]
+    rows = []
+    for x in range(BINS):
+        rows.append('    {' + ','.join('%2d' % table[x][y] for y in range(BINS)) + '}')
+    with open(OUTPUT, 'w') as f:
+        f.write('''/*!
+ * @file    SPH0645_RatioTable.h
+ * @brief   Decision table of the ratio localizer
+ * @note    Generated by Bench/tune_ratio.py from %s, do not edit.
+ *
+ *          Row is the bin of log2(range A2 / range A1), column the bin of
+ *          log2(range B2 / range B1). Bins are 1/8 octave wide, bin 0 holds everything
+ *          below -2 octaves and bin SPH0645_RATIO_BINS-1 everything above. Entries are the
+ *          motor direction in 45 degree steps from A1, -1 where no direction is reported.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#ifndef SPH0645_RATIOTABLE_H
+#define SPH0645_RATIOTABLE_H
+
+#include <stdint.h>
+
+/* ---------------------------------- Ratio Table Definitions ---------------------------------- */
+%s
+
+static const int8_t SPH0645_RATIO_TABLE[SPH0645_RATIO_BINS][SPH0645_RATIO_BINS] =
+{
+%s
+};
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
+''' % (source, '\n'.join(defines), ',\n'.join(rows)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='fit the ratio localizer decision table')
+    parser.add_argument('recordings', nargs='*', help='capture.wav truth.txt pairs')
+    parser.add_argument('--prior', type=int, default=2, help='votes for the hand thresholds per cell')
+    parser.add_argument('--min-count', type=int, default=2, help='votes needed to decide a cell')
+    parser.add_argument('--purity', type=float, default=0.6, help='share of votes the winner needs')
+    parser.add_argument('--dry-run', action='store_true', help='report only, do not write the table')
+    args = parser.parse_args()
+    if len(args.recordings) % 2:
+        parser.error('recordings come in capture.wav truth.txt pairs')
+
+    t = read_thresholds()
+    votes = [[[0]*DIRECTIONS for y in range(BINS)] for x in range(BINS)]
+    for x in range(BINS):
+        for y in range(BINS):
+            d = threshold_direction(bin_centre(x), bin_centre(y), t)
+            if d >= 0:
+                votes[x][y][d] += args.prior
+
+    samples = []
+    for capture, truth in zip(args.recordings[0::2], args.recordings[1::2]):
+        found = list(windows(capture, truth))
+        print('%s: %d labelled windows' % (capture, len(found)))
+        samples += found
+    for x, y, d in samples:
+        votes[x][y][d] += 1
+
+    table = [[-1]*BINS for x in range(BINS)]
+    for x in range(BINS):
+        for y in range(BINS):
+            total = sum(votes[x][y])
+            best = max(range(DIRECTIONS), key=lambda d: votes[x][y][d])
+            if votes[x][y][best] >= args.min_count and votes[x][y][best] >= args.purity*total:
+                table[x][y] = best
+
+    if samples:
+        hits = sum(table[x][y] == d for x, y, d in samples)
+        undecided = sum(table[x][y] < 0 for x, y, d in samples)
+        print('training windows: %.1f %% correct, %.1f %% undecided (%d windows)' %
+              (100.0*hits/len(samples), 100.0*undecided/len(samples), len(samples)))
+    decided = sum(table[x][y] >= 0 for x in range(BINS) for y in range(BINS))
+    print('%d of %d cells decided' % (decided, BINS*BINS))
+
+    if not args.dry_run:
+        source = 'T1..T5 and %d recordings' % (len(args.recordings) // 2) if samples else 'T1..T5'
+        write_table(table, source)
+        print('wrote ' + os.path.relpath(OUTPUT))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,381 @@
+/*!
+ * @file    Clock_Manager.c
+ * @brief   System clock profiles of the head unit and the peripheral timings that follow them
+ * @note    The I2C and timer settings are rescaled from the values CubeMX generated for the
+ *          idle clock, so changing a bus speed or the timer period in CubeMX carries over to
+ *          the boost profile. The UARTs get the smallest prescaler from their CubeMX one up
+ *          that suits the clock and are reprogrammed by the HAL from their Init fields.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#include "Clock_Manager.h"
+#include "Profiler.h"
+
+/* -------------------------------------- Global Variables ------------------------------------- */
+extern I2C_HandleTypeDef*  CLOCK_HI2C[CLOCK_I2C_COUNT];
+extern UART_HandleTypeDef* CLOCK_HUART[CLOCK_UART_COUNT];
+extern TIM_HandleTypeDef*  CLOCK_HTIM;
+
+static uint32_t idle_hz;                                                                            // SYSCLK of the idle profile
+static uint32_t I2C_TIMING[CLOCK_I2C_COUNT];                                                        // TIMINGR at the idle clock
+static uint32_t UART_PRESCALER[CLOCK_UART_COUNT];                                                   // Init.ClockPrescaler at the idle clock
+static uint32_t timer_prescaler;                                                                    // PSC + 1 at the idle clock
+static uint32_t timer_period;                                                                       // ARR + 1 at the idle clock
+static clock_profile_t active_profile = CLOCK_PROFILE_IDLE;                                         // profile SYSCLK is running in
+static volatile uint32_t refused;                                                                   // switches given up on a busy peripheral
+
+/* ---------------------------------- Function Implementations --------------------------------- */
+/*!
+ * @brief   scales a number of clock cycles from the idle clock to another, rounding up
+ * @param   cycles      cycles at the idle clock
+ * @param   hz          new clock
+ * @param   divider     extra division applied at the new clock
+ * @return  uint32_t    cycles at the new clock, never shorter in time
+ */
+static uint32_t CLOCK_Scale(uint32_t cycles, uint32_t hz, uint32_t divider)
+{
+    uint64_t scaled = (uint64_t)cycles*hz;
+    uint64_t unit = (uint64_t)idle_hz*divider;
+    return (uint32_t)((scaled + unit - 1) / unit);
+}
+
+/*!
+ * @brief   scales an SCL low or high count, including the edge resynchronization
+ * @param   cycles      cycles at the idle clock without the resynchronization
+ * @param   hz          new clock
+ * @param   divider     prescaler at the new clock
+ * @return  uint32_t    prescaled count at the new clock
+ * @note    the peripheral adds CLOCK_I2C_SYNC_CYCLES kernel clocks to every SCL phase, which
+ *          is 750 ns at 4 MHz but 25 ns at 120 MHz, so scaling the count alone would raise
+ *          the bus above 100 kHz
+ */
+static uint32_t CLOCK_SclScale(uint32_t cycles, uint32_t hz, uint32_t divider)
+{
+    uint32_t total = CLOCK_Scale(cycles + CLOCK_I2C_SYNC_CYCLES, hz, 1);
+    uint32_t count = total > CLOCK_I2C_SYNC_CYCLES ? total - CLOCK_I2C_SYNC_CYCLES : 0;
+    return (count + divider - 1) / divider;
+}
+
+/*!
+ * @brief   derives an I2C TIMINGR for another kernel clock
+ * @param   timing      TIMINGR at the idle clock
+ * @param   hz          new kernel clock
+ * @return  uint32_t    TIMINGR with the same or slightly longer SCL periods and data setup
+ *                      and hold times
+ * @note    the smallest prescaler that lets every count fit its field is used, the finest
+ *          step keeps the rounding error small
+ */
+static uint32_t CLOCK_I2CTiming(uint32_t timing, uint32_t hz)
+{
+    uint32_t presc  = ((timing >> 28) & 0xF) + 1;
+    uint32_t scldel = ((timing >> 20) & 0xF) + 1;
+    uint32_t sdadel = (timing >> 16) & 0xF;
+    uint32_t sclh   = ((timing >> 8) & 0xFF) + 1;
+    uint32_t scll   = (timing & 0xFF) + 1;
+
+    for (uint32_t p = 1; p <= 16; p++)
+    {
+        uint32_t n_scldel = CLOCK_Scale(scldel*presc, hz, p);
+        uint32_t n_sdadel = CLOCK_Scale(sdadel*presc, hz, p);
+        uint32_t n_sclh   = CLOCK_SclScale(sclh*presc, hz, p);
+        uint32_t n_scll   = CLOCK_SclScale(scll*presc, hz, p);
+        if (n_scldel > 16 || n_sdadel > 15 || n_sclh > 256 || n_scll > 256) continue;
+
+        if (n_scldel == 0) n_scldel = 1;                                                            // fields hold count - 1
+        if (n_sclh == 0) n_sclh = 1;
+        if (n_scll == 0) n_scll = 1;
+        return ((p - 1) << 28) | ((n_scldel - 1) << 20) | (n_sdadel << 16) |
+               ((n_sclh - 1) << 8) | (n_scll - 1);
+    }
+    return timing;                                                                                  // cannot happen below 256 MHz
+}
+
+/*!
+ * @brief   retimes the I2C buses to the current PCLK1
+ * @note    TIMINGR is only writable while the peripheral is disabled
+ */
+static void CLOCK_RetimeI2C(void)
+{
+    uint32_t hz = HAL_RCC_GetPCLK1Freq();
+    for (int bus = 0; bus < CLOCK_I2C_COUNT; bus++)
+    {
+        I2C_HandleTypeDef* hi2c = CLOCK_HI2C[bus];
+        hi2c->Init.Timing = CLOCK_I2CTiming(I2C_TIMING[bus], hz);
+        __HAL_I2C_DISABLE(hi2c);
+        hi2c->Instance->TIMINGR = hi2c->Init.Timing;
+        __HAL_I2C_ENABLE(hi2c);
+    }
+}
+
+/*!
+ * @brief   picks the smallest prescaler, from the one CubeMX set up, that puts the baud rate
+ *          in range of a UART's divider
+ * @param   huart       UART to prescale
+ * @param   idle        prescaler setting at the idle clock, UART_PRESCALER_DIV1 to DIV256
+ * @return  uint32_t    prescaler setting for the current kernel clock
+ * @note    the LPUART kernel clock has to stay within 4096 times the baud rate, 120 MHz
+ *          needs DIV4 at 9600 baud. A USART only has to fit BRR in 16 bits.
+ */
+static uint32_t CLOCK_UARTPrescaler(UART_HandleTypeDef* huart, uint32_t idle)
+{
+    uint32_t hz = huart->Instance == USART1 ? HAL_RCC_GetPCLK2Freq() : HAL_RCC_GetPCLK1Freq();
+    uint64_t limit = UART_INSTANCE_LOWPOWER(huart) ? 4096ull*huart->Init.BaudRate :
+                     (huart->Init.OverSampling == UART_OVERSAMPLING_8 ? 0xFFFFull/2 : 0xFFFFull)*
+                     huart->Init.BaudRate;
+
+    for (uint32_t presc = idle; presc < UART_PRESCALER_DIV256; presc++)
+        if (hz / UARTPrescTable[presc] <= limit) return presc;
+    return UART_PRESCALER_DIV256;
+}
+
+/*!
+ * @brief   reprograms the prescaler and baud rate generator of every UART for the current
+ *          clocks
+ * @return  HAL_StatusTypeDef   HAL_ERROR if a baud rate cannot be reached
+ * @note    UART_SetConfig writes PRESC from Init.ClockPrescaler, computes BRR from the
+ *          prescaled kernel clock and only rewrites the frame format fields, so half-duplex
+ *          and the other CR3 features survive
+ */
+static HAL_StatusTypeDef CLOCK_RetimeUART(void)
+{
+    HAL_StatusTypeDef status = HAL_OK;
+
+    for (int port = 0; port < CLOCK_UART_COUNT; port++)
+    {
+        UART_HandleTypeDef* huart = CLOCK_HUART[port];
+        while (!__HAL_UART_GET_FLAG(huart, UART_FLAG_TC));                                          // let the last stop bit out
+        __HAL_UART_DISABLE(huart);
+        huart->Init.ClockPrescaler = CLOCK_UARTPrescaler(huart, UART_PRESCALER[port]);
+        if (UART_SetConfig(huart) != HAL_OK) status = HAL_ERROR;
+        __HAL_UART_ENABLE(huart);
+    }
+    return status;
+}
+
+/*!
+ * @brief   keeps the timer interrupt period across a change of its kernel clock
+ * @note    the prescaler is scaled alone when it can be, otherwise both registers are
+ *          chosen again. The counter is moved to the same fraction of the new period and
+ *          the prescaler is loaded with an update event that does not raise an interrupt.
+ */
+static void CLOCK_RetimeTimer(void)
+{
+    TIM_TypeDef* tim = CLOCK_HTIM->Instance;
+    uint32_t hz = HAL_RCC_GetPCLK2Freq();                                                           // APB2 undivided, no timer doubling
+    uint64_t ticks = (uint64_t)timer_prescaler*timer_period*hz / idle_hz;
+    uint32_t prescaler = (uint32_t)((ticks + 65535) / 65536);
+    uint32_t period = (uint32_t)(ticks / prescaler);
+
+    if ((uint64_t)timer_prescaler*hz % idle_hz == 0 &&
+        (uint64_t)timer_prescaler*hz / idle_hz <= 65536)                                            // exact, keep the CubeMX period
+    {
+        prescaler = (uint32_t)((uint64_t)timer_prescaler*hz / idle_hz);
+        period = timer_period;
+    }
+
+    uint32_t count = (uint32_t)((uint64_t)tim->CNT*period / (tim->ARR + 1));
+    CLOCK_HTIM->Init.Prescaler = prescaler - 1;
+    CLOCK_HTIM->Init.Period = period - 1;
+
+    tim->CR1 |= TIM_CR1_URS;                                                                        // UG reloads PSC without an interrupt
+    tim->PSC = prescaler - 1;
+    tim->ARR = period - 1;
+    tim->EGR = TIM_EGR_UG;
+    tim->CNT = count;
+    tim->CR1 &= ~TIM_CR1_URS;
+}
+
+/*!
+ * @brief   checks that no peripheral is in the middle of a transfer
+ * @return  int     1 if every I2C bus and UART is idle
+ */
+static int CLOCK_PeripheralsIdle(void)
+{
+    for (int bus = 0; bus < CLOCK_I2C_COUNT; bus++)
+        if (CLOCK_HI2C[bus]->State != HAL_I2C_STATE_READY) return 0;
+    for (int port = 0; port < CLOCK_UART_COUNT; port++)
+        if (CLOCK_HUART[port]->gState != HAL_UART_STATE_READY) return 0;
+    return 1;
+}
+
+/*!
+ * @brief   waits up to CLOCK_IDLE_WAIT for the transfers in flight to finish
+ * @return  int     1 if every I2C bus and UART is idle
+ * @note    interrupts stay enabled, the transfers finish in their own interrupts
+ */
+static int CLOCK_WaitIdle(void)
+{
+    uint32_t start = HAL_GetTick();
+
+    while (!CLOCK_PeripheralsIdle())
+        if (HAL_GetTick() - start >= CLOCK_IDLE_WAIT) return 0;
+    return 1;
+}
+
+/*!
+ * @brief   raises the regulator to range 1 boost and locks the main PLL at 240 MHz VCO
+ * @return  HAL_StatusTypeDef   HAL status of the regulator and the PLL
+ * @note    SYSCLK still runs from the MSI, so nothing has to be retimed yet. Called with
+ *          interrupts enabled, the PLL lock timeout of the HAL counts SysTick ticks.
+ */
+static HAL_StatusTypeDef CLOCK_PllStart(void)
+{
+    RCC_OscInitTypeDef osc = {0};
+
+    if (HAL_PWREx_ControlVoltageScaling(PWR_REGULATOR_VOLTAGE_SCALE1_BOOST) != HAL_OK)
+        return HAL_ERROR;                                                                           // boost mode has to be on before SYSCLK passes 80 MHz
+
+    osc.OscillatorType = RCC_OSCILLATORTYPE_NONE;                                                   // MSI untouched, it also clocks PLLSAI1
+    osc.PLL.PLLState = RCC_PLL_ON;
+    osc.PLL.PLLSource = RCC_PLLSOURCE_MSI;
+    osc.PLL.PLLM = 1;
+    osc.PLL.PLLN = CLOCK_BOOST_PLLN;
+    osc.PLL.PLLP = RCC_PLLP_DIV2;
+    osc.PLL.PLLQ = RCC_PLLQ_DIV2;
+    osc.PLL.PLLR = CLOCK_BOOST_PLLR;
+    return HAL_RCC_OscConfig(&osc);
+}
+
+/*!
+ * @brief   stops the main PLL and returns the regulator to range 1
+ * @return  HAL_StatusTypeDef   HAL status of the PLL and the regulator
+ * @note    only once SYSCLK runs from the MSI again, with interrupts enabled
+ */
+static HAL_StatusTypeDef CLOCK_PllStop(void)
+{
+    RCC_OscInitTypeDef osc = {0};
+
+    osc.OscillatorType = RCC_OSCILLATORTYPE_NONE;
+    osc.PLL.PLLState = RCC_PLL_OFF;
+    if (HAL_RCC_OscConfig(&osc) != HAL_OK) return HAL_ERROR;
+
+    return HAL_PWREx_ControlVoltageScaling(PWR_REGULATOR_VOLTAGE_SCALE1);
+}
+
+/*!
+ * @brief   switches SYSCLK between the MSI and the locked PLL
+ * @param   profile             profile to switch to
+ * @return  HAL_StatusTypeDef   HAL status of the clock switch
+ * @note    HAL_RCC_ClockConfig sets the flash latency before a raise and after a drop, and
+ *          steps through AHB/2 for the required 1 us when going to 120 MHz
+ */
+static HAL_StatusTypeDef CLOCK_Switch(clock_profile_t profile)
+{
+    RCC_ClkInitTypeDef clk = {0};
+
+    clk.ClockType = RCC_CLOCKTYPE_HCLK | RCC_CLOCKTYPE_SYSCLK | RCC_CLOCKTYPE_PCLK1 |
+                    RCC_CLOCKTYPE_PCLK2;
+    clk.SYSCLKSource = profile == CLOCK_PROFILE_BOOST ? RCC_SYSCLKSOURCE_PLLCLK :
+                                                        RCC_SYSCLKSOURCE_MSI;
+    clk.AHBCLKDivider = RCC_SYSCLK_DIV1;
+    clk.APB1CLKDivider = RCC_HCLK_DIV1;
+    clk.APB2CLKDivider = RCC_HCLK_DIV1;
+    return HAL_RCC_ClockConfig(&clk, profile == CLOCK_PROFILE_BOOST ? CLOCK_BOOST_LATENCY :
+                                                                     CLOCK_IDLE_LATENCY);
+}
+
+/*!
+ * @brief   records the peripheral timings CubeMX derived for the idle clock
+ * @return  HAL_StatusTypeDef   HAL_ERROR if SYSCLK is not running in the idle profile
+ */
+HAL_StatusTypeDef CLOCK_Init(void)
+{
+    if (__HAL_RCC_GET_SYSCLK_SOURCE() != RCC_SYSCLKSOURCE_STATUS_MSI) return HAL_ERROR;
+
+    idle_hz = HAL_RCC_GetHCLKFreq();
+    for (int bus = 0; bus < CLOCK_I2C_COUNT; bus++) I2C_TIMING[bus] = CLOCK_HI2C[bus]->Init.Timing;
+    for (int port = 0; port < CLOCK_UART_COUNT; port++)
+        UART_PRESCALER[port] = CLOCK_HUART[port]->Init.ClockPrescaler;
+    timer_prescaler = CLOCK_HTIM->Init.Prescaler + 1;
+    timer_period = CLOCK_HTIM->Init.Period + 1;
+    active_profile = CLOCK_PROFILE_IDLE;
+    refused = 0;
+    return HAL_OK;
+}
+
+/*!
+ * @brief   switches the system clock to a profile and retimes the peripherals to it
+ * @param   profile             profile to run in
+ * @return  HAL_StatusTypeDef   HAL_BUSY if an I2C or UART transfer is still in progress
+ *                              after CLOCK_IDLE_WAIT, the clock is left as it was then.
+ *                              HAL_ERROR if the boost failed or a UART cannot reach its
+ *                              baud rate.
+ * @note    a failed boost falls back to the idle profile, so the caller only loses speed.
+ *          The PLL locks and stops with interrupts enabled, so the SysTick timeouts of the
+ *          HAL run, only the SYSCLK switch and the retiming are masked. The transfers in
+ *          flight drain during the PLL lock and the wait, new ones are held back.
+ */
+HAL_StatusTypeDef CLOCK_SetProfile(clock_profile_t profile)
+{
+    HAL_StatusTypeDef status;
+
+    if (profile == active_profile) return HAL_OK;
+    CLOCK_HoldCallback(1);
+    if (profile == CLOCK_PROFILE_BOOST && CLOCK_PllStart() != HAL_OK)
+    {
+        CLOCK_PllStop();
+        CLOCK_HoldCallback(0);
+        return HAL_ERROR;
+    }
+
+    int idle = CLOCK_WaitIdle();
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();                                                                                // no transfer may start on the old timing
+    if (!idle || !CLOCK_PeripheralsIdle())
+    {
+        __set_PRIMASK(primask);
+        ++refused;
+        if (profile == CLOCK_PROFILE_BOOST) CLOCK_PllStop();
+        CLOCK_HoldCallback(0);
+        return HAL_BUSY;
+    }
+
+    status = CLOCK_Switch(profile);
+    active_profile = __HAL_RCC_GET_SYSCLK_SOURCE() == RCC_SYSCLKSOURCE_STATUS_PLLCLK ?
+              CLOCK_PROFILE_BOOST : CLOCK_PROFILE_IDLE;
+    PROF_CLOCK();                                                                                   // profiled zones convert the cycles from here at the new clock
+
+    CLOCK_RetimeI2C();
+    if (CLOCK_RetimeUART() != HAL_OK) status = HAL_ERROR;
+    CLOCK_RetimeTimer();                                                                            // SysTick was retimed by HAL_RCC_ClockConfig
+    __set_PRIMASK(primask);
+    CLOCK_HoldCallback(0);
+
+    if (active_profile == CLOCK_PROFILE_IDLE && CLOCK_PllStop() != HAL_OK)                          // also after a failed boost
+        status = HAL_ERROR;
+    return status;
+}
+
+/*!
+ * @brief   gets the profile the system clock is running in
+ * @return  clock_profile_t     current profile
+ */
+clock_profile_t CLOCK_GetProfile(void)
+{
+    return active_profile;
+}
+
+/*!
+ * @brief   number of switches refused because a transfer outlasted CLOCK_IDLE_WAIT
+ * @return  uint32_t    refused switch count since CLOCK_Init
+ */
+uint32_t CLOCK_GetRefused(void)
+{
+    return refused;
+}
+
+/*!
+ * @brief   called when a switch starts and ends, so drivers that start transfers from
+ *          their interrupts can hold them back
+ * @param   hold    1 before the switch waits for the buses, 0 once it is done or given up
+ * @note    weak, can be overridden by the application
+ */
+__weak void CLOCK_HoldCallback(uint8_t hold)
+{
+    (void)hold;
+}
+
+/* --------------------------------------------------------------------------------------------- */
@@ -0,0 +1,96 @@
+/*!
+ * @file    Clock_Manager.h
+ * @brief   System clock profiles of the head unit and the peripheral timings that follow them
+ * @note    The head unit idles on the 4 MHz MSI set up by SystemClock_Config and only raises
+ *          SYSCLK to 120 MHz from the main PLL while a window is localized.
+ *
+ *          PROFILE     SYSCLK      SOURCE          REGULATOR           FLASH
+ *          ----------------------------------------------------------------
+ *          IDLE        4 MHz       MSI range 6     range 1             0 WS
+ *          BOOST       120 MHz     PLL (MSI x30)   range 1 boost       5 WS
+ *
+ *          The MSI is never retuned, it also feeds PLLSAI1, so the SAI bit clock and the
+ *          microphone capture run through every switch untouched. AHB and APB stay
+ *          undivided, so every bus and kernel clock that follows SYSCLK is re-derived after a
+ *          switch: the I2C TIMINGR of every bus, the baud rate of every UART, the prescaler
+ *          and period of the timer interrupt, and SysTick through the HAL.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#ifndef CLOCK_MANAGER_H
+#define CLOCK_MANAGER_H
+
+#include "stm32l4xx_hal.h"
+
+/* ------------------------------------- Clock Definitions ------------------------------------- */
+#define CLOCK_I2C_COUNT         4                                                                   // DRV2605 buses
+#define CLOCK_UART_COUNT        3                                                                   // LPUART1, USART1, USART2
+
+#define CLOCK_I2C_SYNC_CYCLES   3                                                                   // kernel clocks an SCL edge takes to resynchronize
+#define CLOCK_IDLE_WAIT         3                                                                   // ms a switch waits for the transfers in flight, longer than a DRV2605 write
+
+#define CLOCK_BOOST_PLLN        60                                                                  // 4 MHz MSI x60 = 240 MHz VCO
+#define CLOCK_BOOST_PLLR        RCC_PLLR_DIV2                                                       // 120 MHz SYSCLK
+#define CLOCK_BOOST_LATENCY     FLASH_LATENCY_5                                                     // wait states at 120 MHz in range 1 boost
+#define CLOCK_IDLE_LATENCY      FLASH_LATENCY_0                                                     // wait states at 4 MHz
+
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef enum
+{
+    CLOCK_PROFILE_IDLE  = 0,                                                                        // 4 MHz MSI, PLL off
+    CLOCK_PROFILE_BOOST = 1                                                                         // 120 MHz PLL
+} clock_profile_t;
+
+/* ------------------------------------ Function Prototypes ------------------------------------ */
+/*!
+ * @brief   records the peripheral timings CubeMX derived for the idle clock
+ * @return  HAL_StatusTypeDef   HAL_ERROR if SYSCLK is not running in the idle profile
+ * @note    call once after every MX_*_Init and before the first switch
+ */
+HAL_StatusTypeDef CLOCK_Init(void);
+
+/*!
+ * @brief   switches the system clock to a profile and retimes the peripherals to it
+ * @param   profile             profile to run in
+ * @return  HAL_StatusTypeDef   HAL_BUSY if an I2C or UART transfer is still in progress
+ *                              after CLOCK_IDLE_WAIT, the clock is left as it was then.
+ *                              HAL_ERROR if the boost failed or a UART cannot reach its
+ *                              baud rate.
+ * @note    interrupts are held off while the clock and the peripheral timings disagree,
+ *          the PLL locks with them enabled so the HAL timeouts can expire. Call it from a
+ *          task, never with interrupts masked. CLOCK_HoldCallback keeps new transfers off
+ *          the buses from before the PLL starts until the peripherals are retimed, so only
+ *          transfers already running are waited for. A boost and the return to idle take
+ *          about 1 ms together, mostly HAL code and the PLL lock at 4 MHz. Switching to the
+ *          profile already running costs nothing.
+ */
+HAL_StatusTypeDef CLOCK_SetProfile(clock_profile_t profile);
+
+/*!
+ * @brief   gets the profile the system clock is running in
+ * @return  clock_profile_t     current profile
+ */
+clock_profile_t CLOCK_GetProfile(void);
+
+/*!
+ * @brief   number of switches refused because a transfer outlasted CLOCK_IDLE_WAIT
+ * @return  uint32_t    refused switch count since CLOCK_Init
+ */
+uint32_t CLOCK_GetRefused(void);
+
+/*!
+ * @brief   called when a switch starts and ends, so drivers that start transfers from
+ *          their interrupts can hold them back
+ * @param   hold    1 before the switch waits for the buses, 0 once the peripherals run on
+ *                  the new timing or the switch was given up
+ * @note    weak, can be overridden by the application. Runs in the task that switches,
+ *          with interrupts enabled.
+ */
+void CLOCK_HoldCallback(uint8_t hold);
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
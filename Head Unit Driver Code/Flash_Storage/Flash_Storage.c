@@ -0,0 +1,186 @@
+/*!
+ * @file    Flash_Storage.c
+ * @brief   Small key/value record store in the last flash page of the STM32 L4R5ZI-P
+ * @note    Every record starts with an 8 byte header (magic, key, payload size, CRC-32 of
+ *          the payload) followed by the payload padded to whole double words, the flash
+ *          programming unit. The header is programmed first so an interrupted write still
+ *          has a known length and the scan can step over it; its CRC then fails.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#include "Flash_Storage.h"
+#include <string.h>
+
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef struct STORAGE_HEADER_STRUCT
+{
+    uint8_t  magic;                                                                                 // STORAGE_MAGIC, 0xFF where the page is still erased
+    uint8_t  key;
+    uint16_t size;                                                                                  // payload bytes
+    uint32_t crc;                                                                                   // CRC-32 of the payload
+} storage_header_t;
+
+/* -------------------------------------- Global Variables ------------------------------------- */
+static uint8_t COMPACT_BUFFER[STORAGE_KEYS][STORAGE_MAX_SIZE];                                      // newest payload of every key while the page is erased
+static uint16_t compact_size[STORAGE_KEYS];
+
+/* ---------------------------------- Function Implementations --------------------------------- */
+/*!
+ * @brief   CRC-32 (IEEE 802.3) of a buffer, bitwise since records are small and rare
+ */
+static uint32_t STORAGE_Crc(const uint8_t* data, uint16_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint16_t i = 0; i < size; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+/*!
+ * @brief   bytes a record takes in flash
+ */
+static uint32_t STORAGE_Footprint(uint16_t size)
+{
+    return sizeof(storage_header_t) + ((size + 7U) & ~7U);
+}
+
+/*!
+ * @brief   walks the record log
+ * @param   key         key to look for, or STORAGE_KEYS to only find the end of the log
+ * @param   found       newest intact record of the key, NULL if there is none
+ * @return  uint32_t    address of the first erased double word after the log
+ */
+static uint32_t STORAGE_Scan(uint8_t key, const storage_header_t** found)
+{
+    uint32_t addr = STORAGE_ADDR;
+    *found = NULL;
+
+    while (addr + sizeof(storage_header_t) <= STORAGE_ADDR + STORAGE_PAGE_SIZE)
+    {
+        const storage_header_t* header = (const storage_header_t*)addr;
+        if (header->magic != STORAGE_MAGIC) break;                                                  // erased, end of the log
+        if (header->size > STORAGE_MAX_SIZE) break;                                                 // not a record we wrote
+        if (header->key == key &&
+            header->crc == STORAGE_Crc((const uint8_t*)(header + 1), header->size)) *found = header;
+        addr += STORAGE_Footprint(header->size);
+    }
+    return addr;
+}
+
+/*!
+ * @brief   programs one record at an address known to be erased
+ */
+static HAL_StatusTypeDef STORAGE_Program(uint32_t addr, uint8_t key, const void* data,
+    uint16_t size)
+{
+    storage_header_t header = {STORAGE_MAGIC, key, size, STORAGE_Crc(data, size)};
+    uint64_t word;
+
+    memcpy(&word, &header, sizeof(word));
+    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, addr, word) != HAL_OK) return HAL_ERROR;
+
+    for (uint16_t offset = 0; offset < size; offset += 8)
+    {
+        word = UINT64_MAX;                                                                          // padding stays erased
+        memcpy(&word, (const uint8_t*)data + offset, size - offset < 8 ? size - offset : 8);
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, addr + 8 + offset, word) != HAL_OK)
+            return HAL_ERROR;
+    }
+    return HAL_OK;
+}
+
+/*!
+ * @brief   keeps the newest copy of every key, erases the page and writes them back
+ * @return  uint32_t    end of the rewritten log, 0 if programming failed
+ * @note    a power loss between the erase and the rewrite loses the stored values, the
+ *          owners fall back to their defaults
+ */
+static uint32_t STORAGE_Compact(void)
+{
+    const storage_header_t* header;
+    FLASH_EraseInitTypeDef erase = {0};
+    uint32_t error;
+
+    for (uint8_t key = 0; key < STORAGE_KEYS; key++)
+    {
+        STORAGE_Scan(key, &header);
+        compact_size[key] = header == NULL ? 0 : header->size;
+        if (header != NULL) memcpy(COMPACT_BUFFER[key], header + 1, header->size);
+    }
+
+    erase.TypeErase = FLASH_TYPEERASE_PAGES;
+    erase.Banks = STORAGE_BANK;
+    erase.Page = STORAGE_PAGE;
+    erase.NbPages = 1;
+    if (HAL_FLASHEx_Erase(&erase, &error) != HAL_OK) return 0;
+
+    uint32_t addr = STORAGE_ADDR;
+    for (uint8_t key = 0; key < STORAGE_KEYS; key++)
+    {
+        if (compact_size[key] == 0) continue;
+        if (STORAGE_Program(addr, key, COMPACT_BUFFER[key], compact_size[key]) != HAL_OK) return 0;
+        addr += STORAGE_Footprint(compact_size[key]);
+    }
+    return addr;
+}
+
+/*!
+ * @brief   reads the newest intact record of a key
+ * @param   key                 record key
+ * @param   data                destination
+ * @param   size                expected payload size in bytes
+ * @return  HAL_StatusTypeDef   HAL_OK if a record of exactly this size was found
+ */
+HAL_StatusTypeDef STORAGE_Read(uint8_t key, void* data, uint16_t size)
+{
+    const storage_header_t* header;
+
+    if (key >= STORAGE_KEYS) return HAL_ERROR;
+    STORAGE_Scan(key, &header);
+    if (header == NULL || header->size != size) return HAL_ERROR;                                   // missing, or written by an older layout
+    memcpy(data, header + 1, size);
+    return HAL_OK;
+}
+
+/*!
+ * @brief   appends a new record for a key, compacting the page first if it is full
+ * @param   key                 record key
+ * @param   data                payload
+ * @param   size                payload size in bytes, at most STORAGE_MAX_SIZE
+ * @return  HAL_StatusTypeDef   HAL_OK once the record has been programmed and read back
+ */
+HAL_StatusTypeDef STORAGE_Write(uint8_t key, const void* data, uint16_t size)
+{
+    const storage_header_t* header;
+    HAL_StatusTypeDef status = HAL_ERROR;
+
+    if (key >= STORAGE_KEYS || size == 0 || size > STORAGE_MAX_SIZE) return HAL_ERROR;
+
+    STORAGE_Scan(key, &header);
+    if (header != NULL && header->size == size && !memcmp(header + 1, data, size))
+        return HAL_OK;                                                                              // unchanged, save a flash cycle
+
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+
+    uint32_t addr = STORAGE_Scan(STORAGE_KEYS, &header);
+    if (addr + STORAGE_Footprint(size) > STORAGE_ADDR + STORAGE_PAGE_SIZE ||                        // page full, or the log ends on
+        *(const uint64_t*)addr != UINT64_MAX) addr = STORAGE_Compact();                             // a torn header that cannot be reprogrammed
+    if (addr != 0 && addr + STORAGE_Footprint(size) <= STORAGE_ADDR + STORAGE_PAGE_SIZE)
+        status = STORAGE_Program(addr, key, data, size);
+
+    HAL_FLASH_Lock();
+
+    if (status != HAL_OK) return status;
+    STORAGE_Scan(key, &header);                                                                     // verify through the same path reads use
+    if (header == NULL || header->size != size || memcmp(header + 1, data, size)) return HAL_ERROR;
+    return HAL_OK;
+}
+
+/* --------------------------------------------------------------------------------------------- */
@@ -0,0 +1,58 @@
+/*!
+ * @file    Flash_Storage.h
+ * @brief   Small key/value record store in the last flash page of the STM32 L4R5ZI-P
+ * @note    Records are appended to a single 4 KB page, so a value can be rewritten many
+ *          times before the page has to be erased. Reading returns the newest copy of a key
+ *          whose checksum is intact, so a write cut short by a power loss falls back to the
+ *          previous value. When the page is full the newest copy of every key is kept and
+ *          the page is erased and rewritten.
+ *
+ *          The page is the last one of bank 2 with the default dual bank option (DBANK = 1),
+ *          far above the application image.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#ifndef FLASH_STORAGE_H
+#define FLASH_STORAGE_H
+
+#include "stm32l4xx_hal.h"
+
+/* ------------------------------------ Storage Definitions ------------------------------------ */
+#define STORAGE_BANK            FLASH_BANK_2
+#define STORAGE_PAGE            255                                                                 // page number inside the bank
+#define STORAGE_PAGE_SIZE       0x1000                                                              // bytes, 4 KB in dual bank mode
+#define STORAGE_ADDR            0x081FF000                                                          // first byte of the page
+#define STORAGE_MAGIC           0xA5                                                                // marks a record header
+#define STORAGE_MAX_SIZE        256                                                                 // largest record payload, bytes
+
+#define STORAGE_KEY_SPH0645_CAL 0x01                                                                // microphone gain and offset
+#define STORAGE_KEY_DRV2605_CAL 0x02                                                                // motor auto-calibration results
+#define STORAGE_KEYS            8                                                                   // keys are 0 .. STORAGE_KEYS-1
+
+/* ------------------------------------ Function Prototypes ------------------------------------ */
+/*!
+ * @brief   reads the newest intact record of a key
+ * @param   key                 record key
+ * @param   data                destination
+ * @param   size                expected payload size in bytes
+ * @return  HAL_StatusTypeDef   HAL_OK if a record of exactly this size was found
+ */
+HAL_StatusTypeDef STORAGE_Read(uint8_t key, void* data, uint16_t size);
+
+/*!
+ * @brief   appends a new record for a key, compacting the page first if it is full
+ * @param   key                 record key
+ * @param   data                payload
+ * @param   size                payload size in bytes, at most STORAGE_MAX_SIZE
+ * @return  HAL_StatusTypeDef   HAL_OK once the record has been programmed and read back
+ * @note    blocks while flash is programmed, about 0.1 ms per 8 bytes and 22 ms when the
+ *          page has to be erased. Code keeps running from the other bank.
+ */
+HAL_StatusTypeDef STORAGE_Write(uint8_t key, const void* data, uint16_t size);
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
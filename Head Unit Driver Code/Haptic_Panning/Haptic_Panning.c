@@ -0,0 +1,124 @@
+/*!
+ * @file    Haptic_Panning.c
+ * @brief   Continuous bearing rendered as a phantom source between two adjacent motors
+ * @note    The bearing is handed over from the localize task as one float and one byte, both
+ *          written with single stores, so PAN_Update never needs to mask interrupts.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#include "Haptic_Panning.h"
+#include <math.h>
+
+/* -------------------------------------- Global Variables ------------------------------------- */
+#define PAN_PI          3.14159265f
+
+extern I2C_HandleTypeDef* DRV2605_HI2C_INST1;
+extern I2C_HandleTypeDef* DRV2605_HI2C_INST2;
+extern I2C_HandleTypeDef* DRV2605_HI2C_INST3;
+extern I2C_HandleTypeDef* DRV2605_HI2C_INST4;
+
+static volatile float   pan_bearing;                                                                // degrees, set by PAN_SetBearing
+static volatile uint8_t pan_intensity;                                                              // RTPIN amplitude at the bearing, 0 = silent
+
+/* ---------------------------------- Function Implementations --------------------------------- */
+/*!
+ * @brief   queues the same register write on every motor
+ * @param   reg                 register address
+ * @param   data                register value
+ * @return  HAL_StatusTypeDef   HAL_BUSY if a motor queue is full
+ */
+static HAL_StatusTypeDef PAN_QueueAll(uint8_t reg, uint8_t data)
+{
+    I2C_HandleTypeDef* motors[DRV2605_MOTORS] = {DRV2605_HI2C_INST1, DRV2605_HI2C_INST2,
+                                                 DRV2605_HI2C_INST3, DRV2605_HI2C_INST4};
+    HAL_StatusTypeDef status = HAL_OK;
+
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+        if (DRV2605_Queue(motors[motor], reg, data, 0) != HAL_OK) status = HAL_BUSY;
+    return status;
+}
+
+/*!
+ * @brief   puts every motor into real-time playback with no drive
+ * @return  HAL_StatusTypeDef   HAL_BUSY if a motor queue is full
+ */
+HAL_StatusTypeDef PAN_Start(void)
+{
+    pan_intensity = 0;
+    HAL_StatusTypeDef status = PAN_QueueAll(DRV2605_REG_RTPIN, 0x00);                               // silent before the mode switch
+    if (PAN_QueueAll(DRV2605_REG_MODE, DRV2605_MODE_REALTIME) != HAL_OK) status = HAL_BUSY;
+    return status;
+}
+
+/*!
+ * @brief   silences every motor and returns them to waveform playback
+ * @return  HAL_StatusTypeDef   HAL_BUSY if a motor queue is full
+ */
+HAL_StatusTypeDef PAN_Stop(void)
+{
+    pan_intensity = 0;
+    I2C_HandleTypeDef* motors[DRV2605_MOTORS] = {DRV2605_HI2C_INST1, DRV2605_HI2C_INST2,
+                                                 DRV2605_HI2C_INST3, DRV2605_HI2C_INST4};
+    HAL_StatusTypeDef status = HAL_OK;
+
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+        if (DRV2605_SetRealtime(motors[motor], 0x00) != HAL_OK) status = HAL_BUSY;
+    if (PAN_QueueAll(DRV2605_REG_MODE, DRV2605_MODE_PLAY) != HAL_OK) status = HAL_BUSY;
+    return status;
+}
+
+/*!
+ * @brief   sets the bearing the motors render
+ * @param   bearing     degrees, 0 = motor 1, 90 = motor 2, any range
+ * @param   intensity   RTPIN amplitude at the motor facing the bearing, 0 silences every motor
+ */
+void PAN_SetBearing(float bearing, uint8_t intensity)
+{
+    pan_bearing = bearing;
+    pan_intensity = intensity > PAN_FULL ? PAN_FULL : intensity;
+}
+
+/*!
+ * @brief   maps the level of a sound to the intensity it is rendered with
+ * @param   level       level of the window in 0.1 dBFS
+ * @return  uint8_t     RTPIN amplitude from PAN_QUIET_DRIVE to PAN_FULL, linear in dB
+ */
+uint8_t PAN_Intensity(int16_t level)
+{
+    if (level <= PAN_LEVEL_QUIET) return PAN_QUIET_DRIVE;
+    if (level >= PAN_LEVEL_LOUD) return PAN_FULL;
+    return (uint8_t)(PAN_QUIET_DRIVE + (PAN_FULL - PAN_QUIET_DRIVE)*(level - PAN_LEVEL_QUIET)/
+                     (PAN_LEVEL_LOUD - PAN_LEVEL_QUIET));
+}
+
+/*!
+ * @brief   streams the amplitudes of the current bearing to the motors
+ */
+void PAN_Update(void)
+{
+    I2C_HandleTypeDef* motors[DRV2605_MOTORS] = {DRV2605_HI2C_INST1, DRV2605_HI2C_INST2,
+                                                 DRV2605_HI2C_INST3, DRV2605_HI2C_INST4};
+    uint8_t amplitude[DRV2605_MOTORS] = {0};
+    uint8_t intensity = pan_intensity;
+
+    if (intensity != 0)
+    {
+        float bearing = fmodf(pan_bearing, 360.0f);
+        if (bearing < 0.0f) bearing += 360.0f;
+        int motor = (int)(bearing/90.0f) % DRV2605_MOTORS;
+        float angle = (bearing - 90.0f*motor)*PAN_PI/180.0f;                                        // 0 to 90 degrees past the motor
+
+        uint8_t near = (uint8_t)(intensity*cosf(angle) + 0.5f);
+        uint8_t next = (uint8_t)(intensity*sinf(angle) + 0.5f);
+        amplitude[motor] = near >= PAN_MIN_DRIVE ? near : 0;
+        amplitude[(motor + 1) % DRV2605_MOTORS] = next >= PAN_MIN_DRIVE ? next : 0;
+    }
+
+    for (int motor = 0; motor < DRV2605_MOTORS; motor++)
+        DRV2605_SetRealtime(motors[motor], amplitude[motor]);                                       // no I2C unless the amplitude changed
+}
+
+/* --------------------------------------------------------------------------------------------- */
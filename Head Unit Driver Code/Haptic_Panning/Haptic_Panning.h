@@ -0,0 +1,79 @@
+/*!
+ * @file    Haptic_Panning.h
+ * @brief   Continuous bearing rendered as a phantom source between two adjacent motors
+ * @note    Instead of buzzing the motor nearest to a discrete direction, every motor runs in
+ *          real-time playback and the haptic task streams drive amplitudes to the pair
+ *          around the bearing with a constant power panning law, so the felt source moves
+ *          smoothly around the head as the tracker does.
+ *
+ *          BEARING                     MOTOR AT THE BEARING    NEXT MOTOR
+ *          --------------------------------------------------------------------
+ *          90*m                        full                    off
+ *          90*m + 45                   71 %                    71 %
+ *          90*m + f*90                 cos(f*90)               sin(f*90)
+ *
+ *          PAN_Update only hands amplitudes to DRV2605_SetRealtime, which writes nothing
+ *          for a motor whose amplitude did not change and folds a new amplitude into a write
+ *          still waiting in the queue, so a bus never carries more than PAN_RATE RTPIN
+ *          writes a second however often the bearing moves.
+ *
+ *          PAN_Intensity scales the whole pair with the loudness of the sound, so a shout is
+ *          felt at full drive and quiet chatter just above the point the motors start.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#ifndef HAPTIC_PANNING_H
+#define HAPTIC_PANNING_H
+
+#include "stm32l4xx_hal.h"
+#include "Adafruit_DRV2605.h"
+
+/* ------------------------------------ Panning Definitions ------------------------------------ */
+#define PAN_RATE                50                                                                  // Hz, amplitude updates, one per timer tick
+#define PAN_FULL                0x7F                                                                // RTPIN full scale in the signed format
+#define PAN_MIN_DRIVE           0x18                                                                // RTPIN below which an ERM does not spin, sent as 0
+#define PAN_QUIET_DRIVE         (PAN_MIN_DRIVE*3/2)                                                 // softest intensity, still spins both motors at 45 degrees
+#define PAN_LEVEL_QUIET         (-500)                                                              // 0.1 dBFS, PAN_QUIET_DRIVE at and below
+#define PAN_LEVEL_LOUD          (-100)                                                              // 0.1 dBFS, PAN_FULL at and above
+
+/* ------------------------------------ Function Prototypes ------------------------------------ */
+/*!
+ * @brief   puts every motor into real-time playback with no drive
+ * @return  HAL_StatusTypeDef   HAL_BUSY if a motor queue is full
+ * @note    call after DRV2605_Begin, cues played with DRV2605_Go are ignored until PAN_Stop
+ */
+HAL_StatusTypeDef PAN_Start(void);
+
+/*!
+ * @brief   silences every motor and returns them to waveform playback
+ * @return  HAL_StatusTypeDef   HAL_BUSY if a motor queue is full
+ */
+HAL_StatusTypeDef PAN_Stop(void);
+
+/*!
+ * @brief   sets the bearing the motors render
+ * @param   bearing     degrees, 0 = motor 1, 90 = motor 2, any range
+ * @param   intensity   RTPIN amplitude at the motor facing the bearing, 0 silences every motor
+ * @note    picked up by the next PAN_Update, safe to call from any task
+ */
+void PAN_SetBearing(float bearing, uint8_t intensity);
+
+/*!
+ * @brief   maps the level of a sound to the intensity it is rendered with
+ * @param   level       level of the window in 0.1 dBFS
+ * @return  uint8_t     RTPIN amplitude from PAN_QUIET_DRIVE to PAN_FULL, linear in dB
+ */
+uint8_t PAN_Intensity(int16_t level);
+
+/*!
+ * @brief   streams the amplitudes of the current bearing to the motors
+ * @note    call once per timer tick, at PAN_RATE
+ */
+void PAN_Update(void);
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
@@ -0,0 +1,61 @@
+/*!
+ * @file    Haptic_Patterns.c
+ * @brief   Waveform sequences that encode where a sound comes from and how it sounds
+ * @note    Sequences only use a few effects, so a motor that keeps cueing the same kind of
+ *          sound holds its sequence and DRV2605_LoadPattern writes nothing.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#include "Haptic_Patterns.h"
+
+/* -------------------------------------- Global Variables ------------------------------------- */
+static const uint8_t CLICK[3] = {DRV2605_EFFECT_STRONG_CLICK, DRV2605_EFFECT_STRONG_CLICK_60,
+                                 DRV2605_EFFECT_STRONG_CLICK_30};                                   // loud, medium, quiet
+static const uint8_t BUMP[3]  = {DRV2605_EFFECT_SOFT_BUMP, DRV2605_EFFECT_SOFT_BUMP_60,
+                                 DRV2605_EFFECT_SOFT_BUMP_30};
+
+static int16_t  cue_level[PATTERN_DIRECTIONS];                                                      // level of the last cue from each direction, 0.1 dBFS
+static uint32_t cue_tick[PATTERN_DIRECTIONS];                                                       // tick of the last cue from each direction
+static uint8_t  cued;                                                                               // directions that have a level in cue_level
+
+/* ---------------------------------- Function Implementations --------------------------------- */
+/*!
+ * @brief   builds the waveform sequence of a cue
+ * @param   pattern     sequence for DRV2605_LoadPattern
+ * @param   direction   direction of the sound, 0, 45, ... 315
+ * @param   confidence  Q15 confidence of the bearing
+ * @param   level       level of the window in 0.1 dBFS, SPH0645_LEVEL_SILENT if the source has
+ *                      no level of its own
+ */
+void PATTERN_Select(pattern_t* pattern, int direction, uint16_t confidence, int16_t level)
+{
+    int sector = ((direction % 360 + 360) % 360) / 45;
+    int strength = level >= PATTERN_LOUD ? 0 : (level >= PATTERN_QUIET ? 1 : 2);
+    uint8_t pulse = confidence >= PATTERN_CONFIDENT ? CLICK[strength] : BUMP[strength];
+    uint32_t now = HAL_GetTick();
+    int heard = level > SPH0645_LEVEL_SILENT;
+
+    int approaching = heard && (cued & (1u << sector)) &&
+        now - cue_tick[sector] < PATTERN_APPROACH_WINDOW &&
+        level - cue_level[sector] > PATTERN_APPROACH;
+    if (heard)
+    {
+        cue_level[sector] = level;
+        cue_tick[sector] = now;
+        cued |= 1u << sector;
+    }
+
+    pattern->count = 0;
+    if (approaching) pattern->waveforms[pattern->count++] = DRV2605_EFFECT_RAMP_UP;
+    pattern->waveforms[pattern->count++] = pulse;
+    if (sector >= 3 && sector <= 5)                                                                 // 135, 180 and 225 are behind
+    {
+        pattern->waveforms[pattern->count++] = DRV2605_WAIT(PATTERN_BEHIND_GAP);
+        pattern->waveforms[pattern->count++] = pulse;
+    }
+}
+
+/* --------------------------------------------------------------------------------------------- */
@@ -0,0 +1,64 @@
+/*!
+ * @file    Haptic_Patterns.h
+ * @brief   Waveform sequences that encode where a sound comes from and how it sounds
+ * @note    The motor that buzzes already tells the direction, the sequence it plays adds
+ *          the rest. Motor 1 is taken to face forward.
+ *
+ *          CUE                         SEQUENCE
+ *          --------------------------------------------------------------------
+ *          front and sides             one pulse
+ *          behind (135 to 225)         two pulses, PATTERN_BEHIND_GAP apart
+ *          approaching                 short ramp up before the pulses
+ *          confident bearing           clicks, soft bumps otherwise
+ *          loudness                    100 %, 60 % or 30 % variant of the pulse
+ *
+ *          A sound counts as approaching when its window is PATTERN_APPROACH louder than
+ *          the last cue from the same direction, if that cue is recent. A sound above
+ *          PATTERN_URGENT is cued on the next timer tick instead of waiting for the 1 s
+ *          cadence.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#ifndef HAPTIC_PATTERNS_H
+#define HAPTIC_PATTERNS_H
+
+#include "stm32l4xx_hal.h"
+#include "Adafruit_DRV2605.h"
+#include "Adafruit_SPH0645.h"
+
+/* ------------------------------------ Pattern Definitions ------------------------------------ */
+#define PATTERN_DIRECTIONS      8                                                                   // 45 degree sectors
+#define PATTERN_CONFIDENT       (0x7FFF/2)                                                          // Q15, weaker bearings get soft bumps
+#define PATTERN_LOUD            (-200)                                                              // 0.1 dBFS, full strength pulses from here
+#define PATTERN_QUIET           (-400)                                                              // 0.1 dBFS, 30 % pulses below
+#define PATTERN_URGENT          (-100)                                                              // 0.1 dBFS, cued without waiting for the cadence
+#define PATTERN_APPROACH        30                                                                  // 0.1 dB over the last cue, 3 dB
+#define PATTERN_APPROACH_WINDOW 5000                                                                // ms a cue is compared against
+#define PATTERN_BEHIND_GAP      80                                                                  // ms between the pulses of a cue from behind
+
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef struct PATTERN_STRUCT
+{
+    uint8_t waveforms[DRV2605_SEQ_SLOTS];                                                           // effect ids and waits, played in order
+    uint8_t count;                                                                                  // used slots
+} pattern_t;
+
+/* ------------------------------------ Function Prototypes ------------------------------------ */
+/*!
+ * @brief   builds the waveform sequence of a cue
+ * @param   pattern     sequence for DRV2605_LoadPattern
+ * @param   direction   direction of the sound, 0, 45, ... 315
+ * @param   confidence  Q15 confidence of the bearing
+ * @param   level       level of the window in 0.1 dBFS, SPH0645_LEVEL_SILENT if the source has
+ *                      no level of its own
+ * @note    remembers the level of every direction to detect approaching sounds, so call it
+ *          once per cue that is played
+ */
+void PATTERN_Select(pattern_t* pattern, int direction, uint16_t confidence, int16_t level);
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
@@ -0,0 +1,608 @@
+/*!
+ * @file    Localization.c
+ * @brief   Sound source localization for the head unit microphone array
+ * @note    Uses GCC-PHAT (generalized cross-correlation with phase transform) on the two
+ *          opposing microphone pairs to estimate a continuous bearing. The module has no HAL
+ *          dependency so it can also be compiled on a host machine.
+ *
+ *          Each pair is packed into one complex Q15 FFT (A1 + jA2, B1 + jB2), the two real
+ *          spectra are separated, and the cross spectrum is whitened to unit magnitude. The
+ *          correlation is then only evaluated at the physically possible lags instead of
+ *          running an inverse FFT.
+ *
+ *          SRP-PHAT reuses the same two FFTs. The four separated spectra give all six
+ *          microphone pairs, their correlations are summed along the pair delays of every
+ *          grid bearing and the strongest peak is reported as a source. Its ideal correlation
+ *          is then subtracted from every pair before the next source is searched, which keeps
+ *          the sidelobes of a single talker from showing up as a second one.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#include "Localization.h"
+#include <math.h>
+
+/* -------------------------------------- Global Variables ------------------------------------- */
+#define LOC_BAND_BINS   (LOC_BAND_HIGH - LOC_BAND_LOW + 1)
+#define LOC_LAGS        (2*LOC_MAX_LAG + 1)
+#define LOC_MASK        (LOC_FFT_SIZE - 1)
+#define LOC_PAIRS       6
+#define LOC_KERNEL      (2*LOC_MAX_LAG*16 + 1)                                                      // correlation kernel entries, 1/16 sample steps
+#define LOC_PI          3.14159265f
+
+static const uint8_t PAIRS[LOC_PAIRS][2] =                                                          // opposing pairs first, GCC-PHAT only uses those
+{
+    {LOC_CH_A1, LOC_CH_A2}, {LOC_CH_B1, LOC_CH_B2},
+    {LOC_CH_A1, LOC_CH_B1}, {LOC_CH_A1, LOC_CH_B2},
+    {LOC_CH_A2, LOC_CH_B1}, {LOC_CH_A2, LOC_CH_B2}
+};
+static const int16_t MIC_ANGLE[LOC_CHANNELS] = {0, 180, 90, 270};                                   // degrees, indexed by channel
+
+static q15_t COS_TABLE[LOC_FFT_SIZE];                                                               // cos(2*pi*m/N), sin is a quarter turn back
+static q15_t SPECTRUM_A[2*LOC_FFT_SIZE];                                                            // FFT of A1 + jA2, interleaved re/im
+static q15_t SPECTRUM_B[2*LOC_FFT_SIZE];                                                            // FFT of B1 + jB2, interleaved re/im
+static q15_t CHANNEL_SPECTRA[LOC_CHANNELS][2*LOC_BAND_BINS];                                        // separated spectrum of each microphone over the band
+static q15_t PHAT[LOC_PAIRS][2*LOC_BAND_BINS];                                                      // whitened second*conj(first) of each pair
+static int16_t SRP_LAGS[LOC_PAIRS][LOC_SRP_GRID];                                                   // pair delay at each grid bearing, Q8 samples
+static q15_t SRP_KERNEL[LOC_KERNEL];                                                                // whitened correlation of a pure delay, by |offset|
+
+/* ---------------------------------- Function Implementations --------------------------------- */
+/*!
+ * @brief   builds the cosine table shared by the FFT and the lag evaluation
+ */
+void LOC_Init(void)
+{
+    for (int m = 0; m < LOC_FFT_SIZE; m++)
+        COS_TABLE[m] = (q15_t)lrintf(cosf(2.0f*LOC_PI*m/LOC_FFT_SIZE) * Q15_ONE);
+
+    for (int p = 0; p < LOC_PAIRS; p++)                                                             // far-field delay of the second mic behind the first
+        for (int g = 0; g < LOC_SRP_GRID; g++)
+        {
+            float theta = 2.0f*LOC_PI*g/LOC_SRP_GRID;
+            float first = cosf(theta - MIC_ANGLE[PAIRS[p][0]]*(LOC_PI/180.0f));
+            float second = cosf(theta - MIC_ANGLE[PAIRS[p][1]]*(LOC_PI/180.0f));
+            SRP_LAGS[p][g] = (int16_t)lrintf(0.5f*LOC_ARRAY_DELAY*(first - second)*256.0f);
+        }
+
+    for (int d = 0; d < LOC_KERNEL; d++)                                                            // table lookups only, cheap at any clock
+    {
+        int32_t sum = 0;
+        for (int k = LOC_BAND_LOW; k <= LOC_BAND_HIGH; k++)
+            sum += COS_TABLE[((uint32_t)(k*d + 8) >> 4) & LOC_MASK];
+        SRP_KERNEL[d] = (q15_t)(sum / LOC_BAND_BINS);
+    }
+}
+
+/*!
+ * @brief   looks up sin(2*pi*m/N)
+ * @param   m           table index, taken modulo N
+ * @return  q15_t       sine value
+ */
+static inline q15_t LOC_Sin(uint32_t m)
+{
+    return COS_TABLE[(m + 3*LOC_FFT_SIZE/4) & LOC_MASK];
+}
+
+/*!
+ * @brief   packs two channels of a frame into one complex buffer, removing DC and scaling
+ *          both channels by the same power of two so the FFT starts with headroom
+ * @param   frame       interleaved frame
+ * @param   chRe        channel placed in the real part
+ * @param   chIm        channel placed in the imaginary part
+ * @param   dc          per-channel DC level
+ * @param   peak        per-channel peak magnitude with DC removed
+ * @param   z           complex output buffer
+ */
+static void LOC_Pack(const q15_t* frame, int chRe, int chIm, const q15_t* dc, const q15_t* peak,
+    q15_t* z)
+{
+    int32_t dcRe = dc[chRe], dcIm = dc[chIm];
+    uint32_t top = (uint32_t)(peak[chRe] | peak[chIm]);
+
+    int bits = top ? 32 - __builtin_clz(top) : 0;                                                   // magnitude bits in use
+    int shift = 13 - bits;                                                                          // leave |x| < 0x2000 for the first stage
+    for (int i = 0; i < LOC_FFT_SIZE; i++)
+    {
+        int32_t re = frame[i*LOC_CHANNELS + chRe] - dcRe;
+        int32_t im = frame[i*LOC_CHANNELS + chIm] - dcIm;
+        z[2*i]     = (q15_t)(shift >= 0 ? re << shift : re >> -shift);
+        z[2*i + 1] = (q15_t)(shift >= 0 ? im << shift : im >> -shift);
+    }
+}
+
+/*!
+ * @brief   reorders a complex buffer into bit-reversed index order
+ * @param   z           complex buffer of LOC_FFT_SIZE points
+ */
+static void LOC_BitReverse(q15_t* z)
+{
+    for (uint32_t i = 1, j = 0; i < LOC_FFT_SIZE; i++)
+    {
+        uint32_t bit = LOC_FFT_SIZE >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j)
+        {
+            q15_t re = z[2*i], im = z[2*i + 1];
+            z[2*i] = z[2*j]; z[2*i + 1] = z[2*j + 1];
+            z[2*j] = re;     z[2*j + 1] = im;
+        }
+    }
+}
+
+/*!
+ * @brief   in-place radix-2 decimation-in-time FFT on Q15 data with block floating point
+ * @param   z           complex buffer of LOC_FFT_SIZE points, interleaved re/im
+ * @return  int         number of stages that were scaled by 1/2 (block exponent)
+ * @note    a stage is only scaled when the previous one produced a value that could
+ *          overflow, which keeps quiet frames from losing their low bits
+ */
+static int LOC_FFT(q15_t* z)
+{
+    LOC_BitReverse(z);
+
+    int scale = 0, exponent = 0;
+    for (int half = 1, step = LOC_FFT_SIZE/2; half < LOC_FFT_SIZE; half <<= 1, step >>= 1)
+    {
+        uint32_t peak = 0;
+        for (int k = 0; k < half; k++)
+        {
+            int32_t c = COS_TABLE[k*step];                                                          // W = c - js
+            int32_t s = LOC_Sin(k*step);
+            for (int i = k; i < LOC_FFT_SIZE; i += 2*half)
+            {
+                int j = i + half;
+                int32_t tr = (c*z[2*j] + s*z[2*j + 1]) >> 15;
+                int32_t ti = (c*z[2*j + 1] - s*z[2*j]) >> 15;
+                int32_t ar = z[2*i], ai = z[2*i + 1];
+
+                int32_t r0 = (ar + tr) >> scale, i0 = (ai + ti) >> scale;
+                int32_t r1 = (ar - tr) >> scale, i1 = (ai - ti) >> scale;
+                z[2*i] = (q15_t)r0; z[2*i + 1] = (q15_t)i0;
+                z[2*j] = (q15_t)r1; z[2*j + 1] = (q15_t)i1;
+
+                peak |= (uint32_t)(r0 ^ (r0 >> 31)) | (uint32_t)(i0 ^ (i0 >> 31)) |
+                        (uint32_t)(r1 ^ (r1 >> 31)) | (uint32_t)(i1 ^ (i1 >> 31));
+            }
+        }
+        exponent += scale;
+        scale = (peak >= 0x2000);                                                                   // |a| + |b|*sqrt(2) must stay below 2^15
+    }
+    return exponent;
+}
+
+/*!
+ * @brief   separates the two real spectra of a packed FFT over the band
+ * @param   z           FFT of x1 + jx2
+ * @param   x1          band spectrum of x1, interleaved re/im
+ * @param   x2          band spectrum of x2, interleaved re/im
+ * @note    X1[k] = (Z[k] + conj(Z[N-k]))/2 and X2[k] = (Z[k] - conj(Z[N-k]))/2j
+ */
+static void LOC_Split(const q15_t* z, q15_t* x1, q15_t* x2)
+{
+    for (int k = LOC_BAND_LOW; k <= LOC_BAND_HIGH; k++)
+    {
+        int32_t a = z[2*k], b = z[2*k + 1];
+        int32_t c = z[2*(LOC_FFT_SIZE - k)], d = z[2*(LOC_FFT_SIZE - k) + 1];
+
+        int i = 2*(k - LOC_BAND_LOW);
+        x1[i] = (q15_t)((a + c) >> 1); x1[i + 1] = (q15_t)((b - d) >> 1);
+        x2[i] = (q15_t)((b + d) >> 1); x2[i + 1] = (q15_t)((c - a) >> 1);
+    }
+}
+
+/*!
+ * @brief   packs, transforms and separates all four channels of a frame
+ * @param   frame       interleaved 4-channel Q15 frame of LOC_FFT_SIZE samples
+ * @param   dc          per-channel DC level of the frame
+ * @param   peak        per-channel peak magnitude with DC removed
+ * @note    the two FFTs may end up with different block exponents, which only scales their
+ *          spectra and does not matter once a pair is whitened
+ */
+static void LOC_Transform(const q15_t* frame, const q15_t* dc, const q15_t* peak)
+{
+    LOC_Pack(frame, LOC_CH_A1, LOC_CH_A2, dc, peak, SPECTRUM_A);
+    LOC_Pack(frame, LOC_CH_B1, LOC_CH_B2, dc, peak, SPECTRUM_B);
+    LOC_FFT(SPECTRUM_A);
+    LOC_FFT(SPECTRUM_B);
+    LOC_Split(SPECTRUM_A, CHANNEL_SPECTRA[LOC_CH_A1], CHANNEL_SPECTRA[LOC_CH_A2]);
+    LOC_Split(SPECTRUM_B, CHANNEL_SPECTRA[LOC_CH_B1], CHANNEL_SPECTRA[LOC_CH_B2]);
+}
+
+/*!
+ * @brief   whitens the cross spectrum of two microphones
+ * @param   x1          band spectrum of the first microphone
+ * @param   x2          band spectrum of the second microphone
+ * @param   phat        unit-magnitude X2*conj(X1) over the band
+ * @return  float       spectral flatness of |X2*conj(X1)| over the band, 0..1
+ * @note    the flatness is the ratio of the geometric to the arithmetic mean and reuses the
+ *          magnitude needed for whitening
+ */
+static float LOC_Whiten(const q15_t* x1, const q15_t* x2, q15_t* phat)
+{
+    float logSum = 0.0f, sum = 0.0f;
+    for (int i = 0; i < 2*LOC_BAND_BINS; i += 2)
+    {
+        int32_t x1r = x1[i], x1i = x1[i + 1];
+        int32_t x2r = x2[i], x2i = x2[i + 1];
+
+        float gr = (float)(((x2r*x1r) >> 1) + ((x2i*x1i) >> 1));                                    // halved so the sum cannot overflow
+        float gi = (float)(((x2i*x1r) >> 1) - ((x2r*x1i) >> 1));
+        float mag = sqrtf(gr*gr + gi*gi);
+
+        if (mag > 0.0f)
+        {
+            float inv = Q15_ONE / mag;
+            phat[i] = (q15_t)(gr * inv);
+            phat[i + 1] = (q15_t)(gi * inv);
+            logSum += log2f(mag);
+        }
+        else phat[i] = phat[i + 1] = 0;
+        sum += mag;
+    }
+
+    if (sum <= 0.0f) return 1.0f;                                                                   // silence is treated as noise
+    return exp2f(logSum/LOC_BAND_BINS) / (sum/LOC_BAND_BINS);
+}
+
+/*!
+ * @brief   evaluates the whitened cross-correlation at one lag
+ * @param   phat        whitened cross spectrum over the band
+ * @param   lag         lag in samples
+ * @return  int32_t     correlation, LOC_BAND_BINS*Q15_ONE for a perfect match
+ */
+static int32_t LOC_Correlate(const q15_t* phat, int lag)
+{
+    int32_t acc = 0;
+    for (int k = LOC_BAND_LOW; k <= LOC_BAND_HIGH; k++)
+    {
+        uint32_t m = (uint32_t)(k*lag) & LOC_MASK;
+        const q15_t* u = phat + 2*(k - LOC_BAND_LOW);
+        acc += (u[0]*COS_TABLE[m] - u[1]*LOC_Sin(m)) >> 15;                                         // Re(U * e^(j*2*pi*k*lag/N))
+    }
+    return acc;
+}
+
+/*!
+ * @brief   evaluates the whitened cross-correlation at every physically possible lag
+ * @param   phat        whitened cross spectrum over the band
+ * @param   r           correlation at lags -LOC_MAX_LAG..LOC_MAX_LAG
+ */
+static void LOC_CorrelateLags(const q15_t* phat, int32_t* r)
+{
+    for (int i = 0; i < LOC_LAGS; i++) r[i] = LOC_Correlate(phat, i - LOC_MAX_LAG);
+}
+
+/*!
+ * @brief   finds the delay of a microphone pair with sub-sample resolution
+ * @param   r           correlation at lags -LOC_MAX_LAG..LOC_MAX_LAG
+ * @param   peak        normalized peak height, Q15
+ * @return  float       delay of the second microphone relative to the first, samples
+ */
+static float LOC_FindLag(const int32_t* r, int32_t* peak)
+{
+    int best = 0;
+    for (int i = 1; i < LOC_LAGS; i++)
+        if (r[i] > r[best]) best = i;
+
+    float lag = (float)(best - LOC_MAX_LAG);
+    if (best > 0 && best < LOC_LAGS - 1)                                                            // parabolic interpolation around the peak
+    {
+        float ym = (float)r[best - 1], y0 = (float)r[best], yp = (float)r[best + 1];
+        float den = ym - 2.0f*y0 + yp;
+        if (den < 0.0f) lag += 0.5f*(ym - yp)/den;
+    }
+
+    *peak = r[best] / LOC_BAND_BINS;
+    if (*peak < 0) *peak = 0;
+    if (*peak > Q15_ONE) *peak = Q15_ONE;
+    return lag;
+}
+
+/*!
+ * @brief   estimates the source bearing of one frame with GCC-PHAT
+ * @param   frame       interleaved 4-channel Q15 frame of LOC_FFT_SIZE samples
+ * @param   dc          per-channel DC level of the frame
+ * @param   peak        per-channel peak magnitude with DC removed
+ * @param   result      bearing, confidence, pair delays and spectral flatness
+ */
+void LOC_GCCPHAT(const q15_t* frame, const q15_t* dc, const q15_t* peak, loc_result_t* result)
+{
+    int32_t r[LOC_LAGS];
+    int32_t peakA, peakB;
+
+    LOC_Transform(frame, dc, peak);
+    float flatA = LOC_Whiten(CHANNEL_SPECTRA[LOC_CH_A1], CHANNEL_SPECTRA[LOC_CH_A2], PHAT[0]);
+    float flatB = LOC_Whiten(CHANNEL_SPECTRA[LOC_CH_B1], CHANNEL_SPECTRA[LOC_CH_B2], PHAT[1]);
+
+    LOC_CorrelateLags(PHAT[0], r);
+    float lagA = LOC_FindLag(r, &peakA);                                                            // ~cos(bearing), A2 hears it later from the front
+    LOC_CorrelateLags(PHAT[1], r);
+    float lagB = LOC_FindLag(r, &peakB);                                                            // ~sin(bearing)
+
+    float bearing = atan2f(lagB, lagA) * (180.0f/LOC_PI);
+    if (bearing < 0.0f) bearing += 360.0f;
+
+    result->bearing = (int16_t)lrintf(bearing) % 360;
+    result->confidence = (uint16_t)(peakA < peakB ? peakA : peakB);
+    result->lagA = (int16_t)lrintf(lagA*256.0f);
+    result->lagB = (int16_t)lrintf(lagB*256.0f);
+    result->flatness = (uint16_t)lrintf(0.5f*(flatA + flatB)*Q15_ONE);
+}
+
+/*!
+ * @brief   reads a pair correlation at a fractional lag
+ * @param   r           correlation at lags -LOC_MAX_LAG..LOC_MAX_LAG
+ * @param   lag         lag, Q8 samples, inside +/-LOC_ARRAY_DELAY
+ * @return  int32_t     correlation, linear between integer lags
+ */
+static int32_t LOC_LagAt(const int32_t* r, int32_t lag)
+{
+    int32_t at = lag + LOC_MAX_LAG*256;
+    int32_t i = at >> 8, frac = at & 0xFF;
+    return r[i] + (int32_t)(((int64_t)(r[i + 1] - r[i])*frac) >> 8);
+}
+
+/*!
+ * @brief   subtracts the ideal whitened correlation of a source from a pair correlation
+ * @param   r           correlation at lags -LOC_MAX_LAG..LOC_MAX_LAG
+ * @param   lag         delay of the source on this pair, Q8 samples
+ * @note    the source is scaled to the correlation measured at its delay, so a single talker
+ *          leaves little more than noise behind
+ */
+static void LOC_Cancel(int32_t* r, int32_t lag)
+{
+    int32_t height = LOC_LagAt(r, lag);
+    if (height <= 0) return;
+
+    for (int i = 0; i < LOC_LAGS; i++)
+    {
+        int32_t offset = (i - LOC_MAX_LAG)*256 - lag;
+        if (offset < 0) offset = -offset;
+        r[i] -= (int32_t)(((int64_t)height*SRP_KERNEL[(offset + 8) >> 4]) >> 15);
+    }
+}
+
+/*!
+ * @brief   estimates up to LOC_SRP_SOURCES source bearings of one frame with SRP-PHAT
+ * @param   frame       interleaved 4-channel Q15 frame of LOC_FFT_SIZE samples
+ * @param   dc          per-channel DC level of the frame
+ * @param   peak        per-channel peak magnitude with DC removed
+ * @param   sources     sources ordered by strength, and the spectral flatness
+ * @return  int         number of sources found
+ * @note    the steered response at a grid bearing is the sum over all six pairs of their
+ *          correlation at the expected delay. After each source is found its correlation is
+ *          cancelled, and peaks closer than LOC_SRP_SEPARATION to a found source are skipped.
+ */
+int LOC_SRPPHAT(const q15_t* frame, const q15_t* dc, const q15_t* peak, loc_sources_t* sources)
+{
+    int32_t r[LOC_PAIRS][LOC_LAGS];
+    int32_t power[LOC_SRP_GRID];
+    float flatness = 0.0f;
+
+    LOC_Transform(frame, dc, peak);
+    for (int p = 0; p < LOC_PAIRS; p++)
+    {
+        const q15_t* first = CHANNEL_SPECTRA[PAIRS[p][0]];
+        const q15_t* second = CHANNEL_SPECTRA[PAIRS[p][1]];
+        float flat = LOC_Whiten(first, second, PHAT[p]);
+        if (p < 2) flatness += 0.5f*flat;                                                           // opposing pairs, same measure as GCC-PHAT
+        LOC_CorrelateLags(PHAT[p], r[p]);
+    }
+
+    sources->count = 0;
+    sources->flatness = (uint16_t)lrintf(flatness*Q15_ONE);
+    while (sources->count < LOC_SRP_SOURCES)
+    {
+        for (int g = 0; g < LOC_SRP_GRID; g++)
+        {
+            int32_t sum = 0;
+            for (int p = 0; p < LOC_PAIRS; p++) sum += LOC_LagAt(r[p], SRP_LAGS[p][g]);
+            power[g] = sum;
+        }
+
+        int best = -1;
+        for (int g = 0; g < LOC_SRP_GRID; g++)
+        {
+            if (power[g] < power[(g + LOC_SRP_GRID - 1) % LOC_SRP_GRID] ||                          // local maxima only
+                power[g] < power[(g + 1) % LOC_SRP_GRID]) continue;
+
+            int separated = 1;
+            for (int s = 0; s < sources->count; s++)
+            {
+                int gap = (g*360/LOC_SRP_GRID - sources->source[s].bearing + 540) % 360 - 180;
+                if (gap < LOC_SRP_SEPARATION && gap > -LOC_SRP_SEPARATION) separated = 0;
+            }
+            if (separated && (best < 0 || power[g] > power[best])) best = g;
+        }
+        if (best < 0) break;
+
+        int32_t strength = power[best] / (LOC_PAIRS*LOC_BAND_BINS);
+        if (strength < LOC_SRP_MIN_STRENGTH) break;
+
+        float ym = (float)power[(best + LOC_SRP_GRID - 1) % LOC_SRP_GRID];
+        float y0 = (float)power[best];
+        float yp = (float)power[(best + 1) % LOC_SRP_GRID];
+        float den = ym - 2.0f*y0 + yp, offset = 0.0f;
+        if (den < 0.0f) offset = 0.5f*(ym - yp)/den;                                                // parabolic interpolation between grid bearings
+
+        float bearing = (best + offset)*(360.0f/LOC_SRP_GRID);
+        if (bearing < 0.0f) bearing += 360.0f;
+
+        loc_source_t* source = &sources->source[sources->count++];
+        source->bearing = (int16_t)(lrintf(bearing) % 360);
+        source->strength = (uint16_t)(strength > Q15_ONE ? Q15_ONE : strength);
+
+        for (int p = 0; p < LOC_PAIRS; p++) LOC_Cancel(r[p], SRP_LAGS[p][best]);                    // remove the source before the next search
+    }
+    return sources->count;
+}
+
+/*!
+ * @brief   rounds a bearing to the nearest of the eight motor directions
+ * @param   result      localization result
+ * @return  int         0, 45, ... 315, or -1 if the confidence is too low
+ */
+int LOC_QuantizeAngle(const loc_result_t* result)
+{
+    if (result->confidence < LOC_MIN_CONFIDENCE) return -1;
+    return ((result->bearing + 22)/45 % 8) * 45;
+}
+
+/*!
+ * @brief   wraps an angle difference into [-180, 180)
+ * @param   deg         angle, degrees
+ * @return  float       wrapped angle
+ */
+static float LOC_Wrap180(float deg)
+{
+    deg = fmodf(deg + 180.0f, 360.0f);
+    return (deg < 0.0f ? deg + 360.0f : deg) - 180.0f;
+}
+
+/*!
+ * @brief   resets a bearing tracker
+ * @param   track       tracker state
+ */
+void LOC_TrackInit(loc_track_t* track)
+{
+    track->bearing = track->rate = 0.0f;
+    track->jump = track->jumpSpread = 0.0f;
+    track->direction = track->candidate = -1;
+    track->persistence = track->outliers = track->misses = 0;
+    track->locked = 0;
+}
+
+/*!
+ * @brief   feeds one localization result into the tracker
+ * @param   track       tracker state
+ * @param   result      localization result, low confidence results count as a miss
+ * @return  int         new motor direction (0, 45, ... 315) when it changes, otherwise -1
+ * @note    the filter runs on the unit circle, residuals are wrapped so 350 -> 10 degrees is
+ *          a 20 degree step. A source that jumps is re-acquired after LOC_TRACK_PERSIST
+ *          consecutive outliers instead of being dragged across.
+ */
+int LOC_TrackUpdate(loc_track_t* track, const loc_result_t* result)
+{
+    if (result->confidence < LOC_MIN_CONFIDENCE)
+    {
+        if (!track->locked) return -1;
+        track->bearing = fmodf(track->bearing + track->rate + 360.0f, 360.0f);                      // coast on the last rate
+        track->rate *= 0.5f;
+        if (++track->misses >= LOC_TRACK_TIMEOUT) LOC_TrackInit(track);                             // the next sound starts a new track
+        return -1;
+    }
+
+    float measured = result->bearing;
+    track->misses = 0;
+
+    if (!track->locked)
+    {
+        track->bearing = measured;
+        track->rate = 0.0f;
+        track->locked = 1;
+    }
+    else
+    {
+        float predicted = track->bearing + track->rate;
+        float residual = LOC_Wrap180(measured - predicted);
+        if (residual > LOC_TRACK_GATE || residual < -LOC_TRACK_GATE)
+        {
+            if (track->outliers == 0)
+            {
+                track->jump = measured;
+                track->jumpSpread = 0.0f;
+            }
+            else track->jumpSpread += LOC_Wrap180(measured - track->jump);
+
+            if (++track->outliers < LOC_TRACK_PERSIST) return -1;                                   // single stray window, ignore it
+            predicted = track->jump + track->jumpSpread/track->outliers;                            // the source really moved, re-acquire
+            residual = 0.0f;                                                                        // at the mean of the outlier run
+            track->rate = 0.0f;
+        }
+        track->outliers = 0;
+        track->bearing = fmodf(predicted + LOC_TRACK_ALPHA*residual + 360.0f, 360.0f);
+        track->rate += LOC_TRACK_BETA*residual;
+    }
+
+    int sector = ((int)(track->bearing + 22.5f)/45 % 8) * 45;
+    if (sector == track->direction ||
+        (track->direction >= 0 &&
+         fabsf(LOC_Wrap180(track->bearing - track->direction)) < 22.5f + LOC_TRACK_HYSTERESIS))
+    {
+        track->persistence = 0;                                                                     // still inside the current sector
+        return -1;
+    }
+
+    if (sector != track->candidate)
+    {
+        track->candidate = (int16_t)sector;
+        track->persistence = 0;
+    }
+    if (++track->persistence < LOC_TRACK_PERSIST) return -1;
+
+    track->direction = (int16_t)sector;
+    track->persistence = 0;
+    return sector;
+}
+
+/*!
+ * @brief   feeds the sources of one frame into a bank of LOC_SRP_SOURCES trackers
+ * @param   tracks      tracker states
+ * @param   sources     SRP-PHAT sources
+ * @param   directions  per tracker, new motor direction when it changes, otherwise -1
+ * @note    matching is greedy in strength order: nearest locked tracker inside the gate,
+ *          then a free tracker, then the nearest remaining one which sees it as an outlier.
+ *          Tracker 0 is always a source that is currently heard when there is one.
+ */
+void LOC_TrackSources(loc_track_t* tracks, const loc_sources_t* sources, int* directions)
+{
+    loc_result_t measured[LOC_SRP_SOURCES] = {0};                                                   // zero confidence is a miss
+    uint8_t used[LOC_SRP_SOURCES] = {0};
+
+    for (int s = 0; s < sources->count; s++)
+    {
+        const loc_source_t* source = &sources->source[s];
+        int match = -1, idle = -1;
+        float nearest = 360.0f;
+
+        for (int t = 0; t < LOC_SRP_SOURCES; t++)
+        {
+            if (used[t]) continue;
+            if (!tracks[t].locked)
+            {
+                if (idle < 0) idle = t;
+                continue;
+            }
+            float gap = fabsf(LOC_Wrap180(source->bearing - tracks[t].bearing));
+            if (gap < nearest)
+            {
+                nearest = gap;
+                match = t;
+            }
+        }
+        if (nearest > LOC_TRACK_GATE && idle >= 0) match = idle;                                    // far from every track, start a new one
+        if (match < 0) continue;
+
+        used[match] = 1;
+        measured[match].bearing = source->bearing;
+        measured[match].confidence = Q15_ONE;                                                       // already above LOC_SRP_MIN_STRENGTH
+    }
+
+    for (int t = 0; t < LOC_SRP_SOURCES; t++)
+        directions[t] = LOC_TrackUpdate(&tracks[t], &measured[t]);
+
+    if (tracks[0].locked && !tracks[0].misses) return;                                              // primary is still heard
+    for (int t = 1; t < LOC_SRP_SOURCES; t++)
+    {
+        if (!tracks[t].locked || tracks[t].misses) continue;
+        loc_track_t primary = tracks[0];                                                            // primary went quiet while another source
+        tracks[0] = tracks[t];                                                                      // is heard, promote it so the primary
+        tracks[t] = primary;                                                                        // motor does not wait for the timeout
+        directions[0] = tracks[0].direction;
+        directions[t] = -1;
+        return;
+    }
+}
@@ -0,0 +1,163 @@
+/*!
+ * @file    Localization.h
+ * @brief   Sound source localization for the head unit microphone array
+ * @note    Uses GCC-PHAT (generalized cross-correlation with phase transform) on the two
+ *          opposing microphone pairs to estimate a continuous bearing, or SRP-PHAT (steered
+ *          response power) on all six pairs to estimate several concurrent sources. The module
+ *          has no HAL dependency so it can also be compiled on a host machine.
+ *
+ *          MIC     BLOCK   POSITION
+ *          ------------------------
+ *          A1      A1      0 deg
+ *          B1      B1      90 deg
+ *          A2      A2      180 deg
+ *          B2      B2      270 deg
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#ifndef LOCALIZATION_H
+#define LOCALIZATION_H
+
+#include <stdint.h>
+
+/* ---------------------------------------- Fixed Point ---------------------------------------- */
+typedef int16_t q15_t;                                                                              // 1.15 signed fraction
+typedef int32_t q31_t;                                                                              // 1.31 signed fraction
+
+#define Q15_ONE                 0x7FFF
+
+/* --------------------------------- Localization Definitions ---------------------------------- */
+#define LOC_FFT_LOG2            10
+#define LOC_FFT_SIZE            (1 << LOC_FFT_LOG2)                                                 // must match SAMPLES
+#define LOC_CHANNELS            4                                                                   // interleaved A1/A2/B1/B2
+
+#define LOC_CH_A1               0                                                                   // channel order of an interleaved frame
+#define LOC_CH_A2               1
+#define LOC_CH_B1               2
+#define LOC_CH_B2               3
+
+#define LOC_SAMPLE_RATE         16000                                                               // Hz
+#define LOC_BAND_LOW            19                                                                  // first PHAT bin, ~300 Hz
+#define LOC_BAND_HIGH           256                                                                 // last PHAT bin, ~4 kHz
+#define LOC_MAX_LAG             9                                                                   // +/- samples, 18 cm across the head
+#define LOC_MIN_CONFIDENCE      (Q15_ONE/4)                                                         // below this no angle is reported
+#define LOC_ARRAY_DELAY         8.4f                                                                // samples for sound to cross the 18 cm diameter
+
+/* ----------------------------------- SRP-PHAT Definitions ------------------------------------ */
+#define LOC_SRP_GRID            72                                                                  // bearings searched, 5 degree steps
+#define LOC_SRP_SOURCES         2                                                                   // most concurrent sources reported
+#define LOC_SRP_SEPARATION      40                                                                  // degrees, closer peaks count as one source
+#define LOC_SRP_MIN_STRENGTH    (Q15_ONE/8)                                                         // weaker peaks are not reported
+
+/* ------------------------------------ Tracker Definitions ------------------------------------ */
+#define LOC_TRACK_ALPHA         0.40f                                                               // bearing gain of the alpha-beta filter
+#define LOC_TRACK_BETA          0.05f                                                               // rate gain of the alpha-beta filter
+#define LOC_TRACK_GATE          45.0f                                                               // degrees, larger residuals are outliers
+#define LOC_TRACK_HYSTERESIS    10.0f                                                               // degrees past a sector edge before switching
+#define LOC_TRACK_PERSIST       3                                                                   // updates a new direction must hold before it is emitted
+#define LOC_TRACK_TIMEOUT       64                                                                  // updates without a measurement before the track is dropped
+
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef struct LOC_RESULT_STRUCT
+{
+    int16_t  bearing;                                                                               // degrees, 0 = A1, 90 = B1
+    uint16_t confidence;                                                                            // Q15, normalized PHAT peak height
+    int16_t  lagA, lagB;                                                                            // A2-A1 and B2-B1 delays, Q8 samples
+    uint16_t flatness;                                                                              // Q15, spectral flatness of the cross spectra, 1 = white
+} loc_result_t;
+
+typedef struct LOC_SOURCE_STRUCT
+{
+    int16_t  bearing;                                                                               // degrees, 0 = A1, 90 = B1
+    uint16_t strength;                                                                              // Q15, steered response normalized over pairs and bins
+} loc_source_t;
+
+typedef struct LOC_SOURCES_STRUCT
+{
+    loc_source_t source[LOC_SRP_SOURCES];                                                           // strongest first
+    uint8_t      count;                                                                             // valid entries in source
+    uint16_t     flatness;                                                                          // Q15, spectral flatness of the opposing pairs, 1 = white
+} loc_sources_t;
+
+typedef struct LOC_TRACK_STRUCT
+{
+    float    bearing;                                                                               // filtered bearing, degrees
+    float    rate;                                                                                  // degrees per update
+    float    jump;                                                                                  // first outlier of the current run, degrees
+    float    jumpSpread;                                                                            // summed offsets of the run from jump, degrees
+    int16_t  direction;                                                                             // last emitted motor direction, -1 if none
+    int16_t  candidate;                                                                             // direction waiting to be emitted
+    uint8_t  persistence;                                                                           // updates the candidate has held
+    uint8_t  outliers;                                                                              // consecutive measurements outside the gate
+    uint8_t  misses;                                                                                // updates without a confident measurement
+    uint8_t  locked;                                                                                // 1 while the filter holds a track
+} loc_track_t;
+
+/* ------------------------------------ Function Prototypes ------------------------------------ */
+/*!
+ * @brief   builds the cosine table shared by the FFT and the lag evaluation
+ */
+void LOC_Init(void);
+
+/*!
+ * @brief   estimates the source bearing of one frame with GCC-PHAT
+ * @param   frame       interleaved 4-channel Q15 frame of LOC_FFT_SIZE samples
+ * @param   dc          per-channel DC level of the frame
+ * @param   peak        per-channel peak magnitude with DC removed
+ * @param   result      bearing, confidence, pair delays and spectral flatness
+ * @note    dc and peak come from the frame statistics pass, so the frame is only read once
+ */
+void LOC_GCCPHAT(const q15_t* frame, const q15_t* dc, const q15_t* peak, loc_result_t* result);
+
+/*!
+ * @brief   estimates up to LOC_SRP_SOURCES source bearings of one frame with SRP-PHAT
+ * @param   frame       interleaved 4-channel Q15 frame of LOC_FFT_SIZE samples
+ * @param   dc          per-channel DC level of the frame
+ * @param   peak        per-channel peak magnitude with DC removed
+ * @param   sources     sources ordered by strength, and the spectral flatness
+ * @return  int         number of sources found
+ * @note    shares the FFTs with GCC-PHAT, costs about three times its whitening and lag search
+ */
+int LOC_SRPPHAT(const q15_t* frame, const q15_t* dc, const q15_t* peak, loc_sources_t* sources);
+
+/*!
+ * @brief   rounds a bearing to the nearest of the eight motor directions
+ * @param   result      localization result
+ * @return  int         0, 45, ... 315, or -1 if the confidence is too low
+ */
+int LOC_QuantizeAngle(const loc_result_t* result);
+
+/*!
+ * @brief   resets a bearing tracker
+ * @param   track       tracker state
+ */
+void LOC_TrackInit(loc_track_t* track);
+
+/*!
+ * @brief   feeds one localization result into the tracker
+ * @param   track       tracker state
+ * @param   result      localization result, low confidence results count as a miss
+ * @return  int         new motor direction (0, 45, ... 315) when it changes, otherwise -1
+ * @note    the filtered bearing has to sit LOC_TRACK_HYSTERESIS past a sector edge for
+ *          LOC_TRACK_PERSIST updates before a new direction is emitted
+ */
+int LOC_TrackUpdate(loc_track_t* track, const loc_result_t* result);
+
+/*!
+ * @brief   feeds the sources of one frame into a bank of LOC_SRP_SOURCES trackers
+ * @param   tracks      tracker states
+ * @param   sources     SRP-PHAT sources
+ * @param   directions  per tracker, new motor direction when it changes, otherwise -1
+ * @note    sources are matched to the nearest locked tracker so a source keeps its tracker
+ *          when the strength order of two sources flips. When the primary source goes quiet
+ *          while another one is heard, the trackers are swapped and the new primary direction
+ *          is returned in directions[0].
+ */
+void LOC_TrackSources(loc_track_t* tracks, const loc_sources_t* sources, int* directions);
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
@@ -0,0 +1,147 @@
+/*!
+ * @file    Profiler.c
+ * @brief   Run times of every head unit stage from the DWT cycle counter
+ * @note    The time is kept as the ns at the last clock change plus the cycles since then
+ *          at the ns per cycle of the running clock, a multiply instead of a division. The
+ *          base is also moved forward once 2^30 cycles have passed, 268 s at 4 MHz, and
+ *          PROF_Due reads the time every timer tick, so the cycles since it never wrap. The ns wrap after 4.29 s, far longer than any zone,
+ *          so the unsigned difference in PROF_END is right across a wrap.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#include "Profiler.h"
+
+#if PROF_ENABLE
+#include <stdio.h>
+#include <string.h>
+
+/* -------------------------------------- Global Variables ------------------------------------- */
+static const char* const NAMES[PROF_ZONES] = {"unpack", "stats", "localize", "track", "angle",
+                                              "i2c", "uart"};
+
+static prof_stats_t stats[PROF_ZONES];
+static uint32_t     dump_tick;                                                                      // tick of the last dump
+static int8_t       dump_zone = -1;                                                                 // next zone to send, -1 between dumps
+static uint32_t     base_cycles;                                                                    // cycle count at the last clock change
+static uint32_t     base_ns;                                                                        // time at base_cycles
+static uint32_t     ns_per_cycle;                                                                   // of the running clock, PROF_NS_SHIFT fraction bits
+
+/* ---------------------------------- Function Implementations --------------------------------- */
+/*!
+ * @brief   starts the cycle counter and clears every zone
+ */
+void PROF_Init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    memset(stats, 0, sizeof(stats));
+    for (int zone = 0; zone < PROF_ZONES; zone++)
+        stats[zone].min = UINT32_MAX;
+    dump_tick = HAL_GetTick();
+    dump_zone = -1;
+    base_ns = 0;
+    base_cycles = DWT->CYCCNT;
+    ns_per_cycle = (uint32_t)((1000000000ull << PROF_NS_SHIFT) / SystemCoreClock);
+}
+
+/*!
+ * @brief   gets the time since PROF_Init
+ * @return  uint32_t    ns, wraps after 4.29 s
+ */
+uint32_t PROF_Now(void)
+{
+    uint32_t cycles = DWT->CYCCNT - base_cycles;
+    uint32_t ns = base_ns + (uint32_t)(((uint64_t)cycles*ns_per_cycle) >> PROF_NS_SHIFT);
+
+    if (cycles >= 1u << 30)                                                                         // the cycles since the base never wrap
+    {
+        base_cycles += cycles;
+        base_ns = ns;
+    }
+    return ns;
+}
+
+/*!
+ * @brief   takes the new SYSCLK as the rate of the cycle counter
+ */
+void PROF_Clock(void)
+{
+    base_ns = PROF_Now();
+    base_cycles = DWT->CYCCNT;                                                                      // cycles so far were converted at the old clock
+    ns_per_cycle = (uint32_t)((1000000000ull << PROF_NS_SHIFT) / SystemCoreClock);
+}
+
+/*!
+ * @brief   adds one pass to a zone
+ * @param   zone        zone the pass belongs to
+ * @param   ns          length of the pass
+ */
+void PROF_Record(prof_zone_t zone, uint32_t ns)
+{
+    prof_stats_t* zs = &stats[zone];
+
+    ++zs->count;
+    zs->total += ns;
+    if (ns < zs->min) zs->min = ns;
+    if (ns > zs->max) zs->max = ns;
+}
+
+/*!
+ * @brief   gets the statistics of a zone
+ * @param   zone                    zone to read
+ * @return  const prof_stats_t*     count, min, max and total ns since PROF_Init
+ */
+const prof_stats_t* PROF_GetStats(prof_zone_t zone)
+{
+    return &stats[zone];
+}
+
+/*!
+ * @brief   checks if a dump is running or due
+ * @return  int     1 if the next PROF_Dump sends a line
+ */
+int PROF_Due(void)
+{
+    PROF_Now();                                                                                     // moves the base forward even while no zone runs
+    return dump_zone >= 0 || HAL_GetTick() - dump_tick >= PROF_DUMP_PERIOD;
+}
+
+/*!
+ * @brief   sends the next line of a dump that is running or due
+ * @param   huart   UART to send on
+ * @return  int     1 if a line was sent, call again until it returns 0
+ */
+int PROF_Dump(UART_HandleTypeDef* huart)
+{
+    if (dump_zone < 0)
+    {
+        if (HAL_GetTick() - dump_tick < PROF_DUMP_PERIOD) return 0;
+        dump_tick = HAL_GetTick();
+        dump_zone = 0;
+    }
+    while (dump_zone < PROF_ZONES && stats[dump_zone].count == 0) ++dump_zone;                      // zones never entered are left out
+    if (dump_zone == PROF_ZONES)
+    {
+        dump_zone = -1;
+        return 0;
+    }
+
+    const prof_stats_t* zs = &stats[dump_zone];
+    char line[PROF_LINE];
+    int length = snprintf(line, sizeof(line), "PROF %s %lu %lu %lu %lu\r\n", NAMES[dump_zone],
+                          (unsigned long)zs->count, (unsigned long)zs->min,
+                          (unsigned long)(zs->total / zs->count), (unsigned long)zs->max);
+    if (length >= (int)sizeof(line)) length = sizeof(line) - 1;
+    HAL_UART_Transmit(huart, (uint8_t*)line, (uint16_t)length, 100);
+
+    if (++dump_zone == PROF_ZONES) dump_zone = -1;
+    return 1;
+}
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
@@ -0,0 +1,134 @@
+/*!
+ * @file    Profiler.h
+ * @brief   Run times of every head unit stage from the DWT cycle counter
+ * @note    A stage is wrapped in PROF_BEGIN and PROF_END of the same zone, in the same
+ *          block. Every pass adds to the count, minimum, maximum and total of that zone, and
+ *          the link task sends the table over hlpuart1 every PROF_DUMP_PERIOD as text.
+ *
+ *          ZONE        STAGE
+ *          --------------------------------------------------------------------
+ *          unpack      DMA hop to the Q15 window, SPH0645_SampleAll
+ *          stats       window moments, DC, min, max and energy of every channel
+ *          localize    GCC-PHAT, SRP-PHAT or the ratio decision tree
+ *          track       bearing tracker
+ *          angle       all of SPH0645_GetAngle, the stages above included
+ *          i2c         loading and triggering a cue on the motor queues
+ *          uart        arrows and health records sent by the link task
+ *
+ *          Times are in ns. The cycle counter runs at SYSCLK, so Clock_Manager calls
+ *          PROF_CLOCK on every switch and the cycles before and after it are converted at
+ *          their own clock. The angle zone spans the boost to 120 MHz and back and is still
+ *          measured right. With PROF_ENABLE 0 every PROF_ macro compiles to nothing, so a
+ *          production build runs the same code as before profiling. The profiler is
+ *          target-only, the replay bench measures wall time itself.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "stm32l4xx_hal.h"
+
+/* ------------------------------------ Profiler Definitions ----------------------------------- */
+#ifndef PROF_ENABLE
+#define PROF_ENABLE             0                                                                   // 1 to build the zones in, 0 compiles them out
+#endif
+
+#define PROF_DUMP_PERIOD        10000                                                               // ms between two dumps of the table
+#define PROF_LINE               64                                                                  // longest dump line, about 65 ms at 9600 baud
+#define PROF_NS_SHIFT           16                                                                  // fraction bits of the ns per cycle of the running clock
+
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef enum
+{
+    PROF_ZONE_UNPACK    = 0,
+    PROF_ZONE_STATS     = 1,
+    PROF_ZONE_LOCALIZE  = 2,
+    PROF_ZONE_TRACK     = 3,
+    PROF_ZONE_ANGLE     = 4,
+    PROF_ZONE_I2C       = 5,
+    PROF_ZONE_UART      = 6,
+    PROF_ZONES          = 7
+} prof_zone_t;
+
+typedef struct PROF_STATS_STRUCT
+{
+    uint32_t count;                                                                                 // passes through the zone
+    uint32_t min;                                                                                   // ns of the shortest pass
+    uint32_t max;                                                                                   // ns of the longest pass
+    uint64_t total;                                                                                 // ns of all passes, for the average
+} prof_stats_t;
+
+/* ------------------------------------ Function Prototypes ------------------------------------ */
+#if PROF_ENABLE
+#define PROF_INIT()             PROF_Init()
+#define PROF_BEGIN(zone)        uint32_t prof_##zone = PROF_Now()
+#define PROF_END(zone)          PROF_Record(zone, PROF_Now() - prof_##zone)
+#define PROF_CLOCK()            PROF_Clock()
+#define PROF_DUE()              PROF_Due()
+#define PROF_DUMP(huart)        PROF_Dump(huart)
+#else
+#define PROF_INIT()
+#define PROF_BEGIN(zone)
+#define PROF_END(zone)
+#define PROF_CLOCK()
+#define PROF_DUE()              0
+#define PROF_DUMP(huart)        0
+#endif
+
+#if PROF_ENABLE
+/*!
+ * @brief   starts the cycle counter and clears every zone
+ */
+void PROF_Init(void);
+
+/*!
+ * @brief   gets the time since PROF_Init
+ * @return  uint32_t    ns, wraps after 4.29 s
+ * @note    called by PROF_BEGIN and PROF_END, from task context only
+ */
+uint32_t PROF_Now(void);
+
+/*!
+ * @brief   takes the new SYSCLK as the rate of the cycle counter
+ * @note    called by PROF_CLOCK right after SYSCLK changed, with interrupts masked
+ */
+void PROF_Clock(void);
+
+/*!
+ * @brief   adds one pass to a zone
+ * @param   zone        zone the pass belongs to
+ * @param   ns          length of the pass
+ * @note    called by PROF_END, from task context only
+ */
+void PROF_Record(prof_zone_t zone, uint32_t ns);
+
+/*!
+ * @brief   gets the statistics of a zone
+ * @param   zone                    zone to read
+ * @return  const prof_stats_t*     count, min, max and total ns since PROF_Init
+ */
+const prof_stats_t* PROF_GetStats(prof_zone_t zone);
+
+/*!
+ * @brief   checks if a dump is running or due
+ * @return  int     1 if the next PROF_Dump sends a line
+ */
+int PROF_Due(void);
+
+/*!
+ * @brief   sends the next line of a dump that is running or due
+ * @param   huart   UART to send on
+ * @return  int     1 if a line was sent, call again until it returns 0
+ * @note    one line per zone that has passes, "zone count min avg max" in ns. The line
+ *          is sent blocking, so each call takes one line of UART time.
+ */
+int PROF_Dump(UART_HandleTypeDef* huart);
+#endif
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
@@ -0,0 +1,140 @@
+/*!
+ * @file    Scheduler.c
+ * @brief   Run-to-completion tasks woken by interrupts and by single-producer queues
+ * @note    A ready flag is a whole byte, so a post is one store and needs no read-modify-write
+ *          that an interrupt could tear. SCHED_Run clears the flag before it runs the task,
+ *          a post that lands during the run is never lost.
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#include "Scheduler.h"
+#include <string.h>
+
+/* -------------------------------------- Global Variables ------------------------------------- */
+static sched_task_t     tasks[SCHED_TASKS];
+static volatile uint8_t ready[SCHED_TASKS];                                                         // set by SCHED_Post, cleared by SCHED_Run
+
+/* ---------------------------------- Function Implementations --------------------------------- */
+/*!
+ * @brief   registers a task under an id
+ * @param   id                  0 to SCHED_TASKS-1, lower ids run first
+ * @param   task                function run once per post
+ * @return  HAL_StatusTypeDef   HAL_ERROR if the id is out of range
+ */
+HAL_StatusTypeDef SCHED_AddTask(uint8_t id, sched_task_t task)
+{
+    if (id >= SCHED_TASKS) return HAL_ERROR;
+    tasks[id] = task;
+    return HAL_OK;
+}
+
+/*!
+ * @brief   marks a task ready to run
+ * @param   id      task to run
+ */
+void SCHED_Post(uint8_t id)
+{
+    if (id < SCHED_TASKS) ready[id] = 1;
+}
+
+/*!
+ * @brief   finds the ready task with the lowest id
+ * @return  int     task id, -1 if no task is ready
+ */
+static int SCHED_Next(void)
+{
+    for (int id = 0; id < SCHED_TASKS; id++)
+        if (ready[id] && tasks[id] != NULL) return id;
+    return -1;
+}
+
+/*!
+ * @brief   runs ready tasks and sleeps while none is ready
+ */
+void SCHED_Run(void)
+{
+    while (1)
+    {
+        int id = SCHED_Next();
+        if (id >= 0)
+        {
+            ready[id] = 0;
+            __DMB();                                                                                // clear before the task reads what the poster left
+            tasks[id]();
+            continue;
+        }
+
+        __disable_irq();
+        if (SCHED_Next() < 0) __WFI();                                                              // a post after the check stays pending and wakes the core
+        __enable_irq();                                                                             // the waking interrupt runs here
+    }
+}
+
+/*!
+ * @brief   sets up an empty queue on caller storage
+ * @param   queue               queue to set up
+ * @param   items               depth*size bytes
+ * @param   size                bytes per item
+ * @param   depth               slots, a power of two up to SCHED_QUEUE_MAX
+ * @param   task                consumer posted on every push, SCHED_NO_TASK for none
+ * @return  HAL_StatusTypeDef   HAL_ERROR if the depth is not a power of two or too deep
+ */
+HAL_StatusTypeDef SCHED_QueueInit(sched_queue_t* queue, void* items, uint8_t size,
+                                  uint8_t depth, uint8_t task)
+{
+    if (depth == 0 || depth > SCHED_QUEUE_MAX || (depth & (depth - 1))) return HAL_ERROR;
+
+    queue->items = items;
+    queue->size = size;
+    queue->depth = depth;
+    queue->task = task;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->drops = 0;
+    return HAL_OK;
+}
+
+/*!
+ * @brief   copies an item into a queue and posts its consumer
+ * @param   queue       queue to push to, from its one producer only
+ * @param   item        size bytes
+ * @return  int         1 if pushed, 0 if the queue was full and the item was dropped
+ */
+int SCHED_Push(sched_queue_t* queue, const void* item)
+{
+    uint8_t head = queue->head;
+
+    if ((uint8_t)(head - queue->tail) == queue->depth)
+    {
+        ++queue->drops;
+        return 0;
+    }
+    memcpy(queue->items + (head & (queue->depth - 1))*queue->size, item, queue->size);
+    __DMB();                                                                                        // item lands before the consumer can see it
+    queue->head = (uint8_t)(head + 1);
+    SCHED_Post(queue->task);
+    return 1;
+}
+
+/*!
+ * @brief   copies the oldest item out of a queue
+ * @param   queue       queue to pop from, from its one consumer only
+ * @param   item        size bytes
+ * @return  int         1 if an item was popped, 0 if the queue was empty
+ */
+int SCHED_Pop(sched_queue_t* queue, void* item)
+{
+    uint8_t tail = queue->tail;
+
+    if (tail == queue->head) return 0;
+    __DMB();                                                                                        // read the item only after seeing the head that covers it
+    memcpy(item, queue->items + (tail & (queue->depth - 1))*queue->size, queue->size);
+    __DMB();                                                                                        // item copied before the producer can reuse the slot
+    queue->tail = (uint8_t)(tail + 1);
+    return 1;
+}
+
+/* --------------------------------------------------------------------------------------------- */
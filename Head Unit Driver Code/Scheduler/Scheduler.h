@@ -0,0 +1,102 @@
+/*!
+ * @file    Scheduler.h
+ * @brief   Run-to-completion tasks woken by interrupts and by single-producer queues
+ * @note    Every task has a ready flag that interrupts and other tasks set with SCHED_Post.
+ *          SCHED_Run clears the flag of the first ready task in id order, runs it to the
+ *          end and starts over from id 0, so a lower id always goes first. With no flag set
+ *          the core sleeps in WFI until the next interrupt.
+ *
+ *          Stages hand data over through queues with one producer and one consumer. The
+ *          producer only moves the head and the consumer only moves the tail, so neither
+ *          side masks interrupts and a reader never sees a half-written item. Pushing an
+ *          item posts the task that consumes the queue.
+ *
+ *          FLOW                        PRODUCER                CONSUMER
+ *          --------------------------------------------------------------------
+ *          ready flag                  any interrupt or task   SCHED_Run
+ *          queue                       one interrupt or task   one task
+ *
+ * @author  Miles Hanbury (mhanbury)
+ * @author  James Kelly (jkellymi)
+ * @author  Joshua Nye (nyej)
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "stm32l4xx_hal.h"
+
+/* ----------------------------------- Scheduler Definitions ----------------------------------- */
+#define SCHED_TASKS             8                                                                   // task ids 0 to 7, 0 runs first
+#define SCHED_QUEUE_MAX         128                                                                 // deepest queue the 8-bit indices can tell from empty
+#define SCHED_NO_TASK           0xFF                                                                // queue that posts nothing on a push
+
+/* ----------------------------------------- Structures ---------------------------------------- */
+typedef void (*sched_task_t)(void);
+
+typedef struct SCHED_QUEUE_STRUCT
+{
+    uint8_t*            items;                                                                      // depth slots of size bytes
+    uint8_t             size;                                                                       // bytes per item
+    uint8_t             depth;                                                                      // slots, a power of two
+    uint8_t             task;                                                                       // consumer posted on every push
+    volatile uint8_t    head;                                                                       // items pushed, only the producer writes it
+    volatile uint8_t    tail;                                                                       // items popped, only the consumer writes it
+    volatile uint16_t   drops;                                                                      // pushes refused because the queue was full
+} sched_queue_t;
+
+/* ------------------------------------ Function Prototypes ------------------------------------ */
+/*!
+ * @brief   registers a task under an id
+ * @param   id                  0 to SCHED_TASKS-1, lower ids run first
+ * @param   task                function run once per post
+ * @return  HAL_StatusTypeDef   HAL_ERROR if the id is out of range
+ * @note    a post that arrives before the task is registered is kept
+ */
+HAL_StatusTypeDef SCHED_AddTask(uint8_t id, sched_task_t task);
+
+/*!
+ * @brief   marks a task ready to run
+ * @param   id      task to run
+ * @note    safe from any interrupt. Posts that arrive before the task runs are merged into
+ *          one run, a post while it runs makes it run again.
+ */
+void SCHED_Post(uint8_t id);
+
+/*!
+ * @brief   runs ready tasks and sleeps while none is ready
+ * @note    never returns, call at the end of main once every task is registered
+ */
+void SCHED_Run(void);
+
+/*!
+ * @brief   sets up an empty queue on caller storage
+ * @param   queue               queue to set up
+ * @param   items               depth*size bytes
+ * @param   size                bytes per item
+ * @param   depth               slots, a power of two up to SCHED_QUEUE_MAX
+ * @param   task                consumer posted on every push, SCHED_NO_TASK for none
+ * @return  HAL_StatusTypeDef   HAL_ERROR if the depth is not a power of two or too deep
+ */
+HAL_StatusTypeDef SCHED_QueueInit(sched_queue_t* queue, void* items, uint8_t size,
+                                  uint8_t depth, uint8_t task);
+
+/*!
+ * @brief   copies an item into a queue and posts its consumer
+ * @param   queue       queue to push to, from its one producer only
+ * @param   item        size bytes
+ * @return  int         1 if pushed, 0 if the queue was full and the item was dropped
+ */
+int SCHED_Push(sched_queue_t* queue, const void* item);
+
+/*!
+ * @brief   copies the oldest item out of a queue
+ * @param   queue       queue to pop from, from its one consumer only
+ * @param   item        size bytes
+ * @return  int         1 if an item was popped, 0 if the queue was empty
+ */
+int SCHED_Pop(sched_queue_t* queue, void* item);
+
+#endif
+
+/* --------------------------------------------------------------------------------------------- */
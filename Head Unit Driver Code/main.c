@@ -24,20 +24,47 @@
 /* ========================================= Includes ========================================== */
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
 #include "math.h"
 #include "Adafruit_DRV2605.h"
 #include "Adafruit_SPH0645.h"
+#include "Clock_Manager.h"
+#include "Haptic_Patterns.h"
+#include "Haptic_Panning.h"
+#include "Scheduler.h"
+#include "Profiler.h"
 
 /* ============================================================================================= */
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
 /* USER CODE BEGIN PTD */
+typedef enum
+{
+  TASK_LOCALIZE = 0,                                                                                // unpacks a hop and updates the bearing, posted by the microphone DMA
+  TASK_HAPTIC   = 1,                                                                                // motor cues and bus upkeep, posted by the timer and new cues
+  TASK_LINK     = 2                                                                                 // wristband arrows and health records, posted by their queues
+} task_id_t;
+
+typedef struct CUE_STRUCT
+{
+  int16_t  angle;                                                                                   // new primary direction, -1 if it did not change
+  int16_t  second;                                                                                  // direction of the second source, -1 if none
+  uint16_t confidence;                                                                              // Q15 confidence of the primary bearing
+  int16_t  level;                                                                                   // 0.1 dBFS loudness of the hop, silent if it did not pass the gate
+} cue_t;
 
 /* USER CODE END PTD */
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+#define CALIBRATE_MICROPHONES 0                                                                     // 1 to measure the capsules against each other at boot and store it
+#define CALIBRATE_MOTORS      0                                                                     // 1 to auto-calibrate the motors at boot and store it
+#define HEALTH_REPORT_ROUNDS  10                                                                    // health rounds between two reports of an unchanged record
+#define HAPTIC_PANNING        0                                                                     // 1 to pan the tracked bearing across the motors instead of cues
+#define CUE_QUEUE_DEPTH       8                                                                     // localize -> haptic, a hop every 16 ms against a tick every 20 ms
+#define LINK_QUEUE_DEPTH      4                                                                     // haptic -> link, at most a cue a tick
+#define HEALTH_RECORD         13                                                                    // bytes of a health record on hlpuart1
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -78,12 +105,31 @@ I2C_HandleTypeDef* DRV2605_HI2C_INST1 = &hi2c1;
 I2C_HandleTypeDef* DRV2605_HI2C_INST2 = &hi2c2;
 I2C_HandleTypeDef* DRV2605_HI2C_INST3 = &hi2c3;
 I2C_HandleTypeDef* DRV2605_HI2C_INST4 = &hi2c4;
-I2C_HandleTypeDef* buzz_motor1;
-I2C_HandleTypeDef* buzz_motor2;
-
-uint8_t message = 0;
-uint8_t isDiagonal = 0;
+SAI_HandleTypeDef* HSAI_BLOCK_A1 = &hsai_BlockA1;
+SAI_HandleTypeDef* HSAI_BLOCK_A2 = &hsai_BlockA2;
+SAI_HandleTypeDef* HSAI_BLOCK_B1 = &hsai_BlockB1;
+SAI_HandleTypeDef* HSAI_BLOCK_B2 = &hsai_BlockB2;
+I2C_HandleTypeDef*  CLOCK_HI2C[CLOCK_I2C_COUNT]   = {&hi2c1, &hi2c2, &hi2c3, &hi2c4};
+UART_HandleTypeDef* CLOCK_HUART[CLOCK_UART_COUNT] = {&hlpuart1, &huart1, &huart2};
+TIM_HandleTypeDef*  CLOCK_HTIM = &htim15;                                                           // peripherals retimed on every clock switch
+sched_queue_t cue_queue;                                                                            // localize -> haptic, bearings of new hops
+sched_queue_t arrow_queue;                                                                          // haptic -> link, arrows for the wristband
+sched_queue_t health_queue;                                                                         // haptic -> link, health records for hlpuart1
+cue_t cue_items[CUE_QUEUE_DEPTH];
+uint8_t arrow_items[LINK_QUEUE_DEPTH][2];
+uint8_t health_items[LINK_QUEUE_DEPTH][HEALTH_RECORD];
+volatile uint8_t ticks = 0;                                                                         // timer ticks, only the timer interrupt writes it
+
+int last_second = -1;                                                                               // localize task: second direction of the last pushed cue
+int last_active = 0;                                                                                // localize task: the last pushed cue had sound
+cue_t cue = {-1, -1, 0, SPH0645_LEVEL_SILENT};                                                      // haptic task: direction and sound being cued
+uint8_t ticks_seen = 0;                                                                             // haptic task: timer ticks already handled
+uint8_t urgent = 0;                                                                                 // haptic task: the level just rose to urgent, cue it on this tick
+uint16_t cue_ticks = PAN_RATE - 1;                                                                  // haptic task: ticks since the last cue check, the first one is due
 uint8_t last_message = 0;
+uint8_t last_second_message = 0;                                                                    // haptic task: arrows of the last cue sent
+uint16_t health_round = 0;                                                                          // haptic task: last DRV2605 health round looked at
+uint8_t health_frame[HEALTH_RECORD];                                                                // haptic task: last health record queued for hlpuart1
 
 /* ============================================================================================= */
 /* USER CODE END PV */
@@ -104,7 +150,12 @@ static void MX_LPUART1_UART_Init(void);
 static void MX_TIM15_Init(void);
 static void MX_I2C3_Init(void);
 /* USER CODE BEGIN PFP */
-
+static void LocalizeTask(void);
+static void HapticTask(void);
+static void LinkTask(void);
+static uint8_t SelectMotors(int angle, uint8_t failed, I2C_HandleTypeDef* buzz[2]);
+static void PlayCue(uint8_t failed, uint8_t urgent);
+static void ReportHealth(const drv2605_health_t* health);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -139,11 +190,11 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_I2C1_Init();
   MX_I2C2_Init();
   MX_I2C4_Init();
   MX_SAI1_Init();
-  MX_DMA_Init();
   MX_USART1_UART_Init();
   MX_SAI2_Init();
   MX_USART2_UART_Init();
@@ -152,7 +203,38 @@ int main(void)
   MX_I2C3_Init();
   /* USER CODE BEGIN 2 */
   /* ========================================== Setup ========================================== */
-  DRV2605_Begin();                                                                                  // initialize motors
+  PROF_INIT();
+  if (CLOCK_Init() != HAL_OK) Error_Handler();                                                      // idle clock timings, before anything boosts
+  if (DRV2605_Begin() != HAL_OK)                                                                    // all four motors at once, ~3 ms
+    printf("DRV2605: a motor did not take its setup\r\n");
+#if CALIBRATE_MOTORS
+  if (DRV2605_Calibrate() != HAL_OK)                                                                // about 0.7 s, wear the unit so the motors are loaded
+    printf("DRV2605: calibration failed on some motors, kept their previous results\r\n");
+#endif
+  if (DRV2605_GetCalibration()->calibrated != (1u << DRV2605_MOTORS) - 1)
+    printf("DRV2605: motors without a stored calibration run open loop\r\n");
+  if (SPH0645_LoadCalibration() != HAL_OK)                                                          // per-microphone gain and offset from flash
+    printf("SPH0645: no calibration stored, running uncalibrated\r\n");
+  if (SPH0645_StartCapture() != HAL_OK) Error_Handler();                                            // start circular microphone capture
+#if CALIBRATE_MICROPHONES
+  if (SPH0645_Calibrate(SPH0645_CAL_HOPS) == HAL_OK)                                                // about 4 s of diffuse noise, keep the room still
+  {
+    const sph0645_calibration_t* cal = SPH0645_GetCalibration();
+    for (int ch = 0; ch < 4; ch++)
+      printf("SPH0645: mic %d gain %ld/65536 offset %d\r\n", ch, (long)cal->gain[ch],
+             cal->offset[ch]);
+  }
+  else printf("SPH0645: calibration failed, kept the previous profile\r\n");
+#endif
+#if HAPTIC_PANNING
+  PAN_Start();                                                                                      // motors follow the bearing in real time
+#endif
+  SCHED_QueueInit(&cue_queue, cue_items, sizeof(cue_t), CUE_QUEUE_DEPTH, TASK_HAPTIC);
+  SCHED_QueueInit(&arrow_queue, arrow_items, 2, LINK_QUEUE_DEPTH, TASK_LINK);
+  SCHED_QueueInit(&health_queue, health_items, 12, LINK_QUEUE_DEPTH, TASK_LINK);
+  SCHED_AddTask(TASK_LOCALIZE, LocalizeTask);
+  SCHED_AddTask(TASK_HAPTIC, HapticTask);
+  SCHED_AddTask(TASK_LINK, LinkTask);
   HAL_TIM_Base_Start_IT(&htim15);                                                                   // initialize timer interrupt
   
   /* =========================================================================================== */
@@ -161,62 +243,9 @@ int main(void)
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
   /* ========================================== Loop =========================================== */
+  SCHED_Run();                                                                                      // tasks from here on, sleeps whenever none is ready
   while (1)
   {
-    int angle = SPH0645_GetAngle();
-    switch (angle)
-    {
-    case 0:
-      buzz_motor1 = DRV2605_HI2C_INST1;
-      isDiagonal = 0;
-      break;
-    
-    case 45:
-      buzz_motor1 = DRV2605_HI2C_INST1;
-      buzz_motor2 = DRV2605_HI2C_INST2;
-      isDiagonal = 1;
-      break;
-    
-    case 90:
-      buzz_motor1 = DRV2605_HI2C_INST2;
-    	isDiagonal = 0;
-      break;
-    
-    case 135:
-      buzz_motor1 = DRV2605_HI2C_INST2;
-      buzz_motor2 = DRV2605_HI2C_INST3;
-      isDiagonal = 1;
-      break;
-
-    case 180:
-      buzz_motor1 = DRV2605_HI2C_INST3;
-      isDiagonal = 0;
-      break;
-
-    case 225:
-      buzz_motor1 = DRV2605_HI2C_INST3;
-      buzz_motor2 = DRV2605_HI2C_INST4;
-      isDiagonal = 1;
-      break;
-
-    case 270:
-      buzz_motor1 = DRV2605_HI2C_INST4;
-      isDiagonal = 0;
-      break;
-
-    case 315:
-      buzz_motor1 = DRV2605_HI2C_INST4;
-      buzz_motor2 = DRV2605_HI2C_INST1;
-      isDiagonal = 1;
-      break;
-
-    default:
-      /* do nothing */
-      break;
-    }
-
-    message = ((uint8_t) (angle/45));
-    ++message;
     /* ========================================================================================= */
     /* USER CODE END WHILE */
     /* USER CODE BEGIN 3 */
@@ -642,7 +671,7 @@ static void MX_SAI1_Init(void)
   hsai_BlockA1.Init.NoDivider = SAI_MASTERDIVIDER_ENABLE;
   hsai_BlockA1.Init.FIFOThreshold = SAI_FIFOTHRESHOLD_EMPTY;
   hsai_BlockA1.Init.AudioFrequency = SAI_AUDIO_FREQUENCY_16K;
-  hsai_BlockA1.Init.SynchroExt = SAI_SYNCEXT_DISABLE;
+  hsai_BlockA1.Init.SynchroExt = SAI_SYNCEXT_OUTBLOCKA_ENABLE;
   hsai_BlockA1.Init.MonoStereoMode = SAI_MONOMODE;
   hsai_BlockA1.Init.CompandingMode = SAI_NOCOMPANDING;
   if (HAL_SAI_InitProtocol(&hsai_BlockA1, SAI_I2S_STANDARD, SAI_PROTOCOL_DATASIZE_32BIT, 2) != HAL_OK)
@@ -650,13 +679,13 @@ static void MX_SAI1_Init(void)
     Error_Handler();
   }
   hsai_BlockB1.Instance = SAI1_Block_B;
-  hsai_BlockB1.Init.AudioMode = SAI_MODEMASTER_RX;
-  hsai_BlockB1.Init.Synchro = SAI_ASYNCHRONOUS;
+  hsai_BlockB1.Init.AudioMode = SAI_MODESLAVE_RX;
+  hsai_BlockB1.Init.Synchro = SAI_SYNCHRONOUS;
   hsai_BlockB1.Init.OutputDrive = SAI_OUTPUTDRIVE_DISABLE;
   hsai_BlockB1.Init.NoDivider = SAI_MASTERDIVIDER_ENABLE;
   hsai_BlockB1.Init.FIFOThreshold = SAI_FIFOTHRESHOLD_EMPTY;
   hsai_BlockB1.Init.AudioFrequency = SAI_AUDIO_FREQUENCY_16K;
-  hsai_BlockB1.Init.SynchroExt = SAI_SYNCEXT_DISABLE;
+  hsai_BlockB1.Init.SynchroExt = SAI_SYNCEXT_OUTBLOCKA_ENABLE;
   hsai_BlockB1.Init.MonoStereoMode = SAI_MONOMODE;
   hsai_BlockB1.Init.CompandingMode = SAI_NOCOMPANDING;
   if (HAL_SAI_InitProtocol(&hsai_BlockB1, SAI_I2S_STANDARD, SAI_PROTOCOL_DATASIZE_32BIT, 2) != HAL_OK)
@@ -685,8 +714,8 @@ static void MX_SAI2_Init(void)
 
   /* USER CODE END SAI2_Init 1 */
   hsai_BlockA2.Instance = SAI2_Block_A;
-  hsai_BlockA2.Init.AudioMode = SAI_MODEMASTER_RX;
-  hsai_BlockA2.Init.Synchro = SAI_ASYNCHRONOUS;
+  hsai_BlockA2.Init.AudioMode = SAI_MODESLAVE_RX;
+  hsai_BlockA2.Init.Synchro = SAI_SYNCHRONOUS_EXT_SAI1;
   hsai_BlockA2.Init.OutputDrive = SAI_OUTPUTDRIVE_DISABLE;
   hsai_BlockA2.Init.NoDivider = SAI_MASTERDIVIDER_ENABLE;
   hsai_BlockA2.Init.FIFOThreshold = SAI_FIFOTHRESHOLD_EMPTY;
@@ -699,8 +728,8 @@ static void MX_SAI2_Init(void)
     Error_Handler();
   }
   hsai_BlockB2.Instance = SAI2_Block_B;
-  hsai_BlockB2.Init.AudioMode = SAI_MODEMASTER_RX;
-  hsai_BlockB2.Init.Synchro = SAI_ASYNCHRONOUS;
+  hsai_BlockB2.Init.AudioMode = SAI_MODESLAVE_RX;
+  hsai_BlockB2.Init.Synchro = SAI_SYNCHRONOUS_EXT_SAI1;
   hsai_BlockB2.Init.OutputDrive = SAI_OUTPUTDRIVE_DISABLE;
   hsai_BlockB2.Init.NoDivider = SAI_MASTERDIVIDER_ENABLE;
   hsai_BlockB2.Init.FIFOThreshold = SAI_FIFOTHRESHOLD_EMPTY;
@@ -739,7 +768,7 @@ static void MX_TIM15_Init(void)
   htim15.Instance = TIM15;
   htim15.Init.Prescaler = 3999;
   htim15.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim15.Init.Period = 999;
+  htim15.Init.Period = 19;
   htim15.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
   htim15.Init.RepetitionCounter = 0;
   htim15.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
@@ -817,6 +846,7 @@ static void MX_DMA_Init(void)
   */
 static void MX_GPIO_Init(void)
 {
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
 
   /* GPIO Ports Clock Enable */
   __HAL_RCC_GPIOE_CLK_ENABLE();
@@ -827,25 +857,265 @@ static void MX_GPIO_Init(void)
   __HAL_RCC_GPIOG_CLK_ENABLE();
   HAL_PWREx_EnableVddIO2();
 
+  /*Configure GPIO pin Output Level */
+  HAL_GPIO_WritePin(GPIOE, GPIO_PIN_7|GPIO_PIN_8|GPIO_PIN_9|GPIO_PIN_10, GPIO_PIN_RESET);
+
+  /*Configure GPIO pins : PE7 PE8 PE9 PE10 */
+  GPIO_InitStruct.Pin = GPIO_PIN_7|GPIO_PIN_8|GPIO_PIN_9|GPIO_PIN_10;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+  HAL_GPIO_Init(GPIOE, &GPIO_InitStruct);
+
 }
 
 /* USER CODE BEGIN 4 */
 /* ================================== Timer Interrupt Handler ================================== */
 void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
 {
-	if (message != last_message)
-	{
-		last_message = message;
-		uint8_t size[2] = {1,0};
-		HAL_StatusTypeDef result = HAL_UART_Transmit(&huart2,size,2,100);
-		result = HAL_UART_Transmit(&huart2,&message,1,100);
-		
-    DRV2605_Go(buzz_motor1);
-		if (isDiagonal)
-		{
-			DRV2605_Go(buzz_motor2);
-		}
-	}
+	++ticks;                                                                                        // counted here, handled in the haptic task
+	SCHED_Post(TASK_HAPTIC);
+}
+
+/*!
+ * @brief   called from the DMA interrupt once a hop of every microphone is in
+ * @param   half    buffer half that was completed
+ */
+void SPH0645_FrameCpltCallback(uint8_t half)
+{
+	(void)half;
+	SCHED_Post(TASK_LOCALIZE);
+}
+
+/*!
+ * @brief   called by CLOCK_SetProfile around a clock switch
+ * @param   hold    1 while the switch waits for the buses, 0 once it is done
+ */
+void CLOCK_HoldCallback(uint8_t hold)
+{
+	DRV2605_Hold(hold);                                                                             // motor queues restart on the new timing
+}
+
+/* =========================================== Tasks =========================================== */
+/*!
+ * @brief   localizes the hop that just came in and hands the result to the haptic task
+ * @note    only runs with a frame waiting, so SPH0645_GetAngle never sleeps inside a task.
+ *          A cue is pushed on every hop with sound, so the haptic task sees the level rise,
+ *          and otherwise only when the second direction changed or the sound just stopped.
+ */
+static void LocalizeTask(void)
+{
+  if (!SPH0645_FrameAvailable()) return;                                                            // taken by a calibration, or a stale post
+
+  PROF_BEGIN(PROF_ZONE_ANGLE);
+  int angle = SPH0645_GetAngle();
+  PROF_END(PROF_ZONE_ANGLE);
+  int second = SPH0645_GetSecondaryAngle();
+#if HAPTIC_PANNING
+  const loc_track_t* track = SPH0645_GetTrack();                                                    // every hop, the bearing moves within a sector too
+  PAN_SetBearing(track->bearing, track->locked ? PAN_Intensity(SPH0645_GetLevel()) : 0);            // silent once the track times out
+#endif
+  int active = angle >= 0 || SPH0645_Active();                                                      // the window passed the gate, the level is current
+  if (!active && !last_active && second == last_second) return;                                     // still quiet, keep the last cue
+
+  cue_t next = {(int16_t)angle, (int16_t)second, 0, SPH0645_LEVEL_SILENT};
+  if (angle >= 0) next.confidence = SPH0645_GetConfidence();
+  if (active) next.level = SPH0645_GetLevel();
+  if (!SCHED_Push(&cue_queue, &next)) return;                                                       // a dropped cue is pushed again with the next hop
+  last_second = second;
+  last_active = active;
+}
+
+/*!
+ * @brief   takes the new cues, keeps the motor buses running and plays a cue once a second,
+ *          or on the next tick once the sound turns urgent
+ * @note    cues only go out on timer ticks, a push alone just records the cue. A level rising
+ *          to PATTERN_URGENT is held until that tick, so a quieter hop can not hide it.
+ */
+static void HapticTask(void)
+{
+  uint8_t elapsed = (uint8_t)(ticks - ticks_seen);
+  cue_t next;
+
+  ticks_seen = (uint8_t)(ticks_seen + elapsed);
+  while (SCHED_Pop(&cue_queue, &next))
+  {
+    if (next.level >= PATTERN_URGENT && cue.level < PATTERN_URGENT) urgent = 1;                     // rising edge
+    if (next.angle >= 0)
+    {
+      cue.angle = next.angle;
+      cue.confidence = next.confidence;
+    }
+    cue.second = next.second;
+    if (!urgent || next.level > cue.level) cue.level = next.level;                                  // a pending urgent cue keeps its loudest level
+  }
+  if (elapsed == 0) return;
+
+  DRV2605_Poll();                                                                                   // reset a motor bus that stopped answering
+  const drv2605_health_t* health = DRV2605_GetHealth();
+  if (health->rounds != health_round)                                                               // every motor was checked again
+  {
+    health_round = health->rounds;
+    ReportHealth(health);
+  }
+#if HAPTIC_PANNING
+  PAN_Update();
+#endif
+  if (PROF_DUE()) SCHED_Post(TASK_LINK);                                                            // profile table over hlpuart1, a line a run
+
+  if (cue.angle < 0) return;                                                                        // nothing localized yet, the first bearing is cued on the next tick
+  cue_ticks += elapsed;
+  if (cue_ticks < PAN_RATE && !urgent) return;                                                      // cues keep their 1 s cadence unless urgent
+  cue_ticks = 0;
+  PlayCue(health->failed, urgent);
+  urgent = 0;
+}
+
+/*!
+ * @brief   sends the queued arrows to the wristband, and the queued health records and the
+ *          profile table over hlpuart1
+ * @note    one of each per run, then posts itself again, so a hop that comes in waits for at
+ *          most one round of blocking transfers
+ */
+static void LinkTask(void)
+{
+  uint8_t size[2] = {2,0};
+  uint8_t payload[2];
+  uint8_t frame[HEALTH_RECORD];
+  int sent = 0;
+
+  if (SCHED_Pop(&arrow_queue, payload))                                                             // primary arrow, second arrow or 0
+  {
+    PROF_BEGIN(PROF_ZONE_UART);
+    HAL_UART_Transmit(&huart2,size,2,100);
+    HAL_UART_Transmit(&huart2,payload,2,100);
+    PROF_END(PROF_ZONE_UART);
+    sent = 1;
+  }
+  if (SCHED_Pop(&health_queue, frame))                                                              // about 13 ms at 9600 baud
+  {
+    PROF_BEGIN(PROF_ZONE_UART);
+    HAL_UART_Transmit(&hlpuart1, frame, sizeof(frame), 100);
+    PROF_END(PROF_ZONE_UART);
+    sent = 1;
+  }
+  if (PROF_DUMP(&hlpuart1)) sent = 1;
+  if (sent) SCHED_Post(TASK_LINK);
+}
+
+/* ======================================== Haptic Cues ======================================== */
+/*!
+ * @brief   picks the motors that play the cue of a direction, around motors that failed
+ *          their health check
+ * @param   angle       direction of the cue, 0, 45, ... 315
+ * @param   failed      motors flagged by DRV2605_GetHealth, bit 0 = motor 1
+ * @param   buzz        motors to play the cue
+ * @return  uint8_t     number of motors in buzz, 1 or 2
+ * @note    a diagonal plays on the motors on both sides and falls back to its working motor.
+ *          A cardinal direction whose motor failed is played on both neighbours at once, a
+ *          pair no other direction uses.
+ */
+static uint8_t SelectMotors(int angle, uint8_t failed, I2C_HandleTypeDef* buzz[2])
+{
+  I2C_HandleTypeDef* motors[4] = {DRV2605_HI2C_INST1, DRV2605_HI2C_INST2,
+                                  DRV2605_HI2C_INST3, DRV2605_HI2C_INST4};
+  int first = (angle/90) % 4;                                                                       // motor at or just before the angle
+  int next = (first + 1) % 4;
+  int diagonal = angle % 90 != 0;
+
+  if (diagonal && (failed & ((1u << first) | (1u << next))))
+  {
+    buzz[0] = motors[(failed & (1u << first)) ? next : first];
+    return 1;
+  }
+  if (!diagonal && (failed & (1u << first)))
+  {
+    buzz[0] = motors[(first + 3) % 4];
+    buzz[1] = motors[next];
+    return 2;
+  }
+  buzz[0] = motors[first];
+  buzz[1] = motors[next];
+  return diagonal ? 2 : 1;
+}
+
+/*!
+ * @brief   sends the arrows of the current cue to the link task and plays it, if it differs
+ *          from the last cue
+ * @param   failed      motors flagged by DRV2605_GetHealth, bit 0 = motor 1
+ * @param   urgent      1 if the sound just turned urgent, the motors play even an unchanged cue
+ * @note    the wristband arrows are never sent twice, only the motors repeat an urgent cue
+ */
+static void PlayCue(uint8_t failed, uint8_t urgent)
+{
+  uint8_t message = (uint8_t)(cue.angle/45 + 1);
+  uint8_t second_message = cue.second < 0 ? 0 : (uint8_t)(cue.second/45 + 1);                       // arrow of the second source, 0 if none
+
+  int changed = message != last_message || second_message != last_second_message;
+  uint8_t payload[2] = {message, second_message};
+
+  if (!changed && !urgent) return;
+  if (changed && SCHED_Push(&arrow_queue, payload))
+  {
+    last_message = message;
+    last_second_message = second_message;
+  }
+  else if (changed && !urgent) return;                                                              // link is behind, tried again on the next tick
+
+#if !HAPTIC_PANNING
+  I2C_HandleTypeDef* motors[4] = {DRV2605_HI2C_INST1, DRV2605_HI2C_INST2,
+                                  DRV2605_HI2C_INST3, DRV2605_HI2C_INST4};
+  I2C_HandleTypeDef* buzz[2];
+  uint8_t count = SelectMotors(cue.angle, failed, buzz);                                            // keep every direction felt around a dead motor
+  pattern_t pattern;
+
+  PATTERN_Select(&pattern, cue.angle, cue.confidence, cue.level);
+  PROF_BEGIN(PROF_ZONE_I2C);
+  for (int i = 0; i < count; i++)
+    DRV2605_LoadPattern(buzz[i], pattern.waveforms, pattern.count);                                 // no I2C if the motor already holds it
+  DRV2605_GoSync(buzz, count);                                                                      // queued, both motors of a diagonal start together
+  PROF_END(PROF_ZONE_I2C);
+
+  if (cue.second < 0 || (failed & (1u << cue.second/90))) return;
+  I2C_HandleTypeDef* buzz_motor3 = motors[cue.second/90];                                           // diagonals use the first motor of the pair
+  if (buzz_motor3 == buzz[0] || (count == 2 && buzz_motor3 == buzz[1])) return;                     // never reload a motor that is playing the primary cue
+  PATTERN_Select(&pattern, cue.second, 0, SPH0645_LEVEL_SILENT);                                    // soft and light, the second source has no level of its own
+  DRV2605_LoadPattern(buzz_motor3, pattern.waveforms, pattern.count);
+  DRV2605_Go(buzz_motor3);
+#else
+  (void)failed;
+#endif
+}
+
+/* ====================================== Motor Health ======================================= */
+/*!
+ * @brief   sends the motor health record over hlpuart1 when it changed, and every
+ *          HEALTH_REPORT_ROUNDS rounds otherwise
+ * @param   health      record of the round that just finished
+ * @note    HEALTH_RECORD bytes: 'H', failed mask, STATUS of motors 1 to 4, VBAT of motors
+ *          1 to 4, clock switches refused so far up to 255, round number and the sum of the
+ *          bytes before it, sent by the link task
+ */
+static void ReportHealth(const drv2605_health_t* health)
+{
+  uint8_t frame[HEALTH_RECORD] = {'H', health->failed};
+  uint32_t refused = CLOCK_GetRefused();
+  uint8_t sum = 0;
+
+  for (int motor = 0; motor < 4; motor++)
+  {
+    frame[2 + motor] = health->status[motor];
+    frame[6 + motor] = health->vbat[motor];
+  }
+  int changed = frame[1] != health_frame[1] ||
+                memcmp(&frame[2], &health_frame[2], 4) != 0;                                        // VBAT alone never counts
+  if (!changed && health->rounds % HEALTH_REPORT_ROUNDS != 0) return;
+
+  frame[10] = refused > 0xFF ? 0xFF : (uint8_t)refused;                                             // localizing at 4 MHz, see CLOCK_SetProfile
+  frame[11] = (uint8_t)health->rounds;
+  for (int i = 0; i < HEALTH_RECORD - 1; i++) sum += frame[i];
+  frame[HEALTH_RECORD - 1] = sum;
+  if (SCHED_Push(&health_queue, frame)) memcpy(health_frame, frame, sizeof(frame));                 // a dropped change is reported next round
 }
 
 #ifdef __GNUC__
@@ -60,6 +60,8 @@ static void MX_USART2_UART_Init(void);
 static void MX_I2C1_Init(void);
 static void MX_TIM2_Init(void);
 /* USER CODE BEGIN PFP */
+void ArrowHandler(uint8_t idx);
+void SecondaryArrowHandler(uint8_t idx);
 
 /* USER CODE END PFP */
 
@@ -82,13 +84,18 @@ screen_enum curScreen = HOMESCREEN;
 
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef* huart)
 {
-	uint8_t buffer[(uint16_t)((size[1] << 8) + size[0]) + 1];                                       // set buffer size
-	HAL_UART_Receive(&huart2, buffer, (uint16_t)((size[1] << 8) + size[0]), HAL_MAX_DELAY);         // fill buffer
-	buffer[(uint16_t)((size[1] << 8) + size[0])] = '\0';                                            // set last value of buffer to null terminator
+	uint16_t length = (uint16_t)((size[1] << 8) + size[0]);                                         // read before size is re-armed
+	uint8_t buffer[length + 1];                                                                     // set buffer size
+	HAL_UART_Receive(&huart2, buffer, length, HAL_MAX_DELAY);                                       // fill buffer
+	buffer[length] = '\0';                                                                          // set last value of buffer to null terminator
 	HAL_UART_Receive_IT(&huart2, size, 2);                                                          // prepare to recieve next message
 	if(curScreen != HOMESCREEN) return;                                                             // only print if on homescreen
 
-	if (buffer[0] <= 8 && buffer[0] >= 1) ArrowHandler(buffer[0]);                                  // print arrow if numeric
+	if (buffer[0] <= 8 && buffer[0] >= 1)                                                           // print arrow if numeric
+	{
+		ArrowHandler(buffer[0]);
+		if (length >= 2) SecondaryArrowHandler(buffer[1]);                                          // second source, 0 clears it
+	}
 	else if (buffer[0] >= 32 && buffer[0] <= 122) ILI9341_PrintString(&cur, (char*)buffer);         // print text otherwise
 }
 
@@ -111,6 +118,26 @@ void ArrowHandler(uint8_t idx)
 	}
 }
 
+void SecondaryArrowHandler(uint8_t idx)
+{
+	static uint16_t ARROW_BLANK[ILI9341_ARROW_BASE_WIDTH];                                          // all background pixels
+	cursor_t arrow_cur = {(ILI9341_WIDTH - ILI9341_ARROW_BASE_WIDTH)/2, 222};                       // bottom bar, between the icons and "clear"
+
+	switch ((int)(idx - 1))
+	{
+	case 0: ILI9341_PrintArr16(&arrow_cur, ILI9341_ARROW_E, ILI9341_ARROW_BASE_WIDTH, 1); break;
+	case 1: ILI9341_PrintArr16(&arrow_cur, ILI9341_ARROW_NE, ILI9341_ARROW_BASE_WIDTH, 1); break;
+	case 2: ILI9341_PrintArr16(&arrow_cur, ILI9341_ARROW_N, ILI9341_ARROW_BASE_WIDTH, 1); break;
+	case 3: ILI9341_PrintArr16(&arrow_cur, ILI9341_ARROW_NW, ILI9341_ARROW_BASE_WIDTH, 1); break;
+	case 4: ILI9341_PrintArr16(&arrow_cur, ILI9341_ARROW_W, ILI9341_ARROW_BASE_WIDTH, 1); break;
+	case 5: ILI9341_PrintArr16(&arrow_cur, ILI9341_ARROW_SW, ILI9341_ARROW_BASE_WIDTH, 1); break;
+	case 6: ILI9341_PrintArr16(&arrow_cur, ILI9341_ARROW_S, ILI9341_ARROW_BASE_WIDTH, 1); break;
+	case 7: ILI9341_PrintArr16(&arrow_cur, ILI9341_ARROW_SE, ILI9341_ARROW_BASE_WIDTH, 1); break;
+
+	default: ILI9341_PrintArr16(&arrow_cur, ARROW_BLANK, ILI9341_ARROW_BASE_WIDTH, 1); break;
+	}
+}
+
 /* ============================================================================================= */
 /* USER CODE END 0 */
 